@@ -0,0 +1,134 @@
+/*
+ * Cross-library call throughput through PLT entries. A synthetic caller
+ * library tail-calls every export of a callee library through its PLT, and
+ * is loaded with each of the loader modes that change what a PLT entry does.
+ * For each mode one JSON object per line reports ns per call and how many
+ * PLT entries were bypassed.
+ *
+ * Usage: callbench [functions=N] [calls=N]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlsearch.h>
+#include "elfgen.h"
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+
+static const struct {
+    const char* name;
+    int flags;
+} modes[] = {
+    { "got", RTLD_NOW },
+    { "bypass", RTLD_BYPASS_PLT },
+    { "lazy", RTLD_LAZYLOAD },
+    { "lazy_bypass", RTLD_LAZYLOAD | RTLD_BYPASS_PLT },
+};
+
+static char** names(const char* prefix, int count) {
+    char** list = malloc(count * sizeof(char*));
+    for (int i = 0; i < count; i++) {
+        list[i] = malloc(32);
+        snprintf(list[i], 32, "%s%d", prefix, i);
+    }
+    return list;
+}
+
+static int writeLib(const char* dir, const elfgen_lib_t* lib) {
+    size_t size;
+    void* image = elfgen_build(lib, &size);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, lib->soname);
+    FILE* file = image ? fopen(path, "wb") : NULL;
+    int ok = file && fwrite(image, size, 1, file) == 1;
+    if (file && fclose(file) != 0) {
+        ok = 0;
+    }
+    free(image);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int functions = 64;
+    long calls = 10000000;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "functions=", 10) == 0) {
+            functions = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "calls=", 6) == 0) {
+            calls = atol(argv[i] + 6);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (functions < 1 || calls < 1) {
+        fprintf(stderr, "functions and calls must be positive\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/callbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char** targets = names("f", functions);
+    char** callers = names("c", functions);
+    const char* needed[] = { "libcallee.so" };
+    elfgen_lib_t callee = {
+        ELFCLASS64, "libcallee.so", 0, NULL, functions, (const char* const*)targets,
+        0, NULL, 0, 0, 0, 0, 0, 0
+    };
+    elfgen_lib_t caller = {
+        ELFCLASS64, "libcaller.so", 1, needed, functions, (const char* const*)callers,
+        functions, (const char* const*)targets, functions, 0, 0, 0, 0, 1
+    };
+    if (!writeLib(dir, &callee) || !writeLib(dir, &caller)) {
+        fprintf(stderr, "Cannot generate libraries in %s\n", dir);
+        return 1;
+    }
+    dlsearch_addPath(dir);
+
+    int (**fn)(void) = malloc(functions * sizeof(*fn));
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        void* handle = ELF64_dlopen("libcaller.so", modes[m].flags);
+        if (!handle) {
+            fprintf(stderr, "Cannot open libcaller.so: %s\n", ELF64_dlerror());
+            return 1;
+        }
+        for (int i = 0; i < functions; i++) {
+            fn[i] = (int (*)(void))ELF64_dlsym(handle, callers[i]);
+            // Binds lazy entries and checks that calls land where they should
+            if (fn[i]() != i) {
+                fprintf(stderr, "%s calls the wrong function\n", callers[i]);
+                return 1;
+            }
+        }
+
+        uint64_t start = dlstats_now();
+        long sum = 0;
+        for (long i = 0; i < calls; i++) {
+            sum += fn[i % functions]();
+        }
+        uint64_t elapsed = dlstats_now() - start;
+
+        dl_stats_t stats;
+        ELF64_dlinfo(handle, RTLD_DI_STATS, &stats);
+        printf("{\"bench\":\"call\",\"mode\":\"%s\",\"functions\":%d,\"calls\":%ld,\"ns_per_call\":%.2f,"
+               "\"plt_bypassed\":%llu,\"checksum\":%ld}\n",
+               modes[m].name, functions, calls, (double)elapsed / calls,
+               (unsigned long long)stats.pltBypassed, sum);
+        ELF64_dlclose(handle);
+    }
+    free(fn);
+    return 0;
+}
+#else
+int main(void) {
+    fprintf(stderr, "PLT entries are only bypassed on x86-64\n");
+    return 1;
+}
+#endif
@@ -0,0 +1,251 @@
+/*
+ * End-to-end loader benchmark. Generates a tree of synthetic libraries with
+ * elfgen, then measures dlopen, dlclose, and dlsym hits and misses. Each
+ * measurement is written to stdout as one JSON object per line.
+ *
+ * Usage: dlbench [key=value...], see `params` below for the keys.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlsearch.h>
+#include "elfgen.h"
+
+/* The loader matching the host word size is benchmarked */
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+#define BENCH_CLASS ELFCLASS64
+#define bench_dlopen ELF64_dlopen
+#define bench_dlsym ELF64_dlsym
+#define bench_dlclose ELF64_dlclose
+#define bench_dlstats ELF64_dlstats
+#define bench_dlerror ELF64_dlerror
+#define bench_addGlobalSymbol ELF64_addGlobalSymbol
+#else
+#include <elf/elf32_dl.h>
+#define BENCH_CLASS ELFCLASS32
+#define bench_dlopen ELF32_dlopen
+#define bench_dlsym ELF32_dlsym
+#define bench_dlclose ELF32_dlclose
+#define bench_dlstats ELF32_dlstats
+#define bench_dlerror ELF32_dlerror
+#define bench_addGlobalSymbol ELF32_addGlobalSymbol
+#endif
+
+static elfgen_params_t params = {
+    BENCH_CLASS,
+    256,    /* exports */
+    64,     /* imports */
+    1024,   /* relocations */
+    60,     /* relativePercent */
+    20,     /* globDatPercent */
+    2,      /* fanout */
+    2,      /* depth */
+    32,     /* nameLength */
+    16384,  /* dataSize */
+    65536   /* bssSize */
+};
+
+static int iterations = 50;
+static int lookups = 10000;
+static const char* label = "default";
+static int libs = 0;
+
+static int hostFunction(void) {
+    return -1;
+}
+
+static int compareU64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* metric, uint64_t* samples, int count) {
+    qsort(samples, count, sizeof(uint64_t), compareU64);
+    uint64_t sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    printf("{\"bench\":\"%s\",\"metric\":\"%s\",\"class\":%d,\"libs\":%d,\"exports\":%d,\"imports\":%d,"
+        "\"relocations\":%d,\"samples\":%d,\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,"
+        "\"max\":%llu,\"mean\":%llu}\n",
+        label, metric, params.elfClass == ELFCLASS64 ? 64 : 32,
+        libs, params.exports, params.imports, params.relocations, count,
+        (unsigned long long)samples[0],
+        (unsigned long long)samples[count / 2],
+        (unsigned long long)samples[count * 9 / 10],
+        (unsigned long long)samples[count * 99 / 100],
+        (unsigned long long)samples[count - 1],
+        (unsigned long long)(sum / count));
+}
+
+static uint64_t residentBytes(void) {
+    unsigned long size, resident;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static bool parseArg(const char* arg) {
+    static const struct {
+        const char* key;
+        int* value;
+    } intParams[] = {
+        { "exports", &params.exports },
+        { "imports", &params.imports },
+        { "relocations", &params.relocations },
+        { "relative", &params.relativePercent },
+        { "globdat", &params.globDatPercent },
+        { "fanout", &params.fanout },
+        { "depth", &params.depth },
+        { "namelen", &params.nameLength },
+        { "iterations", &iterations },
+        { "lookups", &lookups },
+    };
+
+    const char* eq = strchr(arg, '=');
+    if (!eq) {
+        return false;
+    }
+    size_t keyLen = eq - arg;
+    const char* value = eq + 1;
+    for (size_t i = 0; i < sizeof(intParams) / sizeof(intParams[0]); i++) {
+        if (strlen(intParams[i].key) == keyLen && strncmp(arg, intParams[i].key, keyLen) == 0) {
+            *intParams[i].value = atoi(value);
+            return true;
+        }
+    }
+    if (keyLen == 4 && strncmp(arg, "data", 4) == 0) {
+        params.dataSize = strtoul(value, NULL, 0);
+    } else if (keyLen == 3 && strncmp(arg, "bss", 3) == 0) {
+        params.bssSize = strtoul(value, NULL, 0);
+    } else if (keyLen == 5 && strncmp(arg, "label", 5) == 0) {
+        label = value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!parseArg(argv[i])) {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (iterations < 1 || lookups < 1) {
+        fprintf(stderr, "iterations and lookups must be positive\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/dlbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    libs = elfgen_writeTree(dir, &params);
+    if (libs < 0) {
+        fprintf(stderr, "Cannot generate libraries in %s\n", dir);
+        return 1;
+    }
+    dlsearch_addPath(dir);
+
+    // Leaves import host_<k>
+    char** hostNames = malloc((params.imports + 1) * sizeof(char*));
+    for (int i = 0; i < params.imports; i++) {
+        hostNames[i] = malloc(16);
+        snprintf(hostNames[i], 16, "host_%d", i);
+        bench_addGlobalSymbol(hostNames[i], (void*)hostFunction);
+    }
+
+    uint64_t* openNs = malloc(iterations * sizeof(uint64_t));
+    uint64_t* closeNs = malloc(iterations * sizeof(uint64_t));
+    uint64_t* hitNs = malloc(lookups * sizeof(uint64_t));
+    uint64_t* missNs = malloc(lookups * sizeof(uint64_t));
+    uint64_t rssBefore = residentBytes();
+    uint64_t loaderMemory = 0;
+    uint64_t rssLoaded = 0;
+    int status = 0;
+
+    char name[1024];
+    for (int i = 0; i < iterations && !status; i++) {
+        uint64_t start = dlstats_now();
+        void* handle = bench_dlopen("lib0.so", RTLD_NOW);
+        openNs[i] = dlstats_now() - start;
+        if (!handle) {
+            fprintf(stderr, "Cannot open lib0.so: %s\n", bench_dlerror());
+            status = 1;
+            break;
+        }
+
+        if (i == 0) {
+            dl_stats_t stats;
+            bench_dlstats(&stats);
+            loaderMemory = stats.memory;
+            rssLoaded = residentBytes();
+
+            // Exported functions return their index
+            for (int j = 0; j < params.exports; j++) {
+                int (*fn)(void) = (int (*)(void))bench_dlsym(handle,
+                    elfgen_exportName(&params, 0, j, name, sizeof(name)));
+                if (!fn || fn() != j) {
+                    fprintf(stderr, "Bad export %s\n", name);
+                    status = 1;
+                    break;
+                }
+            }
+
+            for (int j = 0; j < lookups && params.exports; j++) {
+                elfgen_exportName(&params, 0, j % params.exports, name, sizeof(name));
+                uint64_t lookup = dlstats_now();
+                bench_dlsym(handle, name);
+                hitNs[j] = dlstats_now() - lookup;
+            }
+            for (int j = 0; j < lookups; j++) {
+                elfgen_exportName(&params, libs, j, name, sizeof(name));
+                uint64_t lookup = dlstats_now();
+                if (bench_dlsym(handle, name)) {
+                    fprintf(stderr, "Unexpected hit %s\n", name);
+                    status = 1;
+                }
+                missNs[j] = dlstats_now() - lookup;
+            }
+        }
+
+        start = dlstats_now();
+        bench_dlclose(handle);
+        closeNs[i] = dlstats_now() - start;
+    }
+
+    if (!status) {
+        report("dlopen_ns", openNs, iterations);
+        report("dlclose_ns", closeNs, iterations);
+        if (params.exports) {
+            report("dlsym_hit_ns", hitNs, lookups);
+        }
+        report("dlsym_miss_ns", missNs, lookups);
+        printf("{\"bench\":\"%s\",\"metric\":\"memory\",\"libs\":%d,\"loader_bytes\":%llu,\"rss_delta_bytes\":%llu}\n",
+            label, libs, (unsigned long long)loaderMemory,
+            (unsigned long long)(rssLoaded > rssBefore ? rssLoaded - rssBefore : 0));
+    }
+
+    for (int i = 0; i < libs; i++) {
+        snprintf(name, sizeof(name), "%s/lib%d.so", dir, i);
+        remove(name);
+    }
+    rmdir(dir);
+    return status;
+}
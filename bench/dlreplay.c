@@ -0,0 +1,310 @@
+/*
+ * Replay a trace written by the loader when ELF_DL_RECORD is set (see
+ * elf/dlrecord.h) against a directory of libraries, and report latency
+ * percentiles per call next to the recorded ones as JSON lines.
+ *
+ * Usage: dlreplay <trace> <libdir> [iterations]
+ *
+ * Every iteration replays the whole trace and then closes the handles the
+ * trace left open, so that iterations start from the same state.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <elf/dlrecord.h>
+#include <elf/dlsearch.h>
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+#define replay_dlopen ELF64_dlopen
+#define replay_dlsym ELF64_dlsym
+#define replay_dlclose ELF64_dlclose
+#define replay_dlerror ELF64_dlerror
+#define replay_addGlobalSymbol ELF64_addGlobalSymbol
+#else
+#include <elf/elf32_dl.h>
+#define replay_dlopen ELF32_dlopen
+#define replay_dlsym ELF32_dlsym
+#define replay_dlclose ELF32_dlclose
+#define replay_dlerror ELF32_dlerror
+#define replay_addGlobalSymbol ELF32_addGlobalSymbol
+#endif
+
+typedef struct {
+    int op;
+    uint64_t duration;
+    size_t name;
+    size_t handle;
+    uint64_t arg;       /* Flags of OPEN, found of SYM */
+} call_t;
+
+typedef struct {
+    uint64_t* samples;
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+static const char* opNames[] = { "string", "dlopen", "dlsym", "dlclose", "global" };
+
+static char** strings = NULL;
+static size_t stringCount = 0;
+static call_t* calls = NULL;
+static size_t callCount = 0;
+
+static int hostFunction(void) {
+    return -1;
+}
+
+static bool readVarint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool readSize(const unsigned char** p, const unsigned char* end, size_t* value) {
+    uint64_t v;
+    if (!readVarint(p, end, &v)) {
+        return false;
+    }
+    *value = (size_t)v;
+    return true;
+}
+
+static bool parseTrace(const unsigned char* p, const unsigned char* end) {
+    size_t stringCapacity = 0, callCapacity = 0;
+    uint64_t delta;
+    while (p < end) {
+        int op = *p++;
+        if (op == DLRECORD_STRING) {
+            size_t len;
+            if (!readSize(&p, end, &len) || len > (size_t)(end - p)) {
+                return false;
+            }
+            if (stringCount == stringCapacity) {
+                stringCapacity = stringCapacity ? stringCapacity * 2 : 256;
+                char** grown = realloc(strings, stringCapacity * sizeof(char*));
+                if (!grown) {
+                    return false;
+                }
+                strings = grown;
+            }
+            char* str = malloc(len + 1);
+            if (!str) {
+                return false;
+            }
+            memcpy(str, p, len);
+            str[len] = 0;
+            strings[stringCount++] = str;
+            p += len;
+            continue;
+        }
+
+        if (callCount == callCapacity) {
+            callCapacity = callCapacity ? callCapacity * 2 : 1024;
+            call_t* grown = realloc(calls, callCapacity * sizeof(call_t));
+            if (!grown) {
+                return false;
+            }
+            calls = grown;
+        }
+        call_t* call = &calls[callCount];
+        memset(call, 0, sizeof(call_t));
+        call->op = op;
+        bool ok = readVarint(&p, end, &delta);
+        switch (op) {
+            case DLRECORD_OPEN:
+                ok = ok && readVarint(&p, end, &call->duration) && readSize(&p, end, &call->name) &&
+                    readVarint(&p, end, &call->arg) && readSize(&p, end, &call->handle);
+                break;
+            case DLRECORD_SYM:
+                ok = ok && readVarint(&p, end, &call->duration) && readSize(&p, end, &call->handle) &&
+                    readSize(&p, end, &call->name) && readVarint(&p, end, &call->arg);
+                break;
+            case DLRECORD_CLOSE:
+                ok = ok && readVarint(&p, end, &call->duration) && readSize(&p, end, &call->handle);
+                break;
+            case DLRECORD_GLOBAL:
+                ok = ok && readSize(&p, end, &call->name);
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok || (op != DLRECORD_CLOSE && call->name >= stringCount)) {
+            return false;
+        }
+        callCount++;
+    }
+    return true;
+}
+
+static void addSample(samples_t* samples, uint64_t value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        uint64_t* grown = realloc(samples->samples, capacity * sizeof(uint64_t));
+        if (!grown) {
+            return;
+        }
+        samples->samples = grown;
+        samples->capacity = capacity;
+    }
+    samples->samples[samples->count++] = value;
+}
+
+static int compareU64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* metric, const char* source, samples_t* samples) {
+    if (!samples->count) {
+        return;
+    }
+    size_t count = samples->count;
+    uint64_t* s = samples->samples;
+    qsort(s, count, sizeof(uint64_t), compareU64);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += s[i];
+    }
+    printf("{\"bench\":\"replay\",\"metric\":\"%s\",\"source\":\"%s\",\"samples\":%llu,\"min\":%llu,"
+        "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu,\"mean\":%llu}\n",
+        metric, source, (unsigned long long)count,
+        (unsigned long long)s[0],
+        (unsigned long long)s[count / 2],
+        (unsigned long long)s[count * 9 / 10],
+        (unsigned long long)s[count * 99 / 100],
+        (unsigned long long)s[count - 1],
+        (unsigned long long)(sum / count));
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <trace> <libdir> [iterations]\n", argv[0]);
+        return 1;
+    }
+    int iterations = argc > 3 ? atoi(argv[3]) : 1;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* trace = size > 0 ? malloc(size) : NULL;
+    if (!trace || fread(trace, size, 1, file) != 1) {
+        fprintf(stderr, "Cannot read %s\n", argv[1]);
+        return 1;
+    }
+    fclose(file);
+    if ((size_t)size < sizeof(DLRECORD_MAGIC) || memcmp(trace, DLRECORD_MAGIC, sizeof(DLRECORD_MAGIC)) != 0 ||
+            !parseTrace(trace + sizeof(DLRECORD_MAGIC), trace + size)) {
+        fprintf(stderr, "Malformed trace %s\n", argv[1]);
+        return 1;
+    }
+    free(trace);
+
+    size_t handleCount = 1;
+    for (size_t i = 0; i < callCount; i++) {
+        if (calls[i].handle >= handleCount) {
+            handleCount = calls[i].handle + 1;
+        }
+    }
+    void** handles = calloc(handleCount, sizeof(void*));
+    size_t* opens = calloc(handleCount, sizeof(size_t));
+    if (!handles || !opens) {
+        return 1;
+    }
+
+    dlsearch_addPath(argv[2]);
+
+    samples_t replayed[DLRECORD_GLOBAL + 1] = {{0}};
+    samples_t recorded[DLRECORD_GLOBAL + 1] = {{0}};
+    size_t skipped = 0, mismatches = 0;
+    for (size_t i = 0; i < callCount; i++) {
+        if (calls[i].op != DLRECORD_GLOBAL) {
+            addSample(&recorded[calls[i].op], calls[i].duration);
+        }
+    }
+
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        for (size_t i = 0; i < callCount; i++) {
+            call_t* call = &calls[i];
+            uint64_t start = dlstats_now();
+            switch (call->op) {
+                case DLRECORD_OPEN: {
+                    void* handle = replay_dlopen(strings[call->name], (int)call->arg);
+                    addSample(&replayed[call->op], dlstats_now() - start);
+                    if (!handle != !call->handle) {
+                        mismatches++;
+                        if (!handle && iteration == 0) {
+                            fprintf(stderr, "Cannot open %s: %s\n", strings[call->name], replay_dlerror());
+                        }
+                    }
+                    // A handle id can only be rebound once it was closed
+                    if (handle && call->handle) {
+                        handles[call->handle] = handle;
+                        opens[call->handle]++;
+                    } else if (handle) {
+                        replay_dlclose(handle);
+                    }
+                    break;
+                }
+                case DLRECORD_SYM: {
+                    void* handle = handles[call->handle];
+                    if (!handle || !opens[call->handle]) {
+                        skipped++;
+                        break;
+                    }
+                    void* symbol = replay_dlsym(handle, strings[call->name]);
+                    addSample(&replayed[call->op], dlstats_now() - start);
+                    if (!symbol != !call->arg) {
+                        mismatches++;
+                    }
+                    break;
+                }
+                case DLRECORD_CLOSE:
+                    if (!handles[call->handle] || !opens[call->handle]) {
+                        skipped++;
+                        break;
+                    }
+                    replay_dlclose(handles[call->handle]);
+                    addSample(&replayed[call->op], dlstats_now() - start);
+                    opens[call->handle]--;
+                    break;
+                case DLRECORD_GLOBAL:
+                    replay_addGlobalSymbol(strings[call->name], (void*)hostFunction);
+                    break;
+            }
+        }
+
+        for (size_t i = 1; i < handleCount; i++) {
+            for (; opens[i]; opens[i]--) {
+                replay_dlclose(handles[i]);
+            }
+            handles[i] = NULL;
+        }
+    }
+
+    for (int op = DLRECORD_OPEN; op <= DLRECORD_CLOSE; op++) {
+        report(opNames[op], "recorded", &recorded[op]);
+        report(opNames[op], "replayed", &replayed[op]);
+    }
+    printf("{\"bench\":\"replay\",\"metric\":\"summary\",\"calls\":%llu,\"iterations\":%d,\"skipped\":%llu,\"mismatches\":%llu}\n",
+        (unsigned long long)callCount, iterations, (unsigned long long)skipped, (unsigned long long)mismatches);
+    return 0;
+}
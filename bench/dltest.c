@@ -0,0 +1,555 @@
+/*
+ * Functional checks of the 64-bit loader on synthetic libraries: handles
+ * shared by name, path, symlink and DT_SONAME, RTLD_NOLOAD and RTLD_NODELETE,
+ * reviving a closed library from the cache, dladdr, the load and unload
+ * counts of iterate_phdr, symbol counts, loading from memory and from a
+ * packed container, the search cache giving way to
+ * ELF_LIBRARY_PATH and vector arguments passed through a lazily bound PLT
+ * entry. One JSON object per line
+ * reports each check, failures are detailed on stderr and make the exit
+ * status non-zero.
+ *
+ * Usage: dltest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlsearch.h>
+#include <elf/dlpack.h>
+#include "elfgen.h"
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+#include <util/cpu.h>
+
+#if defined(__x86_64__) && !defined(_MSC_VER)
+#include <immintrin.h>
+#define DLTEST_VECTOR
+#endif
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+static const char* const exports[] = { "f0", "f1", "f2" };
+
+static char dir[] = "/tmp/dltest.XXXXXX";
+
+static elfgen_lib_t testLib(const char* soname) {
+    elfgen_lib_t lib = {
+        .elfClass = ELFCLASS64,
+        .soname = soname,
+        .exportCount = 3,
+        .exports = exports,
+        .relocations = 16,
+        .relativePercent = 100,
+        .dataSize = 4096,
+    };
+    return lib;
+}
+
+/* Write size bytes of image, which may be NULL, to dir/file and free it */
+static bool writeFile(const char* file, void* image, size_t size) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE* out = image ? fopen(path, "wb") : NULL;
+    bool ok = out && fwrite(image, size, 1, out) == 1;
+    if (out && fclose(out) != 0) {
+        ok = false;
+    }
+    free(image);
+    return ok;
+}
+
+static bool writeImage(const char* file, const elfgen_lib_t* lib) {
+    size_t size;
+    void* image = elfgen_build(lib, &size);
+    return writeFile(file, image, size);
+}
+
+/* Dynamic symbol table of a generated image, to patch before writing it */
+static Elf64_Sym* dynamicSymbols(char* image) {
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*)image;
+    Elf64_Phdr* phdr = (Elf64_Phdr*)(image + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_DYNAMIC) {
+            continue;
+        }
+        for (Elf64_Dyn* dyn = (Elf64_Dyn*)(image + phdr[i].p_offset); dyn->d_tag != DT_NULL; dyn++) {
+            if (dyn->d_tag == DT_SYMTAB) {
+                return (Elf64_Sym*)(image + dyn->d_un.d_ptr);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Write a library with the given DT_SONAME to dir/file */
+static bool writeLib(const char* file, const char* soname) {
+    elfgen_lib_t lib = testLib(soname);
+    return writeImage(file, &lib);
+}
+
+static int call(void* handle, const char* name) {
+    int (*fn)(void) = (int (*)(void))ELF64_dlsym(handle, name);
+    return fn ? fn() : -1;
+}
+
+typedef struct {
+    const char* name;
+    char* start;
+    size_t size;
+    unsigned long long adds;
+    unsigned long long subs;
+    bool found;
+} walk_t;
+
+/*
+ * Find the writable segment of the library named walk->name, if loaded. A
+ * NULL name walks every image, for the counts only.
+ */
+static int walkImages(elf64_phdr_info_t* info, size_t size, void* data) {
+    (void)size;
+    walk_t* walk = data;
+    walk->adds = info->dlpi_adds;
+    walk->subs = info->dlpi_subs;
+    if (!walk->name || !info->dlpi_name || !strstr(info->dlpi_name, walk->name)) {
+        return 0;
+    }
+    walk->found = true;
+    for (uint16_t i = 0; i < info->dlpi_phnum; i++) {
+        const Elf64_Phdr* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_W)) {
+            walk->start = (char*)info->dlpi_addr + phdr->p_vaddr;
+            walk->size = (size_t)phdr->p_memsz;
+        }
+    }
+    return 1;
+}
+
+static walk_t walkFor(const char* name) {
+    walk_t walk = { .name = name };
+    ELF64_iterate_phdr(walkImages, &walk);
+    return walk;
+}
+
+/* Name, absolute path, symlink and DT_SONAME all lead to one handle */
+static bool testDedup(void) {
+    CHECK(writeLib("libdup.so", "libdup.so"));
+    CHECK(writeLib("libfile.so", "libsoname.so"));
+    char path[1024];
+    char link[1024];
+    snprintf(path, sizeof(path), "%s/libdup.so", dir);
+    snprintf(link, sizeof(link), "%s/liblink.so", dir);
+    CHECK(symlink(path, link) == 0);
+
+    void* byName = ELF64_dlopen("libdup.so", RTLD_NOW);
+    CHECK(byName && call(byName, "f1") == 1);
+    void* byPath = ELF64_dlopen(path, RTLD_NOW);
+    void* byLink = ELF64_dlopen("liblink.so", RTLD_NOW);
+    CHECK(byPath == byName && byLink == byName);
+
+    void* file = ELF64_dlopen("libfile.so", RTLD_NOW);
+    void* soname = ELF64_dlopen("libsoname.so", RTLD_NOW);
+    CHECK(file && soname == file);
+
+    ELF64_dlclose(soname);
+    ELF64_dlclose(file);
+    ELF64_dlclose(byLink);
+    ELF64_dlclose(byPath);
+    ELF64_dlclose(byName);
+    CHECK(!ELF64_dlopen("libdup.so", RTLD_NOLOAD));
+    remove(link);
+    return true;
+}
+
+static bool testNoload(void) {
+    CHECK(writeLib("libnoload.so", "libnoload.so"));
+    CHECK(!ELF64_dlopen("libnoload.so", RTLD_NOLOAD));
+    CHECK(!walkFor("libnoload.so").found);
+
+    void* handle = ELF64_dlopen("libnoload.so", RTLD_NOW);
+    CHECK(handle);
+    void* again = ELF64_dlopen("libnoload.so", RTLD_NOLOAD);
+    CHECK(again == handle);
+    ELF64_dlclose(again);
+    ELF64_dlclose(handle);
+    CHECK(!ELF64_dlopen("libnoload.so", RTLD_NOLOAD));
+    return true;
+}
+
+/* Closing every reference to a RTLD_NODELETE library keeps it loaded */
+static bool testNodelete(void) {
+    CHECK(writeLib("libnodelete.so", "libnodelete.so"));
+    void* handle = ELF64_dlopen("libnodelete.so", RTLD_NOW | RTLD_NODELETE);
+    CHECK(handle);
+    ELF64_dlclose(handle);
+    void* again = ELF64_dlopen("libnodelete.so", RTLD_NOLOAD);
+    CHECK(again == handle && call(again, "f2") == 2);
+    ELF64_dlclose(again);
+    CHECK(walkFor("libnodelete.so").found);
+    return true;
+}
+
+/* A cached library comes back with its data as it was after relocation */
+static bool testCache(void) {
+    CHECK(writeLib("libcached.so", "libcached.so"));
+    ELF64_dlcache(16 << 20);
+    void* handle = ELF64_dlopen("libcached.so", RTLD_NOW);
+    CHECK(handle);
+    walk_t walk = walkFor("libcached.so");
+    CHECK(walk.found && walk.start && walk.size);
+    char before = walk.start[0];
+    walk.start[0] = (char)~before;
+    ELF64_dlclose(handle);
+
+    // Parked, so neither loaded nor found by RTLD_NOLOAD
+    CHECK(!walkFor("libcached.so").found);
+    CHECK(!ELF64_dlopen("libcached.so", RTLD_NOLOAD));
+    dl_stats_t stats;
+    ELF64_dlstats(&stats);
+    uint64_t loads = stats.loads;
+
+    void* revived = ELF64_dlopen("libcached.so", RTLD_NOW);
+    CHECK(revived == handle);
+    ELF64_dlstats(&stats);
+    CHECK(stats.loads == loads);
+    walk = walkFor("libcached.so");
+    CHECK(walk.found && walk.start[0] == before && call(revived, "f0") == 0);
+    ELF64_dlclose(revived);
+    ELF64_dlcache(0);
+    return true;
+}
+
+static bool testDladdr(void) {
+    CHECK(writeLib("libaddr.so", "libaddr.so"));
+    void* handle = ELF64_dlopen("libaddr.so", RTLD_NOW);
+    CHECK(handle);
+    void* f1 = ELF64_dlsym(handle, "f1");
+    CHECK(f1);
+
+    dl_info_t info;
+    CHECK(ELF64_dladdr(f1, &info));
+    CHECK(info.dli_fname && strstr(info.dli_fname, "libaddr.so"));
+    CHECK(info.dli_sname && strcmp(info.dli_sname, "f1") == 0);
+    CHECK(info.dli_saddr == f1 && (char*)info.dli_fbase <= (char*)f1);
+    CHECK(ELF64_dladdr((char*)f1 + 1, &info) && info.dli_saddr == f1);
+    CHECK(!ELF64_dladdr(&info, &info));
+
+    ELF64_dlclose(handle);
+    CHECK(!ELF64_dladdr(f1, &info));
+
+    // Symbols without a size, at the start of f1 and inside it, leave the
+    // whole of f1 to it
+    elfgen_lib_t lib = testLib("libalias.so");
+    size_t size;
+    char* image = elfgen_build(&lib, &size);
+    CHECK(image);
+    Elf64_Sym* symtab = dynamicSymbols(image);
+    CHECK(symtab);
+    symtab[1].st_value = symtab[2].st_value;
+    symtab[1].st_size = 0;
+    symtab[3].st_value = symtab[2].st_value + 2;
+    symtab[3].st_size = 0;
+    CHECK(writeFile("libalias.so", image, size));
+    handle = ELF64_dlopen("libalias.so", RTLD_NOW);
+    CHECK(handle);
+    f1 = ELF64_dlsym(handle, "f1");
+    CHECK(f1 && ELF64_dladdr(f1, &info) && info.dli_sname && strcmp(info.dli_sname, "f1") == 0);
+    CHECK(ELF64_dladdr((char*)f1 + 3, &info) && info.dli_saddr == f1);
+    ELF64_dlclose(handle);
+    return true;
+}
+
+/* Opening adds one image, closing subtracts it */
+static bool testPhdrCounts(void) {
+    CHECK(writeLib("libcount.so", "libcount.so"));
+    walk_t before = walkFor(NULL);
+    void* handle = ELF64_dlopen("libcount.so", RTLD_NOW);
+    CHECK(handle);
+    walk_t loaded = walkFor("libcount.so");
+    CHECK(loaded.found);
+    CHECK(loaded.adds == before.adds + 1 && loaded.subs == before.subs);
+
+    void* again = ELF64_dlopen("libcount.so", RTLD_NOW);
+    walk_t same = walkFor(NULL);
+    CHECK(same.adds == loaded.adds && same.subs == loaded.subs);
+    ELF64_dlclose(again);
+    ELF64_dlclose(handle);
+    walk_t closed = walkFor("libcount.so");
+    CHECK(!closed.found);
+    CHECK(closed.adds == loaded.adds && closed.subs == loaded.subs + 1);
+    return true;
+}
+
+/* Imports are resolved through the export map, but only count as imports */
+static bool testSymbolCounts(void) {
+    static const char* const callers[] = { "c0" };
+    static const char* const needed[] = { "libimported.so" };
+    elfgen_lib_t callee = testLib("libimported.so");
+    elfgen_lib_t caller = {
+        .elfClass = ELFCLASS64,
+        .soname = "libimporter.so",
+        .neededCount = 1,
+        .needed = needed,
+        .exportCount = 1,
+        .exports = callers,
+        .importCount = 3,
+        .imports = exports,
+        .relocations = 3,
+    };
+    CHECK(writeImage("libimported.so", &callee) && writeImage("libimporter.so", &caller));
+    void* handle = ELF64_dlopen("libimporter.so", RTLD_NOW);
+    CHECK(handle);
+    dl_stats_t stats;
+    CHECK(ELF64_dlinfo(handle, RTLD_DI_STATS, &stats) == 0);
+    CHECK(stats.symbolsExported == 1 && stats.symbolsImported == 3);
+    ELF64_dlclose(handle);
+    return true;
+}
+
+/* An import typed as IFUNC is bound to the implementation, not called as a resolver */
+static bool testIfuncImport(void) {
+    static const char* const callers[] = { "c0", "c1" };
+    static const char* const needed[] = { "libicallee.so" };
+    elfgen_lib_t callee = testLib("libicallee.so");
+    elfgen_lib_t caller = {
+        .elfClass = ELFCLASS64,
+        .soname = "libicaller.so",
+        .neededCount = 1,
+        .needed = needed,
+        .exportCount = 2,
+        .exports = callers,
+        .importCount = 1,
+        .imports = exports + 1,
+        .relocations = 1,
+    };
+    size_t size;
+    char* image = elfgen_build(&caller, &size);
+    CHECK(image);
+    // c1, whose resolver returns 1, and the import of f1 become IFUNCs
+    Elf64_Sym* symtab = dynamicSymbols(image);
+    CHECK(symtab);
+    symtab[2].st_info = STB_GLOBAL << 4 | STT_GNU_IFUNC;
+    symtab[3].st_info = STB_GLOBAL << 4 | STT_GNU_IFUNC;
+    CHECK(writeFile("libicaller.so", image, size) && writeImage("libicallee.so", &callee));
+    void* handle = ELF64_dlopen("libicaller.so", RTLD_NOW);
+    void* target = handle ? ELF64_dlopen("libicallee.so", RTLD_NOLOAD) : NULL;
+    CHECK(target);
+    void* f1 = ELF64_dlsym(target, "f1");
+    CHECK(f1 && ELF64_dlsym(handle, "f1") == f1 && ELF64_dlsym(handle, "c1") == (void*)1);
+    ELF64_dlclose(target);
+    ELF64_dlclose(handle);
+    return true;
+}
+
+/* The buffer is only read during the call */
+static bool testMemory(void) {
+    elfgen_lib_t lib = testLib("libmem.so");
+    size_t size;
+    char* image = elfgen_build(&lib, &size);
+    CHECK(image);
+    void* handle = ELF64_dlopen_mem(image, size, "libmem.so", RTLD_NOW);
+    memset(image, 0, size);
+    free(image);
+    CHECK(handle && call(handle, "f2") == 2);
+    void* again = ELF64_dlopen("libmem.so", RTLD_NOLOAD);
+    CHECK(again == handle);
+    ELF64_dlclose(again);
+
+    dl_info_t info;
+    void* f0 = ELF64_dlsym(handle, "f0");
+    CHECK(ELF64_dladdr(f0, &info) && strcmp(info.dli_sname, "f0") == 0);
+
+    // A truncated image is refused
+    image = elfgen_build(&lib, &size);
+    CHECK(image);
+    CHECK(!ELF64_dlopen_mem(image, size / 2, "libhalf.so", RTLD_NOW));
+    free(image);
+    ELF64_dlclose(handle);
+    CHECK(!ELF64_dlopen("libmem.so", RTLD_NOLOAD));
+    return true;
+}
+
+/* A packed library loads with the same contents as the plain one */
+static bool testPacked(void) {
+    elfgen_lib_t lib = testLib("libpacked.so");
+    lib.dataSize = 3 * DLPACK_BLOCK / 2;
+    size_t size;
+    char* image = elfgen_build(&lib, &size);
+    CHECK(image);
+    // Half of the data compresses, the other half is stored as is
+    uint32_t seed = 1;
+    for (size_t i = size - lib.dataSize / 2; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = (char)(seed >> 16);
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/libpacked.so", dir);
+    FILE* out = fopen(path, "wb");
+    bool written = out && dlpack_write(image, size, out);
+    if (out && fclose(out) != 0) {
+        written = false;
+    }
+    if (!written) {
+        free(image);
+        CHECK(written);
+    }
+
+    void* handle = ELF64_dlopen("libpacked.so", RTLD_NOW);
+    walk_t walk = walkFor("libpacked.so");
+    bool same = walk.found && walk.size >= lib.dataSize &&
+        memcmp(walk.start + walk.size - lib.dataSize, image + size - lib.dataSize, lib.dataSize) == 0;
+    free(image);
+    CHECK(handle && call(handle, "f2") == 2);
+    CHECK(same);
+    ELF64_dlclose(handle);
+    return true;
+}
+
+/* A library found in the fallback search is cached, but ELF_LIBRARY_PATH wins */
+static bool testSearchEnv(void) {
+    static const char* const envExports[] = { "e0" };
+    CHECK(writeLib("libenv.so", "libenv.so"));
+    void* handle = ELF64_dlopen("libenv.so", RTLD_NOW);
+    CHECK(handle && ELF64_dlsym(handle, "f0"));
+    ELF64_dlclose(handle);
+
+    char envDir[1024];
+    snprintf(envDir, sizeof(envDir), "%s/env", dir);
+    CHECK(mkdir(envDir, 0700) == 0);
+    elfgen_lib_t lib = testLib("libenv.so");
+    lib.exportCount = 1;
+    lib.exports = envExports;
+    CHECK(writeImage("env/libenv.so", &lib));
+    setenv(DLSEARCH_ENV, envDir, 1);
+    handle = ELF64_dlopen("libenv.so", RTLD_NOW);
+    unsetenv(DLSEARCH_ENV);
+    CHECK(handle && ELF64_dlsym(handle, "e0"));
+    ELF64_dlclose(handle);
+
+    handle = ELF64_dlopen("libenv.so", RTLD_NOW);
+    CHECK(handle && ELF64_dlsym(handle, "f0"));
+    ELF64_dlclose(handle);
+    return true;
+}
+
+#ifdef DLTEST_VECTOR
+/*
+ * Call fn with a 256-bit vector in ymm0 and check that it comes back intact.
+ * The synthetic exports only write eax, so a callee returns its argument.
+ */
+__attribute__((target("avx"))) static bool vectorIntact(void* fn) {
+    __m256 in = _mm256_setr_ps(1, 2, 3, 4, 5, 6, 7, 8);
+    __m256 out = ((__m256 (*)(__m256))fn)(in);
+    float lanes[8];
+    _mm256_storeu_ps(lanes, out);
+    for (int i = 0; i < 8; i++) {
+        if (lanes[i] != i + 1) {
+            fprintf(stderr, "lane %d is %g after lazy binding\n", i, lanes[i]);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/* The first call through a lazily bound PLT entry keeps ymm arguments */
+static bool testLazyVector(void) {
+#ifdef DLTEST_VECTOR
+    if (!cpu_has(CPU_AVX)) {
+        return true;
+    }
+    static const char* const callers[] = { "c0" };
+    static const char* const needed[] = { "libvcallee.so" };
+    elfgen_lib_t callee = testLib("libvcallee.so");
+    elfgen_lib_t caller = {
+        .elfClass = ELFCLASS64,
+        .soname = "libvcaller.so",
+        .neededCount = 1,
+        .needed = needed,
+        .exportCount = 1,
+        .exports = callers,
+        .importCount = 1,
+        .imports = exports,
+        .relocations = 1,
+        .plt = 1,
+    };
+    CHECK(writeImage("libvcallee.so", &callee) && writeImage("libvcaller.so", &caller));
+    void* handle = ELF64_dlopen("libvcaller.so", RTLD_LAZYLOAD);
+    CHECK(handle);
+    void* c0 = ELF64_dlsym(handle, "c0");
+    CHECK(c0 && vectorIntact(c0) && vectorIntact(c0));
+    ELF64_dlclose(handle);
+#endif
+    return true;
+}
+
+static const struct {
+    const char* name;
+    bool (*run)(void);
+    const char* file;
+} tests[] = {
+    { "dedup", testDedup, "libdup.so libfile.so" },
+    { "noload", testNoload, "libnoload.so" },
+    { "nodelete", testNodelete, "libnodelete.so" },
+    { "cache", testCache, "libcached.so" },
+    { "dladdr", testDladdr, "libaddr.so libalias.so" },
+    { "phdr_counts", testPhdrCounts, "libcount.so" },
+    { "symbol_counts", testSymbolCounts, "libimported.so libimporter.so" },
+    { "ifunc_import", testIfuncImport, "libicallee.so libicaller.so" },
+    { "memory", testMemory, NULL },
+    { "packed", testPacked, "libpacked.so" },
+    { "search_env", testSearchEnv, "env/libenv.so env libenv.so" },
+    { "lazy_vector", testLazyVector, "libvcallee.so libvcaller.so" },
+};
+
+int main(int argc, char** argv) {
+    (void)argv;
+    if (argc > 1) {
+        fprintf(stderr, "Usage: dltest\n");
+        return 1;
+    }
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    dlsearch_addPath(dir);
+    // Closed libraries are unloaded unless a check enables the cache
+    ELF64_dlcache(0);
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool ok = tests[i].run();
+        printf("{\"test\":\"%s\",\"ok\":%s}\n", tests[i].name, ok ? "true" : "false");
+        failed += !ok;
+    }
+
+    char path[1024];
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        const char* files = tests[i].file;
+        while (files && *files) {
+            size_t len = strcspn(files, " ");
+            snprintf(path, sizeof(path), "%s/%.*s", dir, (int)len, files);
+            remove(path);
+            files += len + (files[len] == ' ');
+        }
+    }
+    rmdir(dir);
+    return failed ? 1 : 0;
+}
+#else
+int main(void) {
+    fprintf(stderr, "Only the 64-bit loader is tested\n");
+    return 1;
+}
+#endif
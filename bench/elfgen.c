@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <elf/elf64.h>
+#include <elf/elf32.h>
+#include "elfgen.h"
+
+#define PAGE_SIZE 0x1000
+#define FUNC_SIZE 16
+#define PLT_ENTRY 16
+
+/* Shared prefix used to pad symbol names, modelled on mangled C++ names */
+static const char namePrefix[] =
+    "_ZN5bench6detail17synthetic_symbolsINSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEEE";
+
+static size_t alignUp(size_t value, size_t align) {
+    return (value + align - 1) / align * align;
+}
+
+static uint32_t elfgen_hash(const char* name) {
+    uint32_t h = 0;
+    for (const unsigned char* c = (const unsigned char*)name; *c; c++) {
+        h = (h << 4) + *c;
+        uint32_t g = h & 0xf0000000;
+        if (g) {
+            h ^= g >> 24;
+        }
+        h &= ~g;
+    }
+    return h;
+}
+
+static void putWord(char* p, bool is64, uint64_t value) {
+    if (is64) {
+        memcpy(p, &value, 8);
+    } else {
+        uint32_t v = (uint32_t)value;
+        memcpy(p, &v, 4);
+    }
+}
+
+static void putSym(char* p, bool is64, uint32_t name, uint64_t value, uint64_t size, uint8_t info, uint16_t shndx) {
+    if (is64) {
+        Elf64_Sym* sym = (Elf64_Sym*)p;
+        sym->st_name = name;
+        sym->st_value = value;
+        sym->st_size = size;
+        sym->st_info = info;
+        sym->st_shndx = shndx;
+    } else {
+        Elf32_Sym* sym = (Elf32_Sym*)p;
+        sym->st_name = name;
+        sym->st_value = (uint32_t)value;
+        sym->st_size = (uint32_t)size;
+        sym->st_info = info;
+        sym->st_shndx = shndx;
+    }
+}
+
+/* i386 uses REL, so the addend of a RELATIVE relocation goes into the slot */
+static void putRel(char* p, char* image, bool is64, uint64_t offset, uint32_t sym, uint32_t type, uint64_t addend) {
+    if (is64) {
+        Elf64_Rela* rel = (Elf64_Rela*)p;
+        rel->r_offset = offset;
+        rel->r_info = (uint64_t)sym << 32 | type;
+        rel->r_addend = addend;
+    } else {
+        Elf32_Rel* rel = (Elf32_Rel*)p;
+        rel->r_offset = (uint32_t)offset;
+        rel->r_info = sym << 8 | type;
+        putWord(image + offset, false, addend);
+    }
+}
+
+static char* putDyn(char* p, bool is64, int64_t tag, uint64_t value) {
+    if (is64) {
+        Elf64_Dyn* dyn = (Elf64_Dyn*)p;
+        dyn->d_tag = tag;
+        dyn->d_un.d_val = value;
+        return p + sizeof(Elf64_Dyn);
+    } else {
+        Elf32_Dyn* dyn = (Elf32_Dyn*)p;
+        dyn->d_tag = (int32_t)tag;
+        dyn->d_un.d_val = (uint32_t)value;
+        return p + sizeof(Elf32_Dyn);
+    }
+}
+
+static void putPhdr(char* p, bool is64, uint32_t type, uint32_t flags, uint64_t offset, uint64_t filesz, uint64_t memsz, uint64_t align) {
+    if (is64) {
+        Elf64_Phdr* ph = (Elf64_Phdr*)p;
+        ph->p_type = type;
+        ph->p_flags = flags;
+        ph->p_offset = ph->p_vaddr = ph->p_paddr = offset;
+        ph->p_filesz = filesz;
+        ph->p_memsz = memsz;
+        ph->p_align = align;
+    } else {
+        Elf32_Phdr* ph = (Elf32_Phdr*)p;
+        ph->p_type = type;
+        ph->p_flags = flags;
+        ph->p_offset = ph->p_vaddr = ph->p_paddr = (uint32_t)offset;
+        ph->p_filesz = (uint32_t)filesz;
+        ph->p_memsz = (uint32_t)memsz;
+        ph->p_align = (uint32_t)align;
+    }
+}
+
+static size_t addString(char* strtab, size_t* strsz, const char* str) {
+    size_t offset = *strsz;
+    size_t len = strlen(str) + 1;
+    memcpy(strtab + offset, str, len);
+    *strsz += len;
+    return offset;
+}
+
+void* elfgen_build(const elfgen_lib_t* lib, size_t* size) {
+    bool is64 = lib->elfClass == ELFCLASS64;
+    size_t ehdrSize = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    size_t phdrSize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+    size_t symSize = is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+    size_t relSize = is64 ? sizeof(Elf64_Rela) : sizeof(Elf32_Rel);
+    size_t dynSize = is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    size_t word = is64 ? 8 : 4;
+
+    // Relocation mix. Symbolic relocations need at least one symbol.
+    int symbols = lib->exportCount + lib->importCount;
+    int nrel = lib->relocations * lib->relativePercent / 100;
+    int nglob = lib->relocations * lib->globDatPercent / 100;
+    if (!symbols) {
+        nrel = lib->relocations;
+        nglob = 0;
+    }
+    int njump = lib->relocations - nrel - nglob;
+    int nsyms = 1 + symbols;
+    bool plt = lib->plt && is64 && njump;
+
+    size_t strsz = 1 + strlen(lib->soname) + 1;
+    for (int i = 0; i < lib->neededCount; i++) {
+        strsz += strlen(lib->needed[i]) + 1;
+    }
+    for (int i = 0; i < lib->exportCount; i++) {
+        strsz += strlen(lib->exports[i]) + 1;
+    }
+    for (int i = 0; i < lib->importCount; i++) {
+        strsz += strlen(lib->imports[i]) + 1;
+    }
+
+    int ndyn = lib->neededCount + 1 + 5 + 1;
+    if (nrel + nglob) {
+        ndyn += 3;
+    }
+    if (njump) {
+        ndyn += 4;
+    }
+
+    // Read-only/executable segment
+    size_t off = alignUp(ehdrSize + 3 * phdrSize, 8);
+    size_t hashOff = off;
+    off += (2 + nsyms + nsyms) * sizeof(uint32_t);
+    size_t symOff = off = alignUp(off, 8);
+    off += nsyms * symSize;
+    size_t strOff = off;
+    off += strsz;
+    size_t relOff = off = alignUp(off, 8);
+    off += (nrel + nglob) * relSize;
+    size_t jmpOff = off;
+    off += njump * relSize;
+    size_t textOff = off = alignUp(off, FUNC_SIZE);
+    off += lib->exportCount * FUNC_SIZE;
+    size_t pltOff = off;
+    if (plt) {
+        off += (1 + njump) * PLT_ENTRY;
+    }
+    size_t textEnd = off;
+
+    // Writable segment
+    size_t dataOff = off = alignUp(off, PAGE_SIZE);
+    size_t dynOff = off;
+    off += ndyn * dynSize;
+    size_t gotOff = off;
+    off += nglob * word;
+    size_t gotpltOff = off;
+    off += (3 + njump) * word;
+    size_t slotOff = off;
+    off += nrel * word;
+    size_t padOff = off;
+    off += lib->dataSize;
+    size_t fileSize = off;
+
+    char* image = calloc(1, fileSize);
+    if (!image) {
+        return NULL;
+    }
+
+    // ELF header
+    uint8_t* ident = (uint8_t*)image;
+    ident[EI_MAG0] = ELFMAG0;
+    ident[EI_MAG1] = ELFMAG1;
+    ident[EI_MAG2] = ELFMAG2;
+    ident[EI_MAG3] = ELFMAG3;
+    ident[EI_CLASS] = (uint8_t)lib->elfClass;
+    ident[EI_DATA] = ELFDATA2LSB;
+    ident[EI_VERSION] = EV_CURRENT;
+    if (is64) {
+        Elf64_Ehdr* header = (Elf64_Ehdr*)image;
+        header->e_type = ET_DYN;
+        header->e_machine = EM_X86_64;
+        header->e_version = EV_CURRENT;
+        header->e_phoff = ehdrSize;
+        header->e_ehsize = (Elf64_Half)ehdrSize;
+        header->e_phentsize = (Elf64_Half)phdrSize;
+        header->e_phnum = 3;
+    } else {
+        Elf32_Ehdr* header = (Elf32_Ehdr*)image;
+        header->e_type = ET_DYN;
+        header->e_machine = EM_386;
+        header->e_version = EV_CURRENT;
+        header->e_phoff = (Elf32_Off)ehdrSize;
+        header->e_ehsize = (Elf32_Half)ehdrSize;
+        header->e_phentsize = (Elf32_Half)phdrSize;
+        header->e_phnum = 3;
+    }
+    putPhdr(image + ehdrSize, is64, PT_LOAD, 5, 0, textEnd, textEnd, PAGE_SIZE);
+    putPhdr(image + ehdrSize + phdrSize, is64, PT_LOAD, 6, dataOff,
+        fileSize - dataOff, fileSize - dataOff + lib->bssSize, PAGE_SIZE);
+    putPhdr(image + ehdrSize + 2 * phdrSize, is64, PT_DYNAMIC, 6, dynOff, ndyn * dynSize, ndyn * dynSize, word);
+
+    // String table
+    char* strtab = image + strOff;
+    size_t strUsed = 1;
+    size_t sonameStr = addString(strtab, &strUsed, lib->soname);
+    size_t* neededStr = malloc((lib->neededCount + 1) * sizeof(size_t));
+    if (!neededStr) {
+        free(image);
+        return NULL;
+    }
+    for (int i = 0; i < lib->neededCount; i++) {
+        neededStr[i] = addString(strtab, &strUsed, lib->needed[i]);
+    }
+
+    // Symbols and SysV hash table
+    uint32_t* hash = (uint32_t*)(image + hashOff);
+    uint32_t* buckets = hash + 2;
+    uint32_t* chains = buckets + nsyms;
+    hash[0] = nsyms;
+    hash[1] = nsyms;
+    for (int i = 1; i < nsyms; i++) {
+        const char* name;
+        if (i <= lib->exportCount) {
+            name = lib->exports[i - 1];
+            size_t str = addString(strtab, &strUsed, name);
+            putSym(image + symOff + i * symSize, is64, (uint32_t)str,
+                textOff + (i - 1) * FUNC_SIZE, 6, STB_GLOBAL << 4 | STT_FUNC, 1);
+        } else {
+            name = lib->imports[i - 1 - lib->exportCount];
+            size_t str = addString(strtab, &strUsed, name);
+            putSym(image + symOff + i * symSize, is64, (uint32_t)str, 0, 0, STB_GLOBAL << 4 | STT_FUNC, SHN_UNDEF);
+        }
+        uint32_t bucket = elfgen_hash(name) % nsyms;
+        chains[i] = buckets[bucket];
+        buckets[bucket] = i;
+    }
+
+    // Every export is `mov eax, index; ret`, valid in both modes
+    for (int i = 0; i < lib->exportCount; i++) {
+        unsigned char* code = (unsigned char*)image + textOff + i * FUNC_SIZE;
+        uint32_t index = i;
+        code[0] = 0xB8;
+        memcpy(code + 1, &index, 4);
+        code[5] = 0xC3;
+        memset(code + 6, 0xCC, FUNC_SIZE - 6);
+    }
+
+    // PLT0 pushes GOT[1] and jumps to GOT[2], entry i jumps through its slot,
+    // which initially points back at its push
+    if (plt) {
+        unsigned char* code = (unsigned char*)image + pltOff;
+        int32_t disp = (int32_t)(gotpltOff + word - (pltOff + 6));
+        code[0] = 0xFF;
+        code[1] = 0x35;
+        memcpy(code + 2, &disp, 4);
+        disp = (int32_t)(gotpltOff + 2 * word - (pltOff + 12));
+        code[6] = 0xFF;
+        code[7] = 0x25;
+        memcpy(code + 8, &disp, 4);
+        memcpy(code + 12, "\x0F\x1F\x40\x00", 4);
+        for (int i = 0; i < njump; i++) {
+            size_t entry = pltOff + (1 + i) * PLT_ENTRY;
+            size_t slot = gotpltOff + (3 + i) * word;
+            code = (unsigned char*)image + entry;
+            disp = (int32_t)(slot - (entry + 6));
+            code[0] = 0xFF;
+            code[1] = 0x25;
+            memcpy(code + 2, &disp, 4);
+            uint32_t index = i;
+            code[6] = 0x68;
+            memcpy(code + 7, &index, 4);
+            disp = (int32_t)(pltOff - (entry + PLT_ENTRY));
+            code[11] = 0xE9;
+            memcpy(code + 12, &disp, 4);
+            putWord(image + slot, is64, entry + 6);
+        }
+        for (int i = 0; i < lib->exportCount; i++) {
+            code = (unsigned char*)image + textOff + i * FUNC_SIZE;
+            disp = (int32_t)(pltOff + (1 + i % njump) * PLT_ENTRY - (textOff + i * FUNC_SIZE + 5));
+            code[0] = 0xE9;
+            memcpy(code + 1, &disp, 4);
+        }
+    }
+
+    // Relocations. The type numbers coincide for x86-64 and i386.
+    char* rel = image + relOff;
+    for (int i = 0; i < nrel; i++, rel += relSize) {
+        uint64_t target = lib->exportCount ? textOff + (i % lib->exportCount) * FUNC_SIZE : textOff;
+        putRel(rel, image, is64, slotOff + i * word, 0, R_X86_64_RELATIVE, target);
+    }
+    for (int i = 0; i < nglob; i++, rel += relSize) {
+        uint32_t sym = lib->importCount ? 1 + lib->exportCount + i % lib->importCount : 1 + i % lib->exportCount;
+        putRel(rel, image, is64, gotOff + i * word, sym, R_X86_64_GLOB_DAT, 0);
+    }
+    rel = image + jmpOff;
+    for (int i = 0; i < njump; i++, rel += relSize) {
+        uint32_t sym = lib->importCount ? 1 + lib->exportCount + i % lib->importCount : 1 + i % lib->exportCount;
+        putRel(rel, image, is64, gotpltOff + (3 + i) * word, sym, R_X86_64_JUMP_SLOT, 0);
+    }
+
+    // Dynamic section
+    char* dyn = image + dynOff;
+    for (int i = 0; i < lib->neededCount; i++) {
+        dyn = putDyn(dyn, is64, DT_NEEDED, neededStr[i]);
+    }
+    free(neededStr);
+    dyn = putDyn(dyn, is64, DT_SONAME, sonameStr);
+    dyn = putDyn(dyn, is64, DT_HASH, hashOff);
+    dyn = putDyn(dyn, is64, DT_STRTAB, strOff);
+    dyn = putDyn(dyn, is64, DT_SYMTAB, symOff);
+    dyn = putDyn(dyn, is64, DT_STRSZ, strsz);
+    dyn = putDyn(dyn, is64, DT_SYMENT, symSize);
+    if (nrel + nglob) {
+        dyn = putDyn(dyn, is64, is64 ? DT_RELA : DT_REL, relOff);
+        dyn = putDyn(dyn, is64, is64 ? DT_RELASZ : DT_RELSZ, (nrel + nglob) * relSize);
+        dyn = putDyn(dyn, is64, is64 ? DT_RELAENT : DT_RELENT, relSize);
+    }
+    if (njump) {
+        dyn = putDyn(dyn, is64, DT_PLTGOT, gotpltOff);
+        dyn = putDyn(dyn, is64, DT_PLTRELSZ, njump * relSize);
+        dyn = putDyn(dyn, is64, DT_PLTREL, is64 ? DT_RELA : DT_REL);
+        dyn = putDyn(dyn, is64, DT_JMPREL, jmpOff);
+    }
+    putDyn(dyn, is64, DT_NULL, 0);
+
+    // Initialized data, so that it is actually read and copied
+    for (size_t i = 0; i < lib->dataSize; i++) {
+        image[padOff + i] = (char)i;
+    }
+
+    *size = fileSize;
+    return image;
+}
+
+const char* elfgen_exportName(const elfgen_params_t* params, int lib, int index, char* buf, size_t len) {
+    char base[32];
+    int baseLen = snprintf(base, sizeof(base), "l%d_f%d", lib, index);
+    size_t pad = params->nameLength > baseLen ? params->nameLength - baseLen : 0;
+    if (pad + baseLen + 1 > len) {
+        pad = len - baseLen - 1;
+    }
+    for (size_t i = 0; i < pad; i++) {
+        buf[i] = namePrefix[i % (sizeof(namePrefix) - 1)];
+    }
+    memcpy(buf + pad, base, baseLen + 1);
+    return buf;
+}
+
+static char* elfgen_strdup(const char* str) {
+    char* copy = malloc(strlen(str) + 1);
+    if (copy) {
+        strcpy(copy, str);
+    }
+    return copy;
+}
+
+static void elfgen_freeNames(char** names, int count) {
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+int elfgen_writeTree(const char* dir, const elfgen_params_t* params) {
+    // Complete k-ary tree numbered breadth first: the children of n are
+    // n * fanout + 1 to n * fanout + fanout
+    int total = 1;
+    int level = 1;
+    for (int d = 0; d < params->depth && params->fanout; d++) {
+        level *= params->fanout;
+        total += level;
+    }
+
+    char buf[1024];
+    for (int n = 0; n < total; n++) {
+        int firstChild = n * params->fanout + 1;
+        int children = firstChild < total ? params->fanout : 0;
+        bool hostImports = !children || !params->exports;
+
+        char** needed = calloc(children + 1, sizeof(char*));
+        char** exports = calloc(params->exports + 1, sizeof(char*));
+        char** imports = calloc(params->imports + 1, sizeof(char*));
+        char soname[32];
+        snprintf(soname, sizeof(soname), "lib%d.so", n);
+
+        bool ok = needed && exports && imports;
+        for (int i = 0; ok && i < children; i++) {
+            snprintf(buf, sizeof(buf), "lib%d.so", firstChild + i);
+            ok = (needed[i] = elfgen_strdup(buf)) != NULL;
+        }
+        for (int i = 0; ok && i < params->exports; i++) {
+            ok = (exports[i] = elfgen_strdup(elfgen_exportName(params, n, i, buf, sizeof(buf)))) != NULL;
+        }
+        for (int i = 0; ok && i < params->imports; i++) {
+            if (hostImports) {
+                snprintf(buf, sizeof(buf), "host_%d", i);
+            } else {
+                elfgen_exportName(params, firstChild + i % children, i / children % params->exports, buf, sizeof(buf));
+            }
+            ok = (imports[i] = elfgen_strdup(buf)) != NULL;
+        }
+
+        size_t size = 0;
+        void* image = NULL;
+        if (ok) {
+            elfgen_lib_t lib = {
+                .elfClass = params->elfClass,
+                .soname = soname,
+                .neededCount = children,
+                .needed = (const char* const*)needed,
+                .exportCount = params->exports,
+                .exports = (const char* const*)exports,
+                .importCount = params->imports,
+                .imports = (const char* const*)imports,
+                .relocations = params->relocations,
+                .relativePercent = params->relativePercent,
+                .globDatPercent = params->globDatPercent,
+                .dataSize = params->dataSize,
+                .bssSize = params->bssSize,
+            };
+            image = elfgen_build(&lib, &size);
+        }
+        elfgen_freeNames(needed, children);
+        elfgen_freeNames(exports, params->exports);
+        elfgen_freeNames(imports, params->imports);
+        if (!image) {
+            return -1;
+        }
+
+        snprintf(buf, sizeof(buf), "%s/%s", dir, soname);
+        FILE* file = fopen(buf, "wb");
+        ok = file && fwrite(image, size, 1, file) == 1;
+        if (file && fclose(file) != 0) {
+            ok = false;
+        }
+        free(image);
+        if (!ok) {
+            return -1;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,57 @@
+#ifndef NORLIT_BENCH_ELFGEN_H
+#define NORLIT_BENCH_ELFGEN_H
+
+#include <stddef.h>
+
+/*
+ * Description of one synthetic shared library. Every export is a function
+ * returning its index in `exports`. Imports are left undefined and are bound
+ * through GLOB_DAT and JUMP_SLOT relocations.
+ */
+typedef struct {
+    int elfClass;               /* ELFCLASS64 (x86-64) or ELFCLASS32 (i386) */
+    const char* soname;
+    int neededCount;
+    const char* const* needed;
+    int exportCount;
+    const char* const* exports;
+    int importCount;
+    const char* const* imports;
+    int relocations;
+    int relativePercent;        /* Remaining relocations after RELATIVE and */
+    int globDatPercent;         /* GLOB_DAT ones are JUMP_SLOT */
+    size_t dataSize;
+    size_t bssSize;
+    /*
+     * x86-64 only: emit a lazy PLT entry per JUMP_SLOT relocation, and make
+     * export i tail-call through entry i instead of returning its index
+     */
+    int plt;
+} elfgen_lib_t;
+
+/* Parameters of a dependency tree of synthetic libraries */
+typedef struct {
+    int elfClass;
+    int exports;
+    int imports;
+    int relocations;
+    int relativePercent;
+    int globDatPercent;
+    int fanout;
+    int depth;
+    int nameLength;             /* Pad symbol names to this length */
+    size_t dataSize;
+    size_t bssSize;
+} elfgen_params_t;
+
+void* elfgen_build(const elfgen_lib_t* lib, size_t* size);
+
+/*
+ * Write the tree into dir as lib<n>.so, where lib0.so is the root. Leaves
+ * import host_<k> symbols, which the caller has to provide. Returns the number
+ * of libraries written, or -1 on failure.
+ */
+int elfgen_writeTree(const char* dir, const elfgen_params_t* params);
+const char* elfgen_exportName(const elfgen_params_t* params, int lib, int index, char* buf, size_t len);
+
+#endif
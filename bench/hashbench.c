@@ -0,0 +1,390 @@
+/*
+ * Microbenchmark of util/hashmap with symbol-name workloads. For every
+ * combination of name distribution, hash function and table size it reports
+ * hash collisions, chain lengths, probes per lookup and ns/op of put, get-hit
+ * and get-miss, as one JSON object per line.
+ *
+ * Usage: hashbench [names=<file>] [count=N] [rounds=N]
+ *
+ * count sizes the generated distributions. The names file, which is used in
+ * full, holds one symbol per line, for example the output of
+ * `nm -D --defined-only lib.so | awk '{print $3}'`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <elf/dlstats.h>
+#include <util/hashmap.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+typedef struct {
+    const char* name;
+    char** keys;
+    char** misses;
+    int count;
+} workload_t;
+
+typedef struct {
+    const char* name;
+    hash_t hash;
+    bool (*supported)(void);
+    bool native;                /* Use hashmap_new_string, with its own hash */
+} hasher_t;
+
+static int count = 10000;
+static int rounds = 5;
+static const char* namesFile = NULL;
+
+/* Deterministic xorshift, so runs are comparable */
+static uint64_t rngState = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+/* SysV ELF hash, as in DT_HASH */
+static int elf_hash(const void* key) {
+    uint32_t h = 0;
+    for (const unsigned char* c = key; *c; c++) {
+        h = (h << 4) + *c;
+        uint32_t g = h & 0xf0000000;
+        if (g) {
+            h ^= g >> 24;
+        }
+        h &= ~g;
+    }
+    return (int)h;
+}
+
+/* GNU hash (djb2), as in DT_GNU_HASH */
+static int gnu_hash(const void* key) {
+    uint32_t h = 5381;
+    for (const unsigned char* c = key; *c; c++) {
+        h = h * 33 + *c;
+    }
+    return (int)h;
+}
+
+static int fnv1a_hash(const void* key) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char* c = key; *c; c++) {
+        h = (h ^ *c) * 16777619u;
+    }
+    return (int)h;
+}
+
+/* Eight bytes per step over the known length, the tail is zero padded */
+static int word_hash(const void* key) {
+    const char* c = key;
+    size_t len = strlen(c);
+    uint64_t h = len * 0x9E3779B97F4A7C15ull;
+    uint64_t w;
+    for (; len >= 8; len -= 8, c += 8) {
+        memcpy(&w, c, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, c, len);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 29;
+    return (int)(h ^ h >> 32);
+}
+
+/* The hash hashmap_new_string maps use, for the collision count */
+static int native_hash(const void* key) {
+    return (int)string_hash_len(key, strlen(key));
+}
+
+static bool always(void) {
+    return true;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static int crc32_hash(const void* key) {
+    const char* c = key;
+    size_t len = strlen(c);
+    uint32_t h = (uint32_t)len;
+    uint32_t w;
+    for (; len >= 4; len -= 4, c += 4) {
+        memcpy(&w, c, 4);
+        h = _mm_crc32_u32(h, w);
+    }
+    for (; len; len--, c++) {
+        h = _mm_crc32_u8(h, (unsigned char)*c);
+    }
+    return (int)h;
+}
+
+static bool has_sse42(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+static const hasher_t hashers[] = {
+    { .name = "string31", .hash = string_hash, .supported = always },
+    { .name = "elf", .hash = elf_hash, .supported = always },
+    { .name = "gnu", .hash = gnu_hash, .supported = always },
+    { .name = "fnv1a", .hash = fnv1a_hash, .supported = always },
+    { .name = "word", .hash = word_hash, .supported = always },
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    { .name = "crc32", .hash = crc32_hash, .supported = has_sse42 },
+#endif
+    { .name = "native", .hash = native_hash, .supported = always, .native = true },
+};
+
+static char* randomIdent(char* p, int minLen, int maxLen) {
+    int len = minLen + (int)(rng() % (maxLen - minLen + 1));
+    for (int i = 0; i < len; i++) {
+        *p++ = "abcdefghijklmnopqrstuvwxyz_"[rng() % (i ? 27 : 26)];
+    }
+    *p = 0;
+    return p;
+}
+
+/* Itanium mangled names sharing a few long namespace/template prefixes */
+static char* mangledName(void) {
+    static const char* prefixes[] = {
+        "_ZNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEE",
+        "_ZN4absl12lts_2023080218container_internal12raw_hash_setINS1_17FlatHashMapPolicyI",
+        "_ZNK4llvm12DenseMapBaseINS_8DenseMapIPKNS_5ValueEjNS_12DenseMapInfoIS4_vEE",
+        "_ZN5boost4asio6detail15reactive_socket_service_base",
+    };
+    static const char* suffixes[] = { "Ev", "Ei", "ERKS_", "EPKcm", "EOS0_", "IJEEEvDpOT_" };
+    char buf[512];
+    char ident[32];
+    randomIdent(ident, 3, 14);
+    snprintf(buf, sizeof(buf), "%s%zu%s%s", prefixes[rng() % 4], strlen(ident), ident, suffixes[rng() % 6]);
+    return strdup(buf);
+}
+
+static char* cName(void) {
+    static const char* prefixes[] = { "", "ssl_", "png_", "g_", "xml" };
+    char buf[64];
+    char* p = buf + sprintf(buf, "%s", prefixes[rng() % 5]);
+    randomIdent(p, 4, 18);
+    return strdup(buf);
+}
+
+static bool addKey(char*** keys, int* n, int* capacity, char* key) {
+    if (!key) {
+        return false;
+    }
+    if (*n == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        char** grown = realloc(*keys, *capacity * sizeof(char*));
+        if (!grown) {
+            return false;
+        }
+        *keys = grown;
+    }
+    (*keys)[(*n)++] = key;
+    return true;
+}
+
+/* Misses share the distribution of the keys but never match one */
+static char** makeMisses(char** keys, int n) {
+    char** misses = malloc(n * sizeof(char*));
+    for (int i = 0; misses && i < n; i++) {
+        size_t len = strlen(keys[i]);
+        misses[i] = malloc(len + 3);
+        memcpy(misses[i], keys[i], len);
+        memcpy(misses[i] + len, "@!", 3);
+    }
+    return misses;
+}
+
+static bool generate(workload_t* workload, const char* name, char* (*gen)(void)) {
+    int n = 0, capacity = 0;
+    char** keys = NULL;
+    hashmap_t* seen = hashmap_new_string(count);
+    while (n < count) {
+        char* key = gen();
+        if (!key) {
+            return false;
+        }
+        // Keys must be distinct for hit/miss accounting
+        if (hashmap_get(seen, key)) {
+            free(key);
+            continue;
+        }
+        hashmap_put(seen, key, key);
+        if (!addKey(&keys, &n, &capacity, key)) {
+            return false;
+        }
+    }
+    hashmap_dispose(seen);
+    workload->name = name;
+    workload->keys = keys;
+    workload->misses = makeMisses(keys, n);
+    workload->count = n;
+    return workload->misses != NULL;
+}
+
+static bool loadFile(workload_t* workload, const char* file) {
+    FILE* fp = fopen(file, "r");
+    if (!fp) {
+        return false;
+    }
+    int n = 0, capacity = 0;
+    char** keys = NULL;
+    hashmap_t* seen = hashmap_new_string(4096);
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!*line || hashmap_get(seen, line)) {
+            continue;
+        }
+        char* key = strdup(line);
+        if (!addKey(&keys, &n, &capacity, key)) {
+            fclose(fp);
+            return false;
+        }
+        hashmap_put(seen, key, key);
+    }
+    fclose(fp);
+    hashmap_dispose(seen);
+    if (!n) {
+        return false;
+    }
+    workload->name = file;
+    workload->keys = keys;
+    workload->misses = makeMisses(keys, n);
+    workload->count = n;
+    return workload->misses != NULL;
+}
+
+static int compareHash(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Keys sharing a full 32-bit hash cannot be told apart without a compare */
+static int hashCollisions(const workload_t* workload, hash_t hash) {
+    uint32_t* hashes = malloc(workload->count * sizeof(uint32_t));
+    if (!hashes) {
+        return -1;
+    }
+    for (int i = 0; i < workload->count; i++) {
+        hashes[i] = (uint32_t)hash(workload->keys[i]);
+    }
+    qsort(hashes, workload->count, sizeof(uint32_t), compareHash);
+    int collisions = 0;
+    for (int i = 1; i < workload->count; i++) {
+        collisions += hashes[i] == hashes[i - 1];
+    }
+    free(hashes);
+    return collisions;
+}
+
+static void run(const workload_t* workload, const hasher_t* hasher, int buckets) {
+    uint64_t putNs = 0, hitNs = 0, missNs = 0;
+    hashmap_counters_t before, after;
+    unsigned long long hitProbes = 0, missProbes = 0;
+    hashmap_info_t info = {0};
+    bool ok = true;
+
+    for (int round = 0; round < rounds; round++) {
+        hashmap_t* map = hasher->native ?
+            hashmap_new_string(buckets) : hashmap_new(hasher->hash, string_comparator, buckets);
+
+        uint64_t start = dlstats_now();
+        for (int i = 0; i < workload->count; i++) {
+            hashmap_put(map, workload->keys[i], workload->keys[i]);
+        }
+        putNs += dlstats_now() - start;
+
+        hashmap_counters(&before);
+        start = dlstats_now();
+        for (int i = 0; i < workload->count; i++) {
+            ok &= hashmap_get(map, workload->keys[i]) == workload->keys[i];
+        }
+        hitNs += dlstats_now() - start;
+        hashmap_counters(&after);
+        hitProbes += after.probes - before.probes;
+
+        before = after;
+        start = dlstats_now();
+        for (int i = 0; i < workload->count; i++) {
+            ok &= hashmap_get(map, workload->misses[i]) == NULL;
+        }
+        missNs += dlstats_now() - start;
+        hashmap_counters(&after);
+        missProbes += after.probes - before.probes;
+
+        hashmap_info(map, &info);
+        hashmap_dispose(map);
+    }
+
+    double ops = (double)workload->count * rounds;
+    printf("{\"bench\":\"hashmap\",\"names\":\"%s\",\"hash\":\"%s\",\"keys\":%d,\"buckets\":%d,"
+        "\"collisions\":%d,\"max_chain\":%d,\"probes_hit\":%.3f,\"probes_miss\":%.3f,"
+        "\"put_ns\":%.2f,\"hit_ns\":%.2f,\"miss_ns\":%.2f,\"memory\":%zu,\"ok\":%s}\n",
+        workload->name, hasher->name, workload->count, buckets,
+        hashCollisions(workload, hasher->hash), info.maxChain, hitProbes / ops, missProbes / ops,
+        putNs / ops, hitNs / ops, missNs / ops, info.memory, ok ? "true" : "false");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "names=", 6) == 0) {
+            namesFile = argv[i] + 6;
+        } else if (strncmp(argv[i], "count=", 6) == 0) {
+            count = atoi(argv[i] + 6);
+        } else if (strncmp(argv[i], "rounds=", 7) == 0) {
+            rounds = atoi(argv[i] + 7);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (count < 1 || rounds < 1) {
+        fprintf(stderr, "count and rounds must be positive\n");
+        return 1;
+    }
+
+    workload_t workloads[3];
+    int workloadCount = 0;
+    if (namesFile) {
+        if (!loadFile(&workloads[workloadCount++], namesFile)) {
+            fprintf(stderr, "Cannot read names from %s\n", namesFile);
+            return 1;
+        }
+    }
+    if (!generate(&workloads[workloadCount++], "mangled", mangledName) ||
+            !generate(&workloads[workloadCount++], "c", cName)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int w = 0; w < workloadCount; w++) {
+        const workload_t* workload = &workloads[w];
+        // A single bucket is what the loader's symbol maps use today. It is
+        // quadratic, so it is skipped for large inputs.
+        int sizes[] = { 1, 64, workload->count / 4, workload->count };
+        for (size_t h = 0; h < sizeof(hashers) / sizeof(hashers[0]); h++) {
+            if (!hashers[h].supported()) {
+                continue;
+            }
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                if (sizes[s] < 1 || (sizes[s] == 1 && workload->count > 4096)) {
+                    continue;
+                }
+                run(workload, &hashers[h], sizes[s]);
+            }
+        }
+    }
+    return 0;
+}
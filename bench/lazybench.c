@@ -0,0 +1,165 @@
+/*
+ * What opening a large library costs when only a few of its pages are used.
+ * A synthetic library with one large writable segment is opened, a fraction
+ * of the pages of that segment is written, and the library is closed again.
+ * The segment holds either initialized data, read from a file or copied from
+ * a buffer, or bss only. For each case one JSON object per line reports the
+ * dlopen time and the resident set growth after opening and after touching.
+ *
+ * Usage: lazybench [mb=N] [percent=N]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlsearch.h>
+#include "elfgen.h"
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+
+static const char* const exports[] = { "f0" };
+
+static uint64_t residentBytes(void) {
+    unsigned long size, resident;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+typedef struct {
+    char* start;
+    size_t size;
+} segment_t;
+
+/* The writable PT_LOAD segment of the library under test */
+static int findSegment(elf64_phdr_info_t* info, size_t size, void* data) {
+    (void)size;
+    if (!info->dlpi_name || !strstr(info->dlpi_name, "libbig.so")) {
+        return 0;
+    }
+    for (uint16_t i = 0; i < info->dlpi_phnum; i++) {
+        const Elf64_Phdr* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_W)) {
+            segment_t* segment = data;
+            segment->start = (char*)info->dlpi_addr + phdr->p_vaddr;
+            segment->size = (size_t)phdr->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int run(const char* source, const char* dir, size_t data, size_t bss, int percent) {
+    elfgen_lib_t lib = {
+        .elfClass = ELFCLASS64,
+        .soname = "libbig.so",
+        .exportCount = 1,
+        .exports = exports,
+        .dataSize = data,
+        .bssSize = bss,
+    };
+    size_t size;
+    char* image = elfgen_build(&lib, &size);
+    if (!image) {
+        fprintf(stderr, "Cannot generate the library\n");
+        return 1;
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, lib.soname);
+    bool fromMemory = strcmp(source, "mem") == 0;
+    if (!fromMemory) {
+        FILE* file = fopen(path, "wb");
+        bool ok = file && fwrite(image, size, 1, file) == 1;
+        if (file && fclose(file) != 0) {
+            ok = false;
+        }
+        free(image);
+        image = NULL;
+        if (!ok) {
+            fprintf(stderr, "Cannot write %s\n", path);
+            return 1;
+        }
+    }
+
+    // The buffer of a memory source is resident before the open starts
+    uint64_t rssBefore = residentBytes();
+    uint64_t start = dlstats_now();
+    void* handle = fromMemory ?
+        ELF64_dlopen_mem(image, size, lib.soname, RTLD_NOW) :
+        ELF64_dlopen(lib.soname, RTLD_NOW);
+    uint64_t elapsed = dlstats_now() - start;
+    if (!handle) {
+        fprintf(stderr, "Cannot open %s: %s\n", lib.soname, ELF64_dlerror());
+        free(image);
+        return 1;
+    }
+    uint64_t rssOpen = residentBytes();
+
+    segment_t segment = { NULL, 0 };
+    ELF64_iterate_phdr(findSegment, &segment);
+    size_t pages = segment.size / 4096;
+    size_t step = percent ? 100 / percent : 0;
+    for (size_t page = 0; step && page < pages; page += step) {
+        segment.start[page * 4096]++;
+    }
+    uint64_t rssTouched = residentBytes();
+
+    printf("{\"bench\":\"lazy\",\"source\":\"%s\",\"data_bytes\":%zu,\"bss_bytes\":%zu,\"percent\":%d,"
+           "\"dlopen_ns\":%llu,\"rss_open_bytes\":%llu,\"rss_touched_bytes\":%llu}\n",
+           source, data, bss, percent, (unsigned long long)elapsed,
+           (unsigned long long)(rssOpen > rssBefore ? rssOpen - rssBefore : 0),
+           (unsigned long long)(rssTouched > rssBefore ? rssTouched - rssBefore : 0));
+    ELF64_dlclose(handle);
+    free(image);
+    remove(path);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    size_t mb = 200;
+    int percent = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "mb=", 3) == 0) {
+            mb = strtoul(argv[i] + 3, NULL, 0);
+        } else if (strncmp(argv[i], "percent=", 8) == 0) {
+            percent = atoi(argv[i] + 8);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!mb || percent < 0 || percent > 100) {
+        fprintf(stderr, "mb must be positive and percent within 0-100\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/lazybench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    dlsearch_addPath(dir);
+    size_t bytes = mb << 20;
+    int status = run("file", dir, bytes, 0, percent) ||
+        run("mem", dir, bytes, 0, percent) ||
+        run("bss", dir, 0, bytes, percent);
+    rmdir(dir);
+    return status;
+}
+#else
+int main(void) {
+    fprintf(stderr, "Only the 64-bit loader is measured\n");
+    return 1;
+}
+#endif
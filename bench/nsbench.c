@@ -0,0 +1,182 @@
+/*
+ * Cost of loading one tree of synthetic libraries into many namespaces. The
+ * tree is opened once per namespace with ELF64_dlmopen, every load after the
+ * first mapping the read-only pages it has in common with an earlier one.
+ * One JSON object per line reports open times, then the memory taken by the
+ * first load and by all of them. Proportional set size counts pages mapped
+ * by several images once, where resident set size counts them every time.
+ *
+ * Usage: nsbench [namespaces=N] [exports=N] [namelen=N] [relocations=N]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlsearch.h>
+#include "elfgen.h"
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+
+static elfgen_params_t params = {
+    ELFCLASS64,
+    4096,   /* exports */
+    64,     /* imports */
+    1024,   /* relocations */
+    60,     /* relativePercent */
+    20,     /* globDatPercent */
+    2,      /* fanout */
+    2,      /* depth */
+    64,     /* nameLength */
+    16384,  /* dataSize */
+    65536   /* bssSize */
+};
+
+static int hostFunction(void) {
+    return -1;
+}
+
+/* Size in bytes of a field of /proc/self/smaps_rollup, given in kB */
+static uint64_t rollupBytes(const char* field) {
+    FILE* rollup = fopen("/proc/self/smaps_rollup", "r");
+    if (!rollup) {
+        return 0;
+    }
+    char line[256];
+    size_t len = strlen(field);
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), rollup)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            sscanf(line + len + 1, "%llu", &kb);
+            break;
+        }
+    }
+    fclose(rollup);
+    return kb * 1024;
+}
+
+int main(int argc, char** argv) {
+    int namespaces = 16;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "namespaces=", 11) == 0) {
+            namespaces = atoi(argv[i] + 11);
+        } else if (strncmp(argv[i], "exports=", 8) == 0) {
+            params.exports = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "namelen=", 8) == 0) {
+            params.nameLength = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "relocations=", 12) == 0) {
+            params.relocations = atoi(argv[i] + 12);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (namespaces < 2) {
+        fprintf(stderr, "namespaces must be at least 2\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/nsbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    int libs = elfgen_writeTree(dir, &params);
+    if (libs < 0) {
+        fprintf(stderr, "Cannot generate libraries in %s\n", dir);
+        return 1;
+    }
+    dlsearch_addPath(dir);
+    char name[1024];
+    for (int i = 0; i < params.imports; i++) {
+        char* host = malloc(16);
+        snprintf(host, 16, "host_%d", i);
+        ELF64_addGlobalSymbol(host, (void*)hostFunction);
+    }
+
+    void** spaces = calloc(namespaces, sizeof(void*));
+    void** handles = calloc(namespaces, sizeof(void*));
+    uint64_t pssBefore = rollupBytes("Pss");
+    uint64_t rssBefore = rollupBytes("Rss");
+    uint64_t pssFirst = 0;
+    uint64_t rssFirst = 0;
+    uint64_t firstNs = 0;
+    uint64_t restNs = 0;
+    int status = 0;
+    for (int i = 0; i < namespaces && !status; i++) {
+        spaces[i] = ELF64_dlnamespace();
+        if (!spaces[i]) {
+            fprintf(stderr, "Cannot create a namespace: %s\n", ELF64_dlerror());
+            status = 1;
+            break;
+        }
+        uint64_t start = dlstats_now();
+        handles[i] = ELF64_dlmopen(spaces[i], "lib0.so", RTLD_NOW);
+        uint64_t elapsed = dlstats_now() - start;
+        if (!handles[i]) {
+            fprintf(stderr, "Cannot open lib0.so: %s\n", ELF64_dlerror());
+            status = 1;
+            break;
+        }
+        // Exported functions return their index, shared pages included
+        int (*fn)(void) = (int (*)(void))ELF64_dlsym(handles[i],
+            elfgen_exportName(&params, 0, params.exports - 1, name, sizeof(name)));
+        if (!fn || fn() != params.exports - 1) {
+            fprintf(stderr, "Bad export %s in namespace %d\n", name, i);
+            status = 1;
+            break;
+        }
+        if (i == 0) {
+            firstNs = elapsed;
+            pssFirst = rollupBytes("Pss");
+            rssFirst = rollupBytes("Rss");
+        } else {
+            restNs += elapsed;
+        }
+    }
+
+    if (!status) {
+        uint64_t pssAll = rollupBytes("Pss");
+        uint64_t rssAll = rollupBytes("Rss");
+        dl_stats_t stats;
+        ELF64_dlstats(&stats);
+        printf("{\"bench\":\"namespaces\",\"metric\":\"dlopen_ns\",\"libs\":%d,\"namespaces\":%d,"
+               "\"first\":%llu,\"rest_mean\":%llu}\n",
+               libs, namespaces, (unsigned long long)firstNs,
+               (unsigned long long)(restNs / (namespaces - 1)));
+        printf("{\"bench\":\"namespaces\",\"metric\":\"memory\",\"libs\":%d,\"namespaces\":%d,"
+               "\"pss_first_bytes\":%llu,\"pss_all_bytes\":%llu,\"rss_first_bytes\":%llu,\"rss_all_bytes\":%llu,"
+               "\"shared_bytes\":%llu,\"loader_bytes\":%llu}\n",
+               libs, namespaces,
+               (unsigned long long)(pssFirst - pssBefore), (unsigned long long)(pssAll - pssBefore),
+               (unsigned long long)(rssFirst - rssBefore), (unsigned long long)(rssAll - rssBefore),
+               (unsigned long long)stats.bytesShared, (unsigned long long)stats.memory);
+    }
+
+    for (int i = 0; i < namespaces && spaces[i]; i++) {
+        if (handles[i]) {
+            ELF64_dlclose(handles[i]);
+        }
+        if (ELF64_dlnamespace_close(spaces[i]) != 0) {
+            fprintf(stderr, "Cannot close namespace %d: %s\n", i, ELF64_dlerror());
+            status = 1;
+        }
+    }
+    for (int i = 0; i < libs; i++) {
+        snprintf(name, sizeof(name), "%s/lib%d.so", dir, i);
+        remove(name);
+    }
+    rmdir(dir);
+    free(spaces);
+    free(handles);
+    return status;
+}
+#else
+int main(void) {
+    fprintf(stderr, "Namespaces are only implemented by the 64-bit loader\n");
+    return 1;
+}
+#endif
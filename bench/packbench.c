@@ -0,0 +1,169 @@
+/*
+ * Break-even of loading packed libraries (see elf/dlpack.h) instead of the
+ * plain ones they hold. The data of a synthetic library is a given share of
+ * random bytes, in 64-byte runs, the rest zeros, which sets how well it
+ * compresses. Both files are loaded from the page cache, so the times only
+ * differ by decoding. Reading them from storage with a bandwidth of B adds
+ * size / B to each, so the packed file loads faster below the break-even
+ * bandwidth (plain size - packed size) / (packed time - plain time). For each
+ * share and decoding thread count one JSON object per line reports the packed
+ * to plain size ratio, ns per load of both files and the break-even bandwidth
+ * in MB/s, null when the packed file loads faster at any bandwidth.
+ *
+ * Usage: packbench [mb=N] [loads=N]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlpack.h>
+#include "elfgen.h"
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+
+static const char* const exports[] = { "f0", "f1" };
+
+static uint64_t state = 88172645463325252ull;
+
+static uint64_t nextRandom(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/* ns per load and close of path, 0 if it does not load */
+static uint64_t timeLoads(const char* path, int loads) {
+    uint64_t total = 0;
+    for (int i = 0; i < loads; i++) {
+        uint64_t start = dlstats_now();
+        void* handle = ELF64_dlopen(path, RTLD_NOW);
+        total += dlstats_now() - start;
+        int (*f1)(void) = handle ? (int (*)(void))ELF64_dlsym(handle, "f1") : NULL;
+        if (!f1 || f1() != 1) {
+            fprintf(stderr, "Cannot load %s: %s\n", path, handle ? "wrong f1" : ELF64_dlerror());
+            return 0;
+        }
+        ELF64_dlclose(handle);
+    }
+    return total / loads;
+}
+
+int main(int argc, char** argv) {
+    size_t mb = 16;
+    int loads = 20;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "mb=", 3) == 0) {
+            mb = (size_t)atol(argv[i] + 3);
+        } else if (strncmp(argv[i], "loads=", 6) == 0) {
+            loads = atoi(argv[i] + 6);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!mb || loads < 1) {
+        fprintf(stderr, "mb and loads must be positive\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/packbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char plainPath[1024];
+    char packedPath[1024];
+    snprintf(plainPath, sizeof(plainPath), "%s/libplain.so", dir);
+    snprintf(packedPath, sizeof(packedPath), "%s/libpacked.so", dir);
+    ELF64_dlcache(0);
+
+    elfgen_lib_t lib = {
+        .elfClass = ELFCLASS64,
+        .soname = "libpackbench.so",
+        .exportCount = 2,
+        .exports = exports,
+        .relocations = 64,
+        .relativePercent = 100,
+        .dataSize = mb << 20,
+    };
+    // One decoding thread, then one per CPU
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long threadCounts[] = { 1, cpus };
+    size_t rounds = cpus > 1 ? 2 : 1;
+    int status = 0;
+    for (int percent = 0; percent <= 100 && !status; percent += 25) {
+        size_t size;
+        char* image = elfgen_build(&lib, &size);
+        if (!image) {
+            fprintf(stderr, "Cannot generate the library\n");
+            return 1;
+        }
+        // The data is the tail of the file
+        char* data = image + size - lib.dataSize;
+        for (size_t i = 0; i < lib.dataSize; i += 64) {
+            size_t run = lib.dataSize - i < 64 ? lib.dataSize - i : 64;
+            if (nextRandom() % 100 < (uint64_t)percent) {
+                for (size_t j = 0; j < run; j++) {
+                    data[i + j] = (char)nextRandom();
+                }
+            } else {
+                memset(data + i, 0, run);
+            }
+        }
+        FILE* plain = fopen(plainPath, "wb");
+        FILE* packed = fopen(packedPath, "wb");
+        bool written = plain && packed && fwrite(image, size, 1, plain) == 1 && dlpack_write(image, size, packed);
+        long packedSize = packed ? ftell(packed) : -1;
+        if (plain && fclose(plain) != 0) {
+            written = false;
+        }
+        if (packed && fclose(packed) != 0) {
+            written = false;
+        }
+        free(image);
+        if (!written || packedSize <= 0) {
+            fprintf(stderr, "Cannot write the libraries to %s\n", dir);
+            return 1;
+        }
+
+        for (size_t r = 0; r < rounds && !status; r++) {
+            long threads = threadCounts[r];
+            char value[24];
+            snprintf(value, sizeof(value), "%ld", threads);
+            setenv(DLPACK_THREADS_ENV, value, 1);
+            uint64_t plainNs = timeLoads(plainPath, loads);
+            uint64_t packedNs = timeLoads(packedPath, loads);
+            if (!plainNs || !packedNs) {
+                status = 1;
+                break;
+            }
+            printf("{\"bench\":\"pack\",\"random_percent\":%d,\"threads\":%ld,\"plain_bytes\":%zu,"
+                   "\"packed_bytes\":%ld,\"ratio\":%.3f,\"plain_ns\":%llu,\"packed_ns\":%llu,\"breakeven_mbps\":",
+                   percent, threads, size, packedSize, (double)packedSize / size,
+                   (unsigned long long)plainNs, (unsigned long long)packedNs);
+            if (packedNs <= plainNs) {
+                printf("null}\n");
+            } else {
+                double saved = (double)size - (double)packedSize;
+                printf("%.1f}\n", saved > 0 ? saved * 1000 / (double)(packedNs - plainNs) : 0);
+            }
+        }
+    }
+
+    remove(plainPath);
+    remove(packedPath);
+    rmdir(dir);
+    return status;
+}
+#else
+int main(void) {
+    fprintf(stderr, "Only the 64-bit loader is measured\n");
+    return 1;
+}
+#endif
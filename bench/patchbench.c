@@ -0,0 +1,163 @@
+/*
+ * Code patching latency while other threads keep running the patched code.
+ * A tiny function is rewritten over and over, either through the writable
+ * alias of an image (see shared.c) or the classic way, by making its page
+ * writable with mprotect and restoring it afterwards. The latter makes the
+ * kernel shoot down the TLB entries of every thread, which the alias avoids.
+ * Patching starts once every thread has called the function. For each method
+ * one JSON object per line reports ns per patch and how many calls the other
+ * threads made while patching, per us in total and per thread.
+ *
+ * Usage: patchbench [threads=N] [patches=N]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlstats.h>
+
+void* alloc_exec(size_t size);
+void* exec_alias(void* ptr);
+bool protect_exec(void* ptr, const unsigned char* flags);
+void free_exec(void* ptr);
+
+typedef int (*patched_fn_t)(void);
+
+static volatile patched_fn_t target;
+static volatile bool stop;
+
+/* Calls made by one thread so far, on a cache line of its own */
+typedef struct {
+    uint64_t count;
+    char pad[56];
+} bench_counter_t;
+
+static void* bench_caller(void* arg) {
+    bench_counter_t* counter = arg;
+    uint64_t count = 0;
+    while (!stop) {
+        target();
+        __atomic_store_n(&counter->count, ++count, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* mov $value, %eax; ret, padded to a word so it is replaced atomically */
+static uint64_t bench_code(uint32_t value) {
+    unsigned char code[8] = {0xb8, 0, 0, 0, 0, 0xc3, 0x90, 0x90};
+    memcpy(code + 1, &value, 4);
+    uint64_t word;
+    memcpy(&word, code, 8);
+    return word;
+}
+
+/* Without an alias the page is made writable just for the store */
+static void bench_patch(char* code, char* alias, uint32_t value) {
+    if (alias != code) {
+        __atomic_store_n((uint64_t*)alias, bench_code(value), __ATOMIC_RELEASE);
+    } else {
+        mprotect(code, 4096, PROT_READ | PROT_WRITE | PROT_EXEC);
+        __atomic_store_n((uint64_t*)code, bench_code(value), __ATOMIC_RELEASE);
+        mprotect(code, 4096, PROT_READ | PROT_EXEC);
+    }
+}
+
+static void bench_run(const char* method, char* code, char* alias, int threads, int patches) {
+    bench_patch(code, alias, 0);
+    target = (patched_fn_t)code;
+    stop = false;
+
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    bench_counter_t* counters = calloc(threads ? threads : 1, sizeof(bench_counter_t));
+    uint64_t* calls = malloc((threads ? threads : 1) * sizeof(uint64_t));
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, bench_caller, &counters[i]);
+    }
+    // Patching starts once every thread runs the code, and only the calls
+    // made while patching are counted
+    for (int i = 0; i < threads; i++) {
+        while (!__atomic_load_n(&counters[i].count, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        calls[i] = __atomic_load_n(&counters[i].count, __ATOMIC_RELAXED);
+    }
+
+    uint64_t start = dlstats_now();
+    for (int i = 1; i <= patches; i++) {
+        bench_patch(code, alias, i);
+    }
+    uint64_t elapsed = dlstats_now() - start;
+
+    uint64_t total = 0;
+    for (int i = 0; i < threads; i++) {
+        calls[i] = __atomic_load_n(&counters[i].count, __ATOMIC_RELAXED) - calls[i];
+        total += calls[i];
+    }
+    stop = true;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(counters);
+
+    if (target() != patches) {
+        fprintf(stderr, "%s: the last patch is not visible\n", method);
+    }
+    printf("{\"bench\":\"patch\",\"method\":\"%s\",\"threads\":%d,\"patches\":%d,\"ns_per_patch\":%.1f,"
+           "\"calls_per_us\":%.1f,\"calls_per_thread\":[",
+           method, threads, patches, (double)elapsed / patches, (double)total * 1000 / elapsed);
+    for (int i = 0; i < threads; i++) {
+        printf("%s%llu", i ? "," : "", (unsigned long long)calls[i]);
+    }
+    printf("]}\n");
+    free(calls);
+}
+
+int main(int argc, char** argv) {
+    int threads = 8;
+    int patches = 100000;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "threads=", 8) == 0) {
+            threads = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "patches=", 8) == 0) {
+            patches = atoi(argv[i] + 8);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (threads < 0 || patches <= 0) {
+        fprintf(stderr, "threads must not be negative and patches must be positive\n");
+        return 1;
+    }
+
+    char* image = alloc_exec(4096);
+    unsigned char flags = PF_R | PF_X;
+    if (!image || !protect_exec(image, &flags)) {
+        fprintf(stderr, "Cannot allocate an image\n");
+        return 1;
+    }
+    if (exec_alias(image) == image) {
+        fprintf(stderr, "No alias available, only mprotect is measured\n");
+    } else {
+        bench_run("alias", image, exec_alias(image), threads, patches);
+    }
+    free_exec(image);
+
+    char* page = mmap(NULL, 4096, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "Cannot allocate a page\n");
+        return 1;
+    }
+    bench_run("mprotect", page, page, threads, patches);
+    munmap(page, 4096);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Cost of replacing a library with ELF64_dlreload while another library is
+ * bound to it. A synthetic caller tail-calls every export of a callee through
+ * its PLT. The callee is swapped back and forth with a build whose exports
+ * return their index in reverse, and every caller is checked to reach the
+ * current build after each reload. A build lacking one of the imported
+ * exports must be refused, leaving the callers bound to the current build.
+ * For each loader mode one JSON object per line reports ns per reload and
+ * per refused reload.
+ *
+ * Usage: reloadbench [functions=N] [reloads=N]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <elf/elf-common.h>
+#include <elf/dlsearch.h>
+#include "elfgen.h"
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#include <elf/elf64_dl.h>
+
+static const struct {
+    const char* name;
+    int flags;
+} modes[] = {
+    { "got", RTLD_NOW },
+    { "bypass", RTLD_BYPASS_PLT },
+};
+
+static char** names(const char* prefix, int count) {
+    char** list = malloc(count * sizeof(char*));
+    for (int i = 0; i < count; i++) {
+        list[i] = malloc(32);
+        snprintf(list[i], 32, "%s%d", prefix, i);
+    }
+    return list;
+}
+
+static int writeLib(const char* dir, const elfgen_lib_t* lib) {
+    size_t size;
+    void* image = elfgen_build(lib, &size);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, lib->soname);
+    FILE* file = image ? fopen(path, "wb") : NULL;
+    int ok = file && fwrite(image, size, 1, file) == 1;
+    if (file && fclose(file) != 0) {
+        ok = 0;
+    }
+    free(image);
+    return ok;
+}
+
+/* Whether caller i reaches export i of the current callee build */
+static int check(int (**fn)(void), int functions, int reversed) {
+    for (int i = 0; i < functions; i++) {
+        if (fn[i]() != (reversed ? functions - 1 - i : i)) {
+            fprintf(stderr, "c%d calls the wrong function\n", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    int functions = 64;
+    int reloads = 1000;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "functions=", 10) == 0) {
+            functions = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "reloads=", 8) == 0) {
+            reloads = atoi(argv[i] + 8);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (functions < 2 || reloads < 1) {
+        fprintf(stderr, "functions must be at least 2 and reloads positive\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/reloadbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char** targets = names("f", functions);
+    char** callers = names("c", functions);
+    char** reversed = malloc(functions * sizeof(char*));
+    for (int i = 0; i < functions; i++) {
+        reversed[i] = targets[functions - 1 - i];
+    }
+    const char* needed[] = { "libcallee.so" };
+    elfgen_lib_t callee = {
+        .elfClass = ELFCLASS64,
+        .soname = "libcallee.so",
+        .exportCount = functions,
+        .exports = (const char* const*)targets,
+    };
+    elfgen_lib_t swapped = callee;
+    swapped.soname = "libswapped.so";
+    swapped.exports = (const char* const*)reversed;
+    // Lacks the last export, which the caller imports
+    elfgen_lib_t partial = callee;
+    partial.soname = "libpartial.so";
+    partial.exportCount = functions - 1;
+    elfgen_lib_t caller = {
+        .elfClass = ELFCLASS64,
+        .soname = "libcaller.so",
+        .neededCount = 1,
+        .needed = needed,
+        .exportCount = functions,
+        .exports = (const char* const*)callers,
+        .importCount = functions,
+        .imports = (const char* const*)targets,
+        .relocations = functions,
+        .plt = 1,
+    };
+    if (!writeLib(dir, &callee) || !writeLib(dir, &swapped) ||
+            !writeLib(dir, &partial) || !writeLib(dir, &caller)) {
+        fprintf(stderr, "Cannot generate libraries in %s\n", dir);
+        return 1;
+    }
+    dlsearch_addPath(dir);
+
+    int status = 0;
+    int (**fn)(void) = malloc(functions * sizeof(*fn));
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && !status; m++) {
+        void* handle = ELF64_dlopen("libcaller.so", modes[m].flags);
+        void* target = handle ? ELF64_dlopen("libcallee.so", RTLD_NOLOAD) : NULL;
+        if (!target) {
+            fprintf(stderr, "Cannot open libcaller.so: %s\n", ELF64_dlerror());
+            return 1;
+        }
+        for (int i = 0; i < functions; i++) {
+            fn[i] = (int (*)(void))ELF64_dlsym(handle, callers[i]);
+        }
+        if (!check(fn, functions, 0)) {
+            return 1;
+        }
+
+        uint64_t reloadNs = 0;
+        uint64_t refusedNs = 0;
+        for (int r = 0; r < reloads && !status; r++) {
+            int odd = r & 1;
+            uint64_t start = dlstats_now();
+            void* next = ELF64_dlreload(target, odd ? "libcallee.so" : "libswapped.so");
+            reloadNs += dlstats_now() - start;
+            if (!next) {
+                fprintf(stderr, "Cannot reload libcallee.so: %s\n", ELF64_dlerror());
+                status = 1;
+                break;
+            }
+            target = next;
+            status = !check(fn, functions, !odd);
+
+            start = dlstats_now();
+            void* refused = ELF64_dlreload(target, "libpartial.so");
+            refusedNs += dlstats_now() - start;
+            if (refused) {
+                fprintf(stderr, "libpartial.so replaced libcallee.so\n");
+                status = 1;
+                break;
+            }
+            status = status || !check(fn, functions, !odd);
+        }
+
+        if (!status) {
+            printf("{\"bench\":\"reload\",\"mode\":\"%s\",\"functions\":%d,\"reloads\":%d,"
+                   "\"reload_ns\":%llu,\"refused_ns\":%llu}\n",
+                   modes[m].name, functions, reloads,
+                   (unsigned long long)(reloadNs / reloads), (unsigned long long)(refusedNs / reloads));
+        }
+        ELF64_dlclose(target);
+        ELF64_dlclose(handle);
+    }
+
+    const char* libs[] = { "libcallee.so", "libswapped.so", "libpartial.so", "libcaller.so" };
+    char path[1024];
+    for (size_t i = 0; i < sizeof(libs) / sizeof(libs[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, libs[i]);
+        remove(path);
+    }
+    rmdir(dir);
+    free(fn);
+    free(reversed);
+    return status;
+}
+#else
+int main(void) {
+    fprintf(stderr, "Libraries are only reloaded by the 64-bit loader\n");
+    return 1;
+}
+#endif
@@ -0,0 +1,138 @@
+#include <util/cpu.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_X86
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+
+static void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    int info[4];
+    __cpuidex(info, (int)leaf, (int)subleaf);
+    for (int i = 0; i < 4; i++) {
+        regs[i] = (uint32_t)info[i];
+    }
+}
+
+static uint64_t cpu_xgetbv(void) {
+    return _xgetbv(0);
+}
+#else
+#include <cpuid.h>
+
+static void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+}
+
+static uint64_t cpu_xgetbv(void) {
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64_t)edx << 32 | eax;
+}
+#endif
+#endif
+
+static uint32_t features = 0;
+static bool detected = false;
+
+#ifdef CPU_X86
+static uint32_t cpu_detect(void) {
+    uint32_t regs[4];
+    uint32_t result = 0;
+
+    cpu_cpuid(0, 0, regs);
+    uint32_t maxLeaf = regs[0];
+    if (maxLeaf < 1) {
+        return 0;
+    }
+
+    cpu_cpuid(1, 0, regs);
+    uint32_t ecx = regs[2];
+    if (ecx & 1 << 0) result |= CPU_SSE3;
+    if (ecx & 1 << 9) result |= CPU_SSSE3;
+    if (ecx & 1 << 19) result |= CPU_SSE41;
+    if (ecx & 1 << 20) result |= CPU_SSE42;
+    if (ecx & 1 << 23) result |= CPU_POPCNT;
+    if (ecx & 1 << 13) result |= CPU_CX16;
+    if (ecx & 1 << 22) result |= CPU_MOVBE;
+
+    // The OS must save YMM (and ZMM) state before AVX can be used
+    uint64_t xcr0 = ecx & 1 << 27 ? cpu_xgetbv() : 0;
+    bool ymm = (xcr0 & 0x6) == 0x6;
+    bool zmm = ymm && (xcr0 & 0xE0) == 0xE0;
+    if (ymm) {
+        if (ecx & 1 << 28) result |= CPU_AVX;
+        if (ecx & 1 << 12) result |= CPU_FMA;
+        if (ecx & 1 << 29) result |= CPU_F16C;
+    }
+
+    if (maxLeaf >= 7) {
+        cpu_cpuid(7, 0, regs);
+        uint32_t ebx = regs[1];
+        if (ebx & 1 << 3) result |= CPU_BMI1;
+        if (ebx & 1 << 8) result |= CPU_BMI2;
+        if (ymm && (ebx & 1 << 5)) result |= CPU_AVX2;
+        if (zmm) {
+            if (ebx & 1 << 16) result |= CPU_AVX512F;
+            if (ebx & 1 << 17) result |= CPU_AVX512DQ;
+            if (ebx & 1 << 28) result |= CPU_AVX512CD;
+            if (ebx & 1 << 30) result |= CPU_AVX512BW;
+            if (ebx & 1u << 31) result |= CPU_AVX512VL;
+        }
+    }
+
+    cpu_cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000001) {
+        cpu_cpuid(0x80000001, 0, regs);
+        if (regs[2] & 1 << 0) result |= CPU_LAHF;
+        if (regs[2] & 1 << 5) result |= CPU_LZCNT;
+    }
+    return result;
+}
+#else
+static uint32_t cpu_detect(void) {
+    return 0;
+}
+#endif
+
+uint32_t cpu_features(void) {
+    if (!detected) {
+        features = cpu_detect();
+        detected = true;
+    }
+    return features;
+}
+
+bool cpu_has(uint32_t wanted) {
+    return (cpu_features() & wanted) == wanted;
+}
+
+int cpu_level(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+    if (cpu_has(CPU_X86_64_V4)) return 4;
+    if (cpu_has(CPU_X86_64_V3)) return 3;
+    if (cpu_has(CPU_X86_64_V2)) return 2;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+uint32_t cpu_xsaveSize(void) {
+#ifdef CPU_X86
+    uint32_t regs[4];
+    cpu_cpuid(0, 0, regs);
+    if (regs[0] < 0xD) {
+        return 0;
+    }
+    cpu_cpuid(1, 0, regs);
+    if (!(regs[2] & 1 << 27)) {
+        return 0;
+    }
+    cpu_cpuid(0xD, 0, regs);
+    return regs[1];
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <elf/dladdr.h>
+
+/*
+ * The index is an immutable array of images sorted by start address. Writers
+ * (dlopen and dlclose) build a new array and publish it with a single pointer
+ * store. Readers announce themselves in `readers` before loading the pointer,
+ * so a writer that sees no readers after publishing knows nobody can still
+ * hold a replaced array or a removed image, and frees them. Otherwise they
+ * are kept on a retire list until a later update finds no readers.
+ */
+typedef struct {
+    size_t count;
+    dladdr_image_t* images[];
+} dladdr_index_t;
+
+#ifdef _MSC_VER
+#include <Windows.h>
+#define atomic_loadPtr(p) InterlockedCompareExchangePointer((void* volatile*)(p), NULL, NULL)
+#define atomic_storePtr(p, v) InterlockedExchangePointer((void* volatile*)(p), (v))
+#define atomic_inc(p) InterlockedIncrement(p)
+#define atomic_dec(p) InterlockedDecrement(p)
+#define atomic_load(p) InterlockedCompareExchange(p, 0, 0)
+#else
+#define atomic_loadPtr(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define atomic_storePtr(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define atomic_inc(p) __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(p) __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define atomic_load(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#endif
+
+static dladdr_index_t* current = NULL;
+static volatile long readers = 0;
+
+static void** retired = NULL;
+static size_t retiredCount = 0;
+static size_t retiredCapacity = 0;
+
+dladdr_image_t* dladdr_newImage(const void* base, size_t size, const char* path, size_t capacity) {
+    dladdr_image_t* image = malloc(sizeof(dladdr_image_t) + capacity * sizeof(dladdr_symbol_t));
+    if (!image) {
+        return NULL;
+    }
+    image->start = (uintptr_t)base;
+    image->end = (uintptr_t)base + size;
+    image->path = path;
+    image->count = 0;
+    image->capacity = capacity;
+    return image;
+}
+
+void dladdr_addSymbol(dladdr_image_t* image, const void* addr, size_t size, const char* name) {
+    if (image && image->count < image->capacity) {
+        dladdr_symbol_t* symbol = &image->symbols[image->count++];
+        symbol->addr = (uintptr_t)addr;
+        symbol->size = size;
+        symbol->name = name;
+    }
+}
+
+size_t dladdr_imageSize(const dladdr_image_t* image) {
+    return image ? sizeof(dladdr_image_t) + image->capacity * sizeof(dladdr_symbol_t) : 0;
+}
+
+/* By address, the largest first among symbols at the same address */
+static int dladdr_compareSymbols(const void* a, const void* b) {
+    const dladdr_symbol_t* x = a;
+    const dladdr_symbol_t* y = b;
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    return x->size > y->size ? -1 : x->size < y->size;
+}
+
+static void dladdr_retire(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    if (retiredCount == retiredCapacity) {
+        size_t capacity = retiredCapacity ? retiredCapacity * 2 : 16;
+        void** grown = realloc(retired, capacity * sizeof(void*));
+        if (!grown) {
+            // Leaking is the only safe option left
+            return;
+        }
+        retired = grown;
+        retiredCapacity = capacity;
+    }
+    retired[retiredCount++] = ptr;
+}
+
+static void dladdr_reclaim(void) {
+    if (atomic_load(&readers) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < retiredCount; i++) {
+        free(retired[i]);
+    }
+    retiredCount = 0;
+}
+
+/*
+ * Publish a copy of the index with `image` added or, if `remove`, taken out.
+ * Returns 1 on success, 0 if the image to remove is not in the index and -1
+ * if memory is exhausted.
+ */
+static int dladdr_update(dladdr_image_t* image, bool remove) {
+    dladdr_index_t* old = current;
+    size_t count = old ? old->count : 0;
+    dladdr_index_t* index = malloc(sizeof(dladdr_index_t) + (count + 1) * sizeof(dladdr_image_t*));
+    if (!index) {
+        return -1;
+    }
+
+    size_t n = 0;
+    bool found = false;
+    for (size_t i = 0; i < count; i++) {
+        dladdr_image_t* other = old->images[i];
+        if (remove && other == image) {
+            found = true;
+            continue;
+        }
+        if (!remove && !found && image->start < other->start) {
+            index->images[n++] = image;
+            found = true;
+        }
+        index->images[n++] = other;
+    }
+    if (!remove && !found) {
+        index->images[n++] = image;
+        found = true;
+    }
+    index->count = n;
+
+    if (!found) {
+        free(index);
+        return 0;
+    }
+    atomic_storePtr(&current, index);
+    dladdr_retire(old);
+    return 1;
+}
+
+void dladdr_insert(dladdr_image_t* image) {
+    if (!image) {
+        return;
+    }
+    qsort(image->symbols, image->count, sizeof(dladdr_symbol_t), dladdr_compareSymbols);
+    // A lookup takes the last symbol at or before the address. One without a
+    // size within the range of a sized one would hide the rest of that range,
+    // so the sized one is kept instead.
+    size_t kept = 0;
+    uintptr_t covered = 0;
+    for (size_t i = 0; i < image->count; i++) {
+        dladdr_symbol_t* symbol = &image->symbols[i];
+        if (!symbol->size && symbol->addr < covered) {
+            continue;
+        }
+        if (symbol->addr + symbol->size > covered) {
+            covered = symbol->addr + symbol->size;
+        }
+        image->symbols[kept++] = *symbol;
+    }
+    image->count = kept;
+    dladdr_update(image, false);
+    dladdr_reclaim();
+}
+
+void dladdr_remove(dladdr_image_t* image) {
+    if (!image) {
+        return;
+    }
+    // An image that never made it into the index can go right away. One that
+    // could not be taken out stays reachable and is leaked.
+    int removed = dladdr_update(image, true);
+    if (removed > 0) {
+        dladdr_retire(image);
+    } else if (removed == 0) {
+        free(image);
+    }
+    dladdr_reclaim();
+}
+
+int dladdr_lookup(const void* addr, dl_info_t* info) {
+    uintptr_t target = (uintptr_t)addr;
+    int found = 0;
+
+    atomic_inc(&readers);
+    dladdr_index_t* index = atomic_loadPtr(&current);
+    if (index) {
+        // Last image starting at or before the address
+        size_t lo = 0, hi = index->count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (index->images[mid]->start <= target) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo && target < index->images[lo - 1]->end) {
+            dladdr_image_t* image = index->images[lo - 1];
+            info->dli_fname = image->path;
+            info->dli_fbase = (void*)image->start;
+            info->dli_sname = NULL;
+            info->dli_saddr = NULL;
+            found = 1;
+
+            lo = 0;
+            hi = image->count;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (image->symbols[mid].addr <= target) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            // Sized symbols cover their range, others only their address
+            if (lo) {
+                dladdr_symbol_t* symbol = &image->symbols[lo - 1];
+                if (target == symbol->addr || target - symbol->addr < symbol->size) {
+                    info->dli_sname = symbol->name;
+                    info->dli_saddr = (void*)symbol->addr;
+                }
+            }
+        }
+    }
+    atomic_dec(&readers);
+    return found;
+}
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <elf/dlinit.h>
+
+#ifndef _MSC_VER
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Nodes become ready once their last dependency is done and are queued in
+ * `ready`. Each node is queued exactly once, so the queue never holds more
+ * than `count` entries and needs no wrapping.
+ */
+typedef struct {
+    void** nodes;
+    size_t count;
+    dlinit_fn_t run;
+    dlinit_fn_t done;
+
+    size_t* waiting;
+    size_t* dependentStart;
+    size_t* dependents;
+
+    size_t* ready;
+    size_t readyHead;
+    size_t readyTail;
+    size_t finished;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} dlinit_graph_t;
+
+static void* dlinit_worker(void* arg) {
+    dlinit_graph_t* graph = arg;
+    pthread_mutex_lock(&graph->lock);
+    for (;;) {
+        while (graph->readyHead == graph->readyTail && graph->finished < graph->count) {
+            pthread_cond_wait(&graph->cond, &graph->lock);
+        }
+        if (graph->readyHead == graph->readyTail) {
+            break;
+        }
+        size_t node = graph->ready[graph->readyHead++];
+        pthread_mutex_unlock(&graph->lock);
+
+        graph->run(graph->nodes[node]);
+
+        pthread_mutex_lock(&graph->lock);
+        graph->done(graph->nodes[node]);
+        graph->finished++;
+        for (size_t i = graph->dependentStart[node]; i < graph->dependentStart[node + 1]; i++) {
+            size_t dependent = graph->dependents[i];
+            if (--graph->waiting[dependent] == 0) {
+                graph->ready[graph->readyTail++] = dependent;
+            }
+        }
+        pthread_cond_broadcast(&graph->cond);
+    }
+    pthread_mutex_unlock(&graph->lock);
+    return NULL;
+}
+
+static bool dlinit_parallel(void** nodes, size_t count, const size_t* depStart, const size_t* deps,
+                            dlinit_fn_t run, dlinit_fn_t done) {
+    const char* env = getenv(DLINIT_THREADS_ENV);
+    long cpus = env && *env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus > 1 ? (size_t)cpus : 1;
+    if (threads > count) {
+        threads = count;
+    }
+    if (threads < 2) {
+        return false;
+    }
+
+    dlinit_graph_t graph;
+    size_t edges = depStart[count];
+    graph.waiting = calloc(count, sizeof(size_t));
+    graph.dependentStart = calloc(count + 1, sizeof(size_t));
+    graph.dependents = malloc((edges ? edges : 1) * sizeof(size_t));
+    graph.ready = malloc(count * sizeof(size_t));
+    pthread_t* workers = malloc((threads - 1) * sizeof(pthread_t));
+    if (!graph.waiting || !graph.dependentStart || !graph.dependents || !graph.ready || !workers) {
+        free(graph.waiting);
+        free(graph.dependentStart);
+        free(graph.dependents);
+        free(graph.ready);
+        free(workers);
+        return false;
+    }
+
+    // Invert the dependency lists, counting sort style
+    for (size_t i = 0; i < edges; i++) {
+        graph.dependentStart[deps[i] + 1]++;
+    }
+    for (size_t i = 0; i < count; i++) {
+        graph.dependentStart[i + 1] += graph.dependentStart[i];
+    }
+    size_t* fill = graph.waiting;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = depStart[i]; j < depStart[i + 1]; j++) {
+            graph.dependents[graph.dependentStart[deps[j]] + fill[deps[j]]++] = i;
+        }
+    }
+
+    graph.readyHead = graph.readyTail = 0;
+    for (size_t i = 0; i < count; i++) {
+        graph.waiting[i] = depStart[i + 1] - depStart[i];
+        if (!graph.waiting[i]) {
+            graph.ready[graph.readyTail++] = i;
+        }
+    }
+    graph.nodes = nodes;
+    graph.count = count;
+    graph.run = run;
+    graph.done = done;
+    graph.finished = 0;
+    pthread_mutex_init(&graph.lock, NULL);
+    pthread_cond_init(&graph.cond, NULL);
+
+    // Fewer workers than asked for only costs parallelism
+    size_t started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, dlinit_worker, &graph) == 0) {
+        started++;
+    }
+    dlinit_worker(&graph);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&graph.cond);
+    pthread_mutex_destroy(&graph.lock);
+    free(graph.waiting);
+    free(graph.dependentStart);
+    free(graph.dependents);
+    free(graph.ready);
+    free(workers);
+    return true;
+}
+#endif
+
+void dlinit_run(void** nodes, size_t count, const size_t* depStart, const size_t* deps,
+                dlinit_fn_t run, dlinit_fn_t done, int parallel) {
+#ifndef _MSC_VER
+    if (parallel && dlinit_parallel(nodes, count, depStart, deps, run, done)) {
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        run(nodes[i]);
+        done(nodes[i]);
+    }
+}
@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <elf/elf64.h>
+#include <elf/elf32.h>
+#include <elf/dlpack.h>
+
+#ifndef _MSC_VER
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define DLPACK_HASH_BITS 14
+
+typedef struct {
+    char magic[8];
+    uint32_t segmentCount;
+    uint32_t blockSize;
+    uint64_t fileSize;
+    uint64_t headerSize;
+} dlpack_header_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t dataOffset;
+} dlpack_segment_t;
+
+struct dlpack {
+    FILE* file;
+    dlpack_header_t header;
+    dlpack_segment_t* segments;
+    size_t* firstBlock;         /* Of each segment, segmentCount + 1 entries */
+    uint32_t* blockSizes;
+    char* headers;
+};
+
+/* Blocks of one segment, claimed one at a time by the decoding threads */
+typedef struct {
+    const unsigned char* data;
+    const size_t* input;        /* Offset of each block in data, count + 1 entries */
+    unsigned char* dst;
+    size_t size;
+    size_t blockSize;
+    size_t count;
+    size_t next;
+} dlpack_job_t;
+
+#ifdef _MSC_VER
+// Blocks are only decoded on the calling thread
+#define dlpack_claim(job) ((job)->next++)
+#else
+#define dlpack_claim(job) __atomic_fetch_add(&(job)->next, 1, __ATOMIC_RELAXED)
+#endif
+
+dlpack_t* dlpack_open(FILE* file) {
+    dlpack_header_t header;
+    if (fseek(file, 0, SEEK_SET) == -1 || fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, DLPACK_MAGIC, sizeof(header.magic)) != 0) {
+        return NULL;
+    }
+    // Sizes come from the file, so they are bounded before anything is allocated
+    if (!header.blockSize || header.blockSize > (64 << 20) || header.segmentCount > 4096 ||
+            header.fileSize > (1ull << 40) || header.headerSize > header.fileSize ||
+            header.headerSize > (1 << 20)) {
+        return NULL;
+    }
+
+    dlpack_t* pack = calloc(1, sizeof(dlpack_t));
+    if (!pack) {
+        return NULL;
+    }
+    pack->file = file;
+    pack->header = header;
+    pack->segments = malloc((header.segmentCount ? header.segmentCount : 1) * sizeof(dlpack_segment_t));
+    pack->firstBlock = malloc((header.segmentCount + 1) * sizeof(size_t));
+    pack->headers = malloc(header.headerSize ? (size_t)header.headerSize : 1);
+    if (!pack->segments || !pack->firstBlock || !pack->headers ||
+            fread(pack->segments, sizeof(dlpack_segment_t), header.segmentCount, file) != header.segmentCount) {
+        dlpack_close(pack);
+        return NULL;
+    }
+
+    size_t blocks = 0;
+    for (uint32_t i = 0; i < header.segmentCount; i++) {
+        dlpack_segment_t* segment = &pack->segments[i];
+        if (segment->offset > header.fileSize || segment->size > header.fileSize - segment->offset) {
+            dlpack_close(pack);
+            return NULL;
+        }
+        pack->firstBlock[i] = blocks;
+        blocks += (size_t)((segment->size + header.blockSize - 1) / header.blockSize);
+    }
+    pack->firstBlock[header.segmentCount] = blocks;
+
+    pack->blockSizes = malloc((blocks ? blocks : 1) * sizeof(uint32_t));
+    if (!pack->blockSizes || fread(pack->blockSizes, sizeof(uint32_t), blocks, file) != blocks ||
+            (header.headerSize && fread(pack->headers, (size_t)header.headerSize, 1, file) != 1)) {
+        dlpack_close(pack);
+        return NULL;
+    }
+    for (size_t i = 0; i < blocks; i++) {
+        if (pack->blockSizes[i] > header.blockSize) {
+            dlpack_close(pack);
+            return NULL;
+        }
+    }
+    return pack;
+}
+
+void dlpack_close(dlpack_t* pack) {
+    if (!pack) {
+        return;
+    }
+    free(pack->segments);
+    free(pack->firstBlock);
+    free(pack->blockSizes);
+    free(pack->headers);
+    free(pack);
+}
+
+uint64_t dlpack_size(dlpack_t* pack) {
+    return pack->header.fileSize;
+}
+
+/* LZ4 length extension: 255 bytes add up until one below 255 ends it */
+static bool dlpack_readLength(const unsigned char** ip, const unsigned char* end, size_t* length) {
+    unsigned char byte;
+    do {
+        if (*ip == end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/* Decode one LZ4 block, which must fill out exactly */
+static bool dlpack_decodeBlock(const unsigned char* in, size_t inSize, unsigned char* out, size_t outSize) {
+    const unsigned char* ip = in;
+    const unsigned char* end = in + inSize;
+    unsigned char* op = out;
+    for (;;) {
+        if (ip == end) {
+            return false;
+        }
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !dlpack_readLength(&ip, end, &literals)) {
+            return false;
+        }
+        if (literals > (size_t)(end - ip) || literals > outSize - (size_t)(op - out)) {
+            return false;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence is made of literals only
+        if (ip == end) {
+            return (size_t)(op - out) == outSize;
+        }
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t distance = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !dlpack_readLength(&ip, end, &length)) {
+            return false;
+        }
+        length += 4;
+        if (!distance || distance > (size_t)(op - out) || length > outSize - (size_t)(op - out)) {
+            return false;
+        }
+
+        // An overlapping match repeats the last distance bytes. What is
+        // already copied doubles every round, and never overlaps the source.
+        const unsigned char* match = op - distance;
+        while (length) {
+            size_t chunk = (size_t)(op - match) < length ? (size_t)(op - match) : length;
+            memcpy(op, match, chunk);
+            op += chunk;
+            length -= chunk;
+        }
+    }
+}
+
+static bool dlpack_runJob(dlpack_job_t* job) {
+    bool ok = true;
+    for (size_t i = dlpack_claim(job); i < job->count; i = dlpack_claim(job)) {
+        size_t offset = i * job->blockSize;
+        size_t size = job->size - offset < job->blockSize ? job->size - offset : job->blockSize;
+        const unsigned char* in = job->data + job->input[i];
+        size_t inSize = job->input[i + 1] - job->input[i];
+        if (inSize == size) {
+            memcpy(job->dst + offset, in, size);
+        } else if (!dlpack_decodeBlock(in, inSize, job->dst + offset, size)) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+#ifndef _MSC_VER
+static void* dlpack_worker(void* arg) {
+    return dlpack_runJob(arg) ? arg : NULL;
+}
+
+static size_t dlpack_threads(size_t blocks) {
+    const char* env = getenv(DLPACK_THREADS_ENV);
+    long cpus = env && *env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus > 1 ? (size_t)cpus : 1;
+    return threads > blocks ? blocks : threads;
+}
+#endif
+
+static bool dlpack_decodeSegment(dlpack_t* pack, uint32_t index, unsigned char* dst) {
+    dlpack_segment_t* segment = &pack->segments[index];
+    size_t first = pack->firstBlock[index];
+    size_t count = pack->firstBlock[index + 1] - first;
+    size_t* input = malloc((count + 1) * sizeof(size_t));
+    if (!input) {
+        return false;
+    }
+    input[0] = 0;
+    for (size_t i = 0; i < count; i++) {
+        input[i + 1] = input[i] + pack->blockSizes[first + i];
+    }
+
+    // Blocks never grow, so a segment of the same size is stored as is
+    if (input[count] == segment->size) {
+        free(input);
+        return fseek(pack->file, (long)segment->dataOffset, SEEK_SET) != -1 &&
+            fread(dst, (size_t)segment->size, 1, pack->file) == 1;
+    }
+
+    // The compressed blocks of the segment are read in one go, then decoded
+    unsigned char* data = malloc(input[count] ? input[count] : 1);
+    bool ok = data && fseek(pack->file, (long)segment->dataOffset, SEEK_SET) != -1 &&
+        (!input[count] || fread(data, input[count], 1, pack->file) == 1);
+    if (ok) {
+        dlpack_job_t job = {
+            .data = data,
+            .input = input,
+            .dst = dst,
+            .size = (size_t)segment->size,
+            .blockSize = pack->header.blockSize,
+            .count = count,
+        };
+#ifdef _MSC_VER
+        ok = dlpack_runJob(&job);
+#else
+        // Fewer workers than asked for only costs parallelism
+        size_t threads = dlpack_threads(count);
+        pthread_t* workers = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+        size_t started = 0;
+        while (workers && started < threads - 1 &&
+                pthread_create(&workers[started], NULL, dlpack_worker, &job) == 0) {
+            started++;
+        }
+        ok = dlpack_runJob(&job);
+        for (size_t i = 0; i < started; i++) {
+            void* result;
+            pthread_join(workers[i], &result);
+            ok = ok && result;
+        }
+        free(workers);
+#endif
+    }
+    free(data);
+    free(input);
+    return ok;
+}
+
+bool dlpack_read(void* source, uint64_t offset, void* dst, size_t size) {
+    dlpack_t* pack = source;
+    uint64_t headerSize = pack->header.headerSize;
+    if (offset <= headerSize && size <= headerSize - offset) {
+        memcpy(dst, pack->headers + offset, size);
+        return true;
+    }
+    for (uint32_t i = 0; i < pack->header.segmentCount; i++) {
+        if (pack->segments[i].offset == offset && pack->segments[i].size == size) {
+            return dlpack_decodeSegment(pack, i, dst);
+        }
+    }
+    return false;
+}
+
+/* Append one LZ4 sequence, the match left out if distance is 0 */
+static bool dlpack_emit(unsigned char* out, size_t capacity, size_t* pos, const unsigned char* literals,
+                        size_t count, size_t distance, size_t length) {
+    size_t need = 1 + count / 255 + 1 + count + (distance ? 2 + length / 255 + 1 : 0);
+    if (need > capacity - *pos) {
+        return false;
+    }
+    unsigned char* op = out + *pos;
+    unsigned char* token = op++;
+    *token = (unsigned char)((count < 15 ? count : 15) << 4);
+    if (count >= 15) {
+        size_t rest = count - 15;
+        for (; rest >= 255; rest -= 255) {
+            *op++ = 255;
+        }
+        *op++ = (unsigned char)rest;
+    }
+    memcpy(op, literals, count);
+    op += count;
+    if (distance) {
+        *op++ = (unsigned char)distance;
+        *op++ = (unsigned char)(distance >> 8);
+        size_t rest = length - 4;
+        *token |= (unsigned char)(rest < 15 ? rest : 15);
+        if (rest >= 15) {
+            for (rest -= 15; rest >= 255; rest -= 255) {
+                *op++ = 255;
+            }
+            *op++ = (unsigned char)rest;
+        }
+    }
+    *pos = (size_t)(op - out);
+    return true;
+}
+
+/*
+ * Greedy LZ4 compression of one block, with a hash table of the last position
+ * of each 4-byte sequence. Returns 0 if the result would not be smaller.
+ */
+static size_t dlpack_encodeBlock(const unsigned char* in, size_t size, unsigned char* out, uint32_t* table) {
+    size_t capacity = size - 1;
+    size_t pos = 0;
+    size_t anchor = 0;
+    memset(table, 0, sizeof(uint32_t) << DLPACK_HASH_BITS);
+
+    // The last match starts 12 bytes before the end at the latest, and the
+    // last 5 bytes are always literals
+    for (size_t i = 0; size >= 13 && i < size - 12;) {
+        uint32_t sequence;
+        memcpy(&sequence, in + i, 4);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - DLPACK_HASH_BITS);
+        size_t ref = table[hash];
+        table[hash] = (uint32_t)i + 1;
+        if (!ref-- || i - ref > 65535 || memcmp(in + ref, in + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t length = 4;
+        while (i + length < size - 5 && in[ref + length] == in[i + length]) {
+            length++;
+        }
+        if (!dlpack_emit(out, capacity, &pos, in + anchor, i - anchor, i - ref, length)) {
+            return 0;
+        }
+        i += length;
+        anchor = i;
+    }
+    if (!dlpack_emit(out, capacity, &pos, in + anchor, size - anchor, 0, 0)) {
+        return 0;
+    }
+    return pos;
+}
+
+/* Find the headers and the PT_LOAD segments with file contents */
+static bool dlpack_parse(const unsigned char* elf, size_t size, uint64_t* headerSize,
+                         dlpack_segment_t** segments, uint32_t* count) {
+    if (size < EI_NIDENT || elf[EI_MAG0] != ELFMAG0 || elf[EI_MAG1] != ELFMAG1 ||
+            elf[EI_MAG2] != ELFMAG2 || elf[EI_MAG3] != ELFMAG3) {
+        return false;
+    }
+    uint64_t phoff, phentsize, phnum, ehdrSize;
+    if (elf[EI_CLASS] == ELFCLASS64 && size >= sizeof(Elf64_Ehdr)) {
+        Elf64_Ehdr header;
+        memcpy(&header, elf, sizeof(header));
+        phoff = header.e_phoff;
+        phentsize = header.e_phentsize;
+        phnum = header.e_phnum;
+        ehdrSize = sizeof(Elf64_Ehdr);
+    } else if (elf[EI_CLASS] == ELFCLASS32 && size >= sizeof(Elf32_Ehdr)) {
+        Elf32_Ehdr header;
+        memcpy(&header, elf, sizeof(header));
+        phoff = header.e_phoff;
+        phentsize = header.e_phentsize;
+        phnum = header.e_phnum;
+        ehdrSize = sizeof(Elf32_Ehdr);
+    } else {
+        return false;
+    }
+    bool is64 = elf[EI_CLASS] == ELFCLASS64;
+    if (phentsize < (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr)) || phoff > size ||
+            phnum * phentsize > size - phoff) {
+        return false;
+    }
+    *headerSize = phoff + phnum * phentsize > ehdrSize ? phoff + phnum * phentsize : ehdrSize;
+
+    *segments = malloc((phnum ? phnum : 1) * sizeof(dlpack_segment_t));
+    if (!*segments) {
+        return false;
+    }
+    *count = 0;
+    for (uint64_t i = 0; i < phnum; i++) {
+        uint64_t type, offset, filesz;
+        if (is64) {
+            Elf64_Phdr phdr;
+            memcpy(&phdr, elf + phoff + i * phentsize, sizeof(phdr));
+            type = phdr.p_type;
+            offset = phdr.p_offset;
+            filesz = phdr.p_filesz;
+        } else {
+            Elf32_Phdr phdr;
+            memcpy(&phdr, elf + phoff + i * phentsize, sizeof(phdr));
+            type = phdr.p_type;
+            offset = phdr.p_offset;
+            filesz = phdr.p_filesz;
+        }
+        if (type != PT_LOAD || !filesz) {
+            continue;
+        }
+        if (offset > size || filesz > size - offset) {
+            free(*segments);
+            return false;
+        }
+        (*segments)[*count].offset = offset;
+        (*segments)[*count].size = filesz;
+        (*count)++;
+    }
+    return true;
+}
+
+bool dlpack_write(const void* elf, size_t size, FILE* out) {
+    const unsigned char* image = elf;
+    dlpack_header_t header = {
+        .magic = DLPACK_MAGIC,
+        .blockSize = DLPACK_BLOCK,
+        .fileSize = size,
+    };
+    dlpack_segment_t* segments;
+    if (!dlpack_parse(image, size, &header.headerSize, &segments, &header.segmentCount)) {
+        return false;
+    }
+
+    size_t blocks = 0;
+    size_t total = 0;
+    for (uint32_t i = 0; i < header.segmentCount; i++) {
+        blocks += (size_t)((segments[i].size + DLPACK_BLOCK - 1) / DLPACK_BLOCK);
+        total += (size_t)segments[i].size;
+    }
+    uint32_t* blockSizes = malloc((blocks ? blocks : 1) * sizeof(uint32_t));
+    unsigned char* data = malloc(total ? total : 1);
+    uint32_t* table = malloc(sizeof(uint32_t) << DLPACK_HASH_BITS);
+    bool ok = blockSizes && data && table;
+
+    // Blocks that do not shrink are stored as they are
+    size_t block = 0;
+    size_t used = 0;
+    uint64_t dataOffset = sizeof(header) + header.segmentCount * sizeof(dlpack_segment_t) +
+        blocks * sizeof(uint32_t) + header.headerSize;
+    for (uint32_t i = 0; ok && i < header.segmentCount; i++) {
+        segments[i].dataOffset = dataOffset + used;
+        for (uint64_t offset = 0; offset < segments[i].size; offset += DLPACK_BLOCK) {
+            const unsigned char* in = image + segments[i].offset + offset;
+            size_t inSize = segments[i].size - offset < DLPACK_BLOCK ? (size_t)(segments[i].size - offset) : DLPACK_BLOCK;
+            size_t packed = dlpack_encodeBlock(in, inSize, data + used, table);
+            if (!packed) {
+                memcpy(data + used, in, inSize);
+                packed = inSize;
+            }
+            blockSizes[block++] = (uint32_t)packed;
+            used += packed;
+        }
+    }
+
+    ok = ok && fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(segments, sizeof(dlpack_segment_t), header.segmentCount, out) == header.segmentCount &&
+        fwrite(blockSizes, sizeof(uint32_t), blocks, out) == blocks &&
+        fwrite(image, (size_t)header.headerSize, 1, out) == 1 &&
+        (!used || fwrite(data, used, 1, out) == 1);
+    free(segments);
+    free(blockSizes);
+    free(data);
+    free(table);
+    return ok;
+}
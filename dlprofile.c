@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <elf/dlprofile.h>
+#include <elf/elf-common.h>
+#include <util/hashmap.h>
+
+void* alloc_exec(size_t size);
+void* exec_alias(void* ptr);
+bool protect_exec(void* ptr, const unsigned char* flags);
+void free_exec(void* ptr);
+
+/*
+ * Trampolines are allocated in chunks of one code page followed by the
+ * counters, so code is written through the alias of the chunk and counters
+ * are plain writable memory. Each trampoline takes 64 bytes of code page:
+ *
+ *     endbr64
+ *     mov %rsp, %r11
+ *     shr $12, %r11
+ *     and $7, %r11
+ *     shl $6, %r11
+ *     add base(%rip), %r11
+ *     incq (%r11)
+ *     jmp *target(%rip)
+ *
+ * with base at offset 48 and target at offset 56. A call from a PLT entry may
+ * clobber r11 and the flags. Threads run on different stacks, so the stack
+ * address picks one of 8 cache lines of counters, which keeps threads calling
+ * the same function from sharing a line most of the time. The increment is
+ * not atomic: a locked one costs several times the rest of the trampoline,
+ * and two threads only lose a count when they hit the same line at once.
+ */
+#define PROFILE_PAGE 4096
+#define PROFILE_STUB 64
+#define PROFILE_STUBS (PROFILE_PAGE / PROFILE_STUB)
+#define PROFILE_SHARDS 8
+#define PROFILE_LINE 64
+#define PROFILE_COUNTER_PAGES (PROFILE_STUBS * PROFILE_SHARDS * PROFILE_LINE / PROFILE_PAGE)
+
+typedef struct {
+    char* caller;
+    char* symbol;
+    char* counters;
+} dlprofile_entry_t;
+
+static const unsigned char stubCode[] = {
+    0xf3, 0x0f, 0x1e, 0xfa,                     // endbr64
+    0x49, 0x89, 0xe3,                           // mov %rsp, %r11
+    0x49, 0xc1, 0xeb, 0x0c,                     // shr $12, %r11
+    0x49, 0x83, 0xe3, 0x07,                     // and $7, %r11
+    0x49, 0xc1, 0xe3, 0x06,                     // shl $6, %r11
+    0x4c, 0x03, 0x1d, 48 - 26, 0, 0, 0,         // add base(%rip), %r11
+    0x49, 0xff, 0x03,                           // incq (%r11)
+    0xff, 0x25, 56 - 35, 0, 0, 0,               // jmp *target(%rip)
+};
+
+static int state = -1;
+static bool all = false;
+static char* names = NULL;
+static hashmap_t* selected = NULL;
+
+static char* chunk = NULL;
+static char* chunkAlias = NULL;
+static size_t chunkUsed = PROFILE_STUBS;
+
+static dlprofile_entry_t* entries = NULL;
+static size_t entryCount = 0;
+static size_t entryCapacity = 0;
+
+bool dlprofile_enable(const char* symbols) {
+#if defined(__x86_64__) || defined(_M_X64)
+    char* copy = strdup(symbols);
+    hashmap_t* map = hashmap_new_string(16);
+    if (!copy || !map) {
+        free(copy);
+        if (map) {
+            hashmap_dispose(map);
+        }
+        return false;
+    }
+    if (selected) {
+        hashmap_dispose(selected);
+    }
+    free(names);
+    names = copy;
+    selected = map;
+    all = false;
+    bool any = false;
+    for (char* name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+        if (strcmp(name, "*") == 0) {
+            all = true;
+        } else {
+            hashmap_put(selected, name, name);
+        }
+        any = true;
+    }
+    state = any ? 1 : 0;
+    return true;
+#else
+    // Trampolines are x86-64 code
+    (void)symbols;
+    state = 0;
+    return false;
+#endif
+}
+
+bool dlprofile_selected(const char* symbol) {
+    if (state == -1) {
+        const char* value = getenv(DLPROFILE_ENV);
+        state = 0;
+        if (value && *value) {
+            dlprofile_enable(value);
+        }
+    }
+    return state == 1 && (all || hashmap_get(selected, symbol));
+}
+
+static bool dlprofile_grow(void) {
+    char* mem = alloc_exec((1 + PROFILE_COUNTER_PAGES) * PROFILE_PAGE);
+    if (!mem) {
+        return false;
+    }
+    unsigned char flags[1 + PROFILE_COUNTER_PAGES];
+    flags[0] = PF_R | PF_X;
+    memset(flags + 1, PF_R | PF_W, PROFILE_COUNTER_PAGES);
+    if (!protect_exec(mem, flags)) {
+        free_exec(mem);
+        return false;
+    }
+    // The previous chunk is kept, its trampolines are still in use
+    chunk = mem;
+    chunkAlias = exec_alias(mem);
+    chunkUsed = 0;
+    return true;
+}
+
+void* dlprofile_trampoline(const char* caller, const char* symbol, void* target, uint64_t** targetSlot) {
+    if (entryCount == entryCapacity) {
+        size_t capacity = entryCapacity ? entryCapacity * 2 : 64;
+        dlprofile_entry_t* grown = realloc(entries, capacity * sizeof(dlprofile_entry_t));
+        if (!grown) {
+            return NULL;
+        }
+        entries = grown;
+        entryCapacity = capacity;
+    }
+    if (chunkUsed == PROFILE_STUBS && !dlprofile_grow()) {
+        return NULL;
+    }
+    dlprofile_entry_t* entry = &entries[entryCount];
+    entry->caller = strdup(caller);
+    entry->symbol = strdup(symbol);
+    if (!entry->caller || !entry->symbol) {
+        free(entry->caller);
+        free(entry->symbol);
+        return NULL;
+    }
+    entry->counters = chunk + PROFILE_PAGE + chunkUsed * PROFILE_SHARDS * PROFILE_LINE;
+    entryCount++;
+
+    char* stub = chunkAlias + chunkUsed * PROFILE_STUB;
+    memcpy(stub, stubCode, sizeof(stubCode));
+    memset(stub + sizeof(stubCode), 0xcc, 48 - sizeof(stubCode));
+    *(uint64_t*)(stub + 48) = (uint64_t)(uintptr_t)entry->counters;
+    *(uint64_t*)(stub + 56) = (uint64_t)(uintptr_t)target;
+    *targetSlot = (uint64_t*)(stub + 56);
+    return chunk + chunkUsed++ * PROFILE_STUB;
+}
+
+int dlprofile_walk(dlprofile_callback_t callback, void* data) {
+    for (size_t i = 0; i < entryCount; i++) {
+        uint64_t calls = 0;
+        for (int shard = 0; shard < PROFILE_SHARDS; shard++) {
+#ifdef _MSC_VER
+            calls += *(volatile uint64_t*)(entries[i].counters + shard * PROFILE_LINE);
+#else
+            calls += __atomic_load_n((uint64_t*)(entries[i].counters + shard * PROFILE_LINE), __ATOMIC_RELAXED);
+#endif
+        }
+        int ret = callback(entries[i].caller, entries[i].symbol, calls, data);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <elf/dlrecord.h>
+#include <util/hashmap.h>
+
+/* Calls may be recorded from any thread, each record is written whole */
+#ifdef _MSC_VER
+#include <Windows.h>
+static SRWLOCK lock = SRWLOCK_INIT;
+#define dlrecord_lock() AcquireSRWLockExclusive(&lock)
+#define dlrecord_unlock() ReleaseSRWLockExclusive(&lock)
+#else
+#include <pthread.h>
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define dlrecord_lock() pthread_mutex_lock(&lock)
+#define dlrecord_unlock() pthread_mutex_unlock(&lock)
+#endif
+
+static int state = -1;
+static FILE* output = NULL;
+static hashmap_t* strings = NULL;
+static hashmap_t* handles = NULL;
+static size_t nextString = 0;
+static size_t nextHandle = 1;
+static uint64_t lastStart = 0;
+
+static int pointer_hash(const void* ptr) {
+    size_t value = (size_t)ptr;
+    return (int)(value >> 4 ^ value >> 20);
+}
+
+static int pointer_comparator(const void* a, const void* b) {
+    return a == b ? 0 : (const char*)a < (const char*)b ? -1 : 1;
+}
+
+static bool dlrecord_startLocked(const char* file) {
+    FILE* fp = fopen(file, "wb");
+    if (!fp) {
+        return false;
+    }
+    if (fwrite(DLRECORD_MAGIC, sizeof(DLRECORD_MAGIC), 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+
+    // Ids are local to a file
+    if (strings) {
+        pair_t* it = hashmap_iterator(strings);
+        while ((it = hashmap_next(it))) {
+            free(it->first);
+        }
+        hashmap_dispose(strings);
+        hashmap_dispose(handles);
+    }
+    strings = hashmap_new_string(256);
+    handles = hashmap_new(pointer_hash, pointer_comparator, 64);
+    nextString = 0;
+    nextHandle = 1;
+    lastStart = 0;
+
+    if (!output) {
+        atexit(dlrecord_flush);
+    } else {
+        fclose(output);
+    }
+    output = fp;
+    state = strings && handles ? 1 : 0;
+    return state == 1;
+}
+
+bool dlrecord_start(const char* file) {
+    dlrecord_lock();
+    bool started = dlrecord_startLocked(file);
+    dlrecord_unlock();
+    return started;
+}
+
+bool dlrecord_enabled(void) {
+    if (state == -1) {
+        dlrecord_lock();
+        if (state == -1) {
+            const char* file = getenv(DLRECORD_ENV);
+            state = 0;
+            if (file && *file) {
+                dlrecord_startLocked(file);
+            }
+        }
+        dlrecord_unlock();
+    }
+    return state == 1;
+}
+
+void dlrecord_flush(void) {
+    dlrecord_lock();
+    if (output) {
+        fflush(output);
+    }
+    dlrecord_unlock();
+}
+
+static void dlrecord_writeVarint(uint64_t value) {
+    unsigned char buf[10];
+    size_t len = 0;
+    do {
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        buf[len++] = value ? byte | 0x80 : byte;
+    } while (value);
+    fwrite(buf, len, 1, output);
+}
+
+static void dlrecord_writeTime(uint64_t start, uint64_t end) {
+    dlrecord_writeVarint(lastStart && start > lastStart ? start - lastStart : 0);
+    dlrecord_writeVarint(end - start);
+    lastStart = start;
+}
+
+/* Strings are written once and referred to by id afterwards */
+static size_t dlrecord_string(const char* str) {
+    void* id = hashmap_get(strings, str);
+    if (id) {
+        return (size_t)id - 1;
+    }
+    size_t len = strlen(str);
+    fputc(DLRECORD_STRING, output);
+    dlrecord_writeVarint(len);
+    fwrite(str, len, 1, output);
+
+    // Without a copy the string is simply written again next time
+    char* copy = strdup(str);
+    if (copy) {
+        hashmap_put(strings, copy, (void*)(nextString + 1));
+    }
+    return nextString++;
+}
+
+static size_t dlrecord_handle(void* handle, bool assign) {
+    if (!handle) {
+        return 0;
+    }
+    size_t id = (size_t)hashmap_get(handles, handle);
+    if (!id && assign) {
+        id = nextHandle++;
+        hashmap_put(handles, handle, (void*)id);
+    }
+    return id;
+}
+
+void dlrecord_open(const char* name, int flags, void* handle, uint64_t start, uint64_t end) {
+    if (!dlrecord_enabled()) {
+        return;
+    }
+    dlrecord_lock();
+    size_t nameId = dlrecord_string(name);
+    fputc(DLRECORD_OPEN, output);
+    dlrecord_writeTime(start, end);
+    dlrecord_writeVarint(nameId);
+    dlrecord_writeVarint((unsigned)flags);
+    dlrecord_writeVarint(dlrecord_handle(handle, true));
+    dlrecord_unlock();
+}
+
+void dlrecord_sym(void* handle, const char* name, void* result, uint64_t start, uint64_t end) {
+    if (!dlrecord_enabled()) {
+        return;
+    }
+    dlrecord_lock();
+    size_t nameId = dlrecord_string(name);
+    fputc(DLRECORD_SYM, output);
+    dlrecord_writeTime(start, end);
+    dlrecord_writeVarint(dlrecord_handle(handle, false));
+    dlrecord_writeVarint(nameId);
+    dlrecord_writeVarint(result != NULL);
+    dlrecord_unlock();
+}
+
+/*
+ * The id is kept after the close: the address can only come back from a
+ * later OPEN, which the replayer uses to rebind the id.
+ */
+void dlrecord_close(void* handle, uint64_t start, uint64_t end) {
+    if (!dlrecord_enabled()) {
+        return;
+    }
+    dlrecord_lock();
+    fputc(DLRECORD_CLOSE, output);
+    dlrecord_writeTime(start, end);
+    dlrecord_writeVarint(dlrecord_handle(handle, false));
+    dlrecord_unlock();
+}
+
+void dlrecord_global(const char* name, uint64_t start) {
+    if (!dlrecord_enabled()) {
+        return;
+    }
+    dlrecord_lock();
+    size_t nameId = dlrecord_string(name);
+    fputc(DLRECORD_GLOBAL, output);
+    dlrecord_writeVarint(lastStart && start > lastStart ? start - lastStart : 0);
+    lastStart = start;
+    dlrecord_writeVarint(nameId);
+    dlrecord_unlock();
+}
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <elf/dlsearch.h>
+#include <util/hashmap.h>
+
+#ifdef _MSC_VER
+#define PATH_LIST_SEPARATOR ';'
+#define realpath(path, resolved) _fullpath(resolved, path, 0)
+#else
+#define PATH_LIST_SEPARATOR ':'
+#endif
+
+/*
+ * Cache file layout: a header, followed by `count` entries and a string table
+ * of `strsz` bytes. Entries refer to NUL-terminated strings by their offset
+ * in the string table.
+ */
+static const char cacheMagic[8] = "ELFDLC1";
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t strsz;
+} cache_header_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t path;
+} cache_entry_t;
+
+/* Subdirectory of every search directory holding per-level variants */
+#define HWCAPS_DIR "glibc-hwcaps"
+
+static char* searchPath = NULL;
+
+static hashmap_t* getCache() {
+    static hashmap_t* map = NULL;
+    if (!map) {
+        map = hashmap_new_string(64);
+    }
+    return map;
+}
+
+/* Search directory -> levels with a variant directory, see dlsearch_variants */
+static hashmap_t* getVariants() {
+    static hashmap_t* map = NULL;
+    if (!map) {
+        map = hashmap_new_string(16);
+    }
+    return map;
+}
+
+/*
+ * Each cache entry is a single allocation holding "name\0path\0". The key
+ * points at the start of the block and the value right after the name.
+ */
+static void dlsearch_cacheRemove(const char* name) {
+    char* value = hashmap_remove(getCache(), name);
+    if (value) {
+        free(value - strlen(name) - 1);
+    }
+}
+
+static void dlsearch_cachePut(const char* name, const char* path) {
+    size_t nameLen = strlen(name);
+    size_t pathLen = strlen(path);
+    char* block = malloc(nameLen + pathLen + 2);
+    if (!block) {
+        return;
+    }
+    memcpy(block, name, nameLen + 1);
+    memcpy(block + nameLen + 1, path, pathLen + 1);
+
+    dlsearch_cacheRemove(name);
+    hashmap_put(getCache(), block, block + nameLen + 1);
+}
+
+void dlsearch_addPath(const char* path) {
+    size_t oldLen = searchPath ? strlen(searchPath) : 0;
+    size_t len = strlen(path);
+    char* list = realloc(searchPath, oldLen + len + 2);
+    if (!list) {
+        return;
+    }
+    if (oldLen) {
+        list[oldLen++] = PATH_LIST_SEPARATOR;
+    }
+    memcpy(list + oldLen, path, len + 1);
+    searchPath = list;
+}
+
+bool dlsearch_loadCache(const char* file) {
+    FILE* fp = fopen(file, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    cache_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+            memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0) {
+        fclose(fp);
+        return false;
+    }
+
+    size_t tableSize = header.count * sizeof(cache_entry_t);
+    char* blob = malloc(tableSize + header.strsz + 1);
+    if (!blob) {
+        fclose(fp);
+        return false;
+    }
+    if (tableSize + header.strsz && fread(blob, tableSize + header.strsz, 1, fp) != 1) {
+        free(blob);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    // Guarantee termination of the last string even for a corrupted file
+    char* strings = blob + tableSize;
+    strings[header.strsz] = 0;
+
+    cache_entry_t* entries = (cache_entry_t*)blob;
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (entries[i].name < header.strsz && entries[i].path < header.strsz) {
+            dlsearch_cachePut(strings + entries[i].name, strings + entries[i].path);
+        }
+    }
+    free(blob);
+    return true;
+}
+
+bool dlsearch_saveCache(const char* file) {
+    cache_header_t header;
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.count = 0;
+    header.strsz = 0;
+
+    pair_t* it = hashmap_iterator(getCache());
+    while ((it = hashmap_next(it))) {
+        header.count++;
+        header.strsz += (uint32_t)(strlen(it->first) + strlen(it->second) + 2);
+    }
+
+    FILE* fp = fopen(file, "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    uint32_t offset = 0;
+    it = hashmap_iterator(getCache());
+    while ((it = hashmap_next(it))) {
+        cache_entry_t entry;
+        entry.name = offset;
+        offset += (uint32_t)strlen(it->first) + 1;
+        entry.path = offset;
+        offset += (uint32_t)strlen(it->second) + 1;
+        ok = ok && fwrite(&entry, sizeof(entry), 1, fp) == 1;
+    }
+
+    it = hashmap_iterator(getCache());
+    while ((it = hashmap_next(it))) {
+        ok = ok && fwrite(it->first, strlen(it->first) + 1, 1, fp) == 1;
+        ok = ok && fwrite(it->second, strlen(it->second) + 1, 1, fp) == 1;
+    }
+
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+static FILE* dlsearch_tryFile(char* path, char** result) {
+    FILE* file = fopen(path, "rb");
+    if (file) {
+        *result = path;
+    } else {
+        free(path);
+    }
+    return file;
+}
+
+/*
+ * Set of levels N for which dir/glibc-hwcaps/x86-64-vN exists, as a bit mask.
+ * Each search directory is examined once, the first time it is searched, so
+ * later lookups do not open files in variant directories that do not exist.
+ * Bit 0 marks the directory as examined. dir ends in a separator or is empty.
+ */
+static unsigned dlsearch_variants(const char* dir, size_t dirLen) {
+    char* key = malloc(dirLen + sizeof(HWCAPS_DIR) + 16);
+    if (!key) {
+        return 1;
+    }
+    memcpy(key, dir, dirLen);
+    key[dirLen] = 0;
+    unsigned mask = (unsigned)(uintptr_t)hashmap_get(getVariants(), key);
+    if (mask) {
+        free(key);
+        return mask;
+    }
+
+    mask = 1;
+    struct stat st;
+    strcpy(key + dirLen, HWCAPS_DIR);
+    if (stat(dirLen ? key : HWCAPS_DIR, &st) == 0) {
+        for (int l = 2; l <= 9; l++) {
+            sprintf(key + dirLen, HWCAPS_DIR "/x86-64-v%d", l);
+            if (stat(key, &st) == 0) {
+                mask |= 1u << l;
+            }
+        }
+    }
+    key[dirLen] = 0;
+    hashmap_put(getVariants(), key, (void*)(uintptr_t)mask);
+    return mask;
+}
+
+/*
+ * Try name inside a directory, preferring the variants built for an x86-64
+ * level, from level down to x86-64-v2, in the glibc-hwcaps subdirectories.
+ * An empty directory denotes the current directory.
+ */
+static FILE* dlsearch_tryDir(const char* dir, size_t dirLen, const char* name, int level, char** result) {
+    size_t nameLen = strlen(name);
+    char* path = malloc(dirLen + sizeof(HWCAPS_DIR) + nameLen + 32);
+    if (!path) {
+        return NULL;
+    }
+    char* p = path;
+    memcpy(p, dir, dirLen);
+    p += dirLen;
+    if (p != path && p[-1] != '/') {
+        *p++ = '/';
+    }
+
+    unsigned variants = level >= 2 ? dlsearch_variants(path, p - path) : 0;
+    for (int l = level; l >= 2; l--) {
+        if (!(variants & 1u << l)) {
+            continue;
+        }
+        sprintf(p, HWCAPS_DIR "/x86-64-v%d/%s", l, name);
+        FILE* file = fopen(path, "rb");
+        if (file) {
+            *result = path;
+            return file;
+        }
+    }
+
+    memcpy(p, name, nameLen + 1);
+    return dlsearch_tryFile(path, result);
+}
+
+int dlsearch_level(const char* path) {
+    const char* dir = strstr(path, HWCAPS_DIR "/x86-64-v");
+    if (!dir) {
+        return 0;
+    }
+    int level = dir[sizeof(HWCAPS_DIR) + 8] - '0';
+    return level >= 2 && level <= 9 && dir[sizeof(HWCAPS_DIR) + 9] == '/' ? level : 0;
+}
+
+static FILE* dlsearch_tryList(const char* list, const char* name, const char* origin, int level, char** result) {
+    if (!list) {
+        return NULL;
+    }
+
+    const char* end;
+    for (const char* dir = list; ; dir = end + 1) {
+        end = strchr(dir, PATH_LIST_SEPARATOR);
+        if (!end) {
+            end = dir + strlen(dir);
+        }
+        size_t dirLen = end - dir;
+
+        // $ORIGIN stands for the directory of the requesting library
+        const char* prefix = "";
+        size_t prefixLen = 0;
+        bool expand = false;
+        if (dirLen >= 7 && strncmp(dir, "$ORIGIN", 7) == 0) {
+            dir += 7;
+            dirLen -= 7;
+            expand = true;
+        } else if (dirLen >= 9 && strncmp(dir, "${ORIGIN}", 9) == 0) {
+            dir += 9;
+            dirLen -= 9;
+            expand = true;
+        }
+        if (expand && origin) {
+            const char* slash = strrchr(origin, '/');
+#ifdef _MSC_VER
+            const char* backslash = strrchr(origin, '\\');
+            if (backslash > slash) slash = backslash;
+#endif
+            if (slash) {
+                prefix = origin;
+                prefixLen = slash - origin;
+            } else {
+                prefix = ".";
+                prefixLen = 1;
+            }
+        }
+
+        char* path = malloc(prefixLen + dirLen + 1);
+        if (!path) {
+            return NULL;
+        }
+        memcpy(path, prefix, prefixLen);
+        memcpy(path + prefixLen, dir, dirLen);
+        path[prefixLen + dirLen] = 0;
+
+        FILE* file = dlsearch_tryDir(path, prefixLen + dirLen, name, level, result);
+        free(path);
+        if (file) {
+            return file;
+        }
+        if (!*end) {
+            return NULL;
+        }
+    }
+}
+
+FILE* dlsearch_open(const char* name, const char* origin, const char* rpath, const char* runpath, int level, char** path) {
+    const char* slash = strrchr(name, '/');
+#ifdef _MSC_VER
+    const char* backslash = strrchr(name, '\\');
+    if (backslash > slash) slash = backslash;
+#endif
+    // Names with a directory are opened exactly as given
+    if (slash) {
+        char* copy = strdup(name);
+        return copy ? dlsearch_tryFile(copy, path) : NULL;
+    }
+
+    // The per-library lists and the environment depend on the requester and
+    // may change, so they are always searched and never cached
+    FILE* file = NULL;
+    if (!runpath) {
+        file = dlsearch_tryList(rpath, name, origin, level, path);
+    }
+    if (!file) {
+        file = dlsearch_tryList(getenv(DLSEARCH_ENV), name, origin, level, path);
+    }
+    if (!file) {
+        file = dlsearch_tryList(runpath, name, origin, level, path);
+    }
+    if (file) {
+        return file;
+    }
+
+    // The result depends on the level, so it is part of the cache key
+    char levelKey[24] = "";
+    if (level >= 2) {
+        sprintf(levelKey, "@x86-64-v%d", level);
+    }
+    char* key = malloc(strlen(name) + strlen(levelKey) + 1);
+    if (!key) {
+        return NULL;
+    }
+    strcat(strcpy(key, name), levelKey);
+
+    // A cache hit replaces the fallback search with one hash probe and a
+    // single open. A stale entry is dropped and the search takes over.
+    const char* cached = hashmap_get(getCache(), key);
+    if (cached) {
+        char* copy = strdup(cached);
+        file = copy ? dlsearch_tryFile(copy, path) : NULL;
+        if (file) {
+            free(key);
+            return file;
+        }
+        dlsearch_cacheRemove(key);
+    }
+
+    file = dlsearch_tryList(searchPath, name, origin, level, path);
+    if (!file) {
+        file = dlsearch_tryList("", name, origin, level, path);
+    }
+
+    // Remember where the library was found so the next lookup is a probe.
+    // The path is made absolute, the cache outlives the working directory
+    // and may be saved for other processes.
+    if (file) {
+        char* absolute = realpath(*path, NULL);
+        if (absolute) {
+            dlsearch_cachePut(key, absolute);
+            free(absolute);
+        }
+    }
+    free(key);
+    return file;
+}
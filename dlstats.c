@@ -0,0 +1,79 @@
+#include <elf/dlstats.h>
+#include <elf/dltrace.h>
+
+#ifdef _MSC_VER
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t dlstats_now(void) {
+#ifdef _MSC_VER
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static const char* const phaseNames[DL_PHASE_COUNT] = {
+    "read", "map", "deps", "resolve", "relocate", "init"
+};
+
+dl_mark_t dlstats_mark(void) {
+    dl_mark_t mark;
+#ifdef DL_PERF_COUNTERS
+    perfcount_read(mark.counters);
+#endif
+    mark.ns = dlstats_now();
+    return mark;
+}
+
+/* Account the time since start to phase and return a mark for the next one */
+dl_mark_t dlstats_phase(dl_stats_t* stats, int phase, const char* lib, dl_mark_t start) {
+    dl_mark_t now = dlstats_mark();
+    stats->phaseNs[phase] += now.ns - start.ns;
+    dltrace_span(phaseNames[phase], lib, start.ns, now.ns);
+#ifdef DL_PERF_COUNTERS
+    static int buckets[DL_PHASE_COUNT];
+    static bool registered = false;
+    if (!registered) {
+        for (int i = 0; i < DL_PHASE_COUNT; i++) {
+            buckets[i] = perfcount_bucket(phaseNames[i]);
+        }
+        registered = true;
+    }
+    perfcount_account(buckets[phase], start.counters);
+#endif
+    return now;
+}
+
+void dlstats_add(dl_stats_t* total, const dl_stats_t* stats) {
+    total->loads += stats->loads;
+    for (int i = 0; i < DL_PHASE_COUNT; i++) {
+        total->phaseNs[i] += stats->phaseNs[i];
+    }
+    total->bytesRead += stats->bytesRead;
+    total->bytesCopied += stats->bytesCopied;
+    total->symbolsExported += stats->symbolsExported;
+    total->symbolsImported += stats->symbolsImported;
+    for (int i = 0; i < DL_RELOC_TYPES; i++) {
+        total->relocations[i] += stats->relocations[i];
+    }
+    total->pltBypassed += stats->pltBypassed;
+    total->bytesShared += stats->bytesShared;
+    total->hashLookups += stats->hashLookups;
+    total->hashProbes += stats->hashProbes;
+    if (stats->hashMaxChain > total->hashMaxChain) {
+        total->hashMaxChain = stats->hashMaxChain;
+    }
+    total->memory += stats->memory;
+}
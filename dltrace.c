@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <elf/dltrace.h>
+#include <util/hashmap.h>
+
+#ifdef _MSC_VER
+#include <Windows.h>
+#include <process.h>
+#define getpid _getpid
+#define dltrace_tid() ((int)GetCurrentThreadId())
+#else
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#define dltrace_tid() ((int)syscall(SYS_gettid))
+#else
+#define dltrace_tid() ((int)getpid())
+#endif
+#endif
+
+typedef struct {
+    const char* name;
+    const char* lib;
+    uint64_t start;
+    uint64_t end;
+    // Thread that recorded the span, parallel initializers run on several
+    int tid;
+} span_t;
+
+static int state = -1;
+static char* output = NULL;
+static span_t* spans = NULL;
+static size_t spanCount = 0;
+static size_t spanCapacity = 0;
+static hashmap_t* libNames = NULL;
+
+bool dltrace_start(const char* file) {
+    char* copy = strdup(file);
+    if (!copy) {
+        return false;
+    }
+    if (!libNames) {
+        libNames = hashmap_new_string(64);
+        if (!libNames) {
+            free(copy);
+            return false;
+        }
+    }
+    if (!output) {
+        atexit(dltrace_flush);
+    }
+    free(output);
+    output = copy;
+    state = 1;
+    return true;
+}
+
+bool dltrace_enabled(void) {
+    if (state == -1) {
+        const char* file = getenv(DLTRACE_ENV);
+        state = 0;
+        if (file && *file) {
+            dltrace_start(file);
+        }
+    }
+    return state == 1;
+}
+
+/* Library names are interned as spans outlive the handles they refer to */
+static const char* dltrace_intern(const char* lib) {
+    char* name = hashmap_get(libNames, lib);
+    if (!name) {
+        name = strdup(lib);
+        if (!name) {
+            return "?";
+        }
+        hashmap_put(libNames, name, name);
+    }
+    return name;
+}
+
+void dltrace_span(const char* name, const char* lib, uint64_t start, uint64_t end) {
+    if (!dltrace_enabled()) {
+        return;
+    }
+    if (spanCount == spanCapacity) {
+        size_t capacity = spanCapacity ? spanCapacity * 2 : 256;
+        span_t* grown = realloc(spans, capacity * sizeof(span_t));
+        if (!grown) {
+            return;
+        }
+        spans = grown;
+        spanCapacity = capacity;
+    }
+    span_t* span = &spans[spanCount++];
+    span->name = name;
+    span->lib = dltrace_intern(lib);
+    span->start = start;
+    span->end = end;
+    span->tid = dltrace_tid();
+}
+
+static void dltrace_writeString(FILE* file, const char* str) {
+    fputc('"', file);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+            fputc(*str, file);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(file, "\\u%04x", *str);
+        } else {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+void dltrace_flush(void) {
+    if (!output || !spanCount) {
+        return;
+    }
+    FILE* file = fopen(output, "w");
+    if (!file) {
+        return;
+    }
+
+    int pid = (int)getpid();
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    for (size_t i = 0; i < spanCount; i++) {
+        span_t* span = &spans[i];
+        fprintf(file, "%s\n{\"name\":", i ? "," : "");
+        dltrace_writeString(file, span->name);
+        fprintf(file, ",\"cat\":\"dl\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"lib\":",
+            span->start / 1000.0, (span->end - span->start) / 1000.0, pid, span->tid);
+        dltrace_writeString(file, span->lib);
+        fputs("}}", file);
+    }
+    fputs("\n]}\n", file);
+    fclose(file);
+}
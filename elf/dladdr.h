@@ -0,0 +1,50 @@
+#ifndef NORLIT_ELF_DLADDR_H
+#define NORLIT_ELF_DLADDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Result of a reverse lookup, following the layout of Dl_info */
+typedef struct {
+    const char* dli_fname;  /* Path of the image containing the address */
+    void* dli_fbase;        /* Base address of that image */
+    const char* dli_sname;  /* Symbol containing the address, or NULL */
+    void* dli_saddr;        /* Address of that symbol, or NULL */
+} dl_info_t;
+
+typedef struct {
+    uintptr_t addr;
+    size_t size;
+    const char* name;
+} dladdr_symbol_t;
+
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    const char* path;
+    size_t count;
+    size_t capacity;
+    dladdr_symbol_t symbols[];
+} dladdr_image_t;
+
+/*
+ * Images are built by the loaders with room for `capacity` symbols, then
+ * published with dladdr_insert, which sorts the symbols by address and drops
+ * those without a size that fall within a sized one. Once published an image
+ * is immutable. dladdr_remove unpublishes and frees it,
+ * deferring the free while a lookup may still be reading it.
+ */
+dladdr_image_t* dladdr_newImage(const void* base, size_t size, const char* path, size_t capacity);
+void dladdr_addSymbol(dladdr_image_t* image, const void* addr, size_t size, const char* name);
+void dladdr_insert(dladdr_image_t* image);
+void dladdr_remove(dladdr_image_t* image);
+size_t dladdr_imageSize(const dladdr_image_t* image);
+
+/*
+ * Map an address to its image and symbol in O(log n). Lookups take no locks
+ * and do not allocate, so they may be called from signal handlers. Returns 0
+ * if the address is not inside a loaded image.
+ */
+int dladdr_lookup(const void* addr, dl_info_t* info);
+
+#endif
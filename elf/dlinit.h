@@ -0,0 +1,25 @@
+#ifndef NORLIT_ELF_DLINIT_H
+#define NORLIT_ELF_DLINIT_H
+
+#include <stddef.h>
+
+/* Environment variable overriding the thread count, one per CPU by default */
+#define DLINIT_THREADS_ENV "ELF_DL_INIT_THREADS"
+
+typedef void (*dlinit_fn_t)(void* node);
+
+/*
+ * Run the initializers of a dependency graph. nodes are in dependency order:
+ * the dependencies of node i are deps[depStart[i]] to deps[depStart[i + 1] - 1],
+ * all of them indices below i. run is called for a node once run and done
+ * have returned for all its dependencies, possibly on another thread and
+ * concurrently with nodes of independent subtrees. done follows run on the
+ * same thread, but calls to done are serialized.
+ *
+ * With parallel unset, or without thread support, every node is run on the
+ * calling thread in order.
+ */
+void dlinit_run(void** nodes, size_t count, const size_t* depStart, const size_t* deps,
+                dlinit_fn_t run, dlinit_fn_t done, int parallel);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef NORLIT_ELF_DLPACK_H
+#define NORLIT_ELF_DLPACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Environment variable overriding the decoding thread count, one per CPU by default */
+#define DLPACK_THREADS_ENV "ELF_DL_PACK_THREADS"
+
+#define DLPACK_MAGIC "\177ELFLZ4"
+
+/* Uncompressed bytes per block, the unit of parallel decoding */
+#define DLPACK_BLOCK (256 * 1024)
+
+/*
+ * Compressed container of a shared library, which the loaders open from a
+ * path in place of the library itself. The ELF and program headers are kept
+ * as they are. The contents of each PT_LOAD segment are cut into blocks of
+ * DLPACK_BLOCK bytes, each compressed on its own in the LZ4 block format, or
+ * stored as is when that does not make it smaller. A segment is decoded
+ * straight into its place in the image, its blocks in parallel. Anything
+ * outside the headers and the loaded segments, such as section headers and
+ * debug information, is left out.
+ *
+ * The file is laid out as follows, little-endian:
+ *
+ *   header    magic[8], u32 segmentCount, u32 blockSize, u64 fileSize,
+ *             u64 headerSize
+ *   segments  segmentCount x { u64 offset, u64 size, u64 dataOffset }
+ *   blocks    u32 compressed size of every block, segment after segment
+ *   headers   the first headerSize bytes of the library
+ *   data      the compressed blocks, segment after segment
+ *
+ * offset and size locate a segment in the library, fileSize is its size.
+ * dataOffset locates the first block of the segment in the container.
+ */
+typedef struct dlpack dlpack_t;
+
+/*
+ * Read the tables of a container. Returns NULL, with the position of file
+ * undefined, if file is not a well-formed container. The file must stay open
+ * until dlpack_close.
+ */
+dlpack_t* dlpack_open(FILE* file);
+void dlpack_close(dlpack_t* pack);
+
+/* Size of the packed library, as seen through dlpack_read */
+uint64_t dlpack_size(dlpack_t* pack);
+
+/*
+ * Read size bytes at offset from the packed library. Only ranges within the
+ * headers and whole PT_LOAD segments can be read.
+ */
+bool dlpack_read(void* pack, uint64_t offset, void* dst, size_t size);
+
+/* Write a container for the ELF image of size bytes at elf */
+bool dlpack_write(const void* elf, size_t size, FILE* out);
+
+#endif
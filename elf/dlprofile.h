@@ -0,0 +1,33 @@
+#ifndef NORLIT_ELF_DLPROFILE_H
+#define NORLIT_ELF_DLPROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Symbols whose calls through the PLT are counted: "*" for all of them or a
+ * comma-separated list of names. Unset or empty disables the profiler.
+ */
+#define DLPROFILE_ENV "ELF_DL_PROFILE"
+
+typedef int (*dlprofile_callback_t)(const char* caller, const char* symbol, uint64_t calls, void* data);
+
+/* Select symbols as DLPROFILE_ENV does, for libraries loaded from now on */
+bool dlprofile_enable(const char* symbols);
+bool dlprofile_selected(const char* symbol);
+
+/*
+ * Build a trampoline counting the calls from caller to symbol before jumping
+ * to target, or return NULL if that is not possible. *targetSlot receives the
+ * address of the jump target, which may be replaced atomically later on.
+ * Trampolines live as long as the process, so counts outlive the libraries.
+ */
+void* dlprofile_trampoline(const char* caller, const char* symbol, void* target, uint64_t** targetSlot);
+
+/*
+ * Report the calls counted so far, one callback per trampoline, until the
+ * callback returns non-zero. A pair shows up once per load of its caller.
+ */
+int dlprofile_walk(dlprofile_callback_t callback, void* data);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef NORLIT_ELF_DLRECORD_H
+#define NORLIT_ELF_DLRECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Setting this environment variable to a file name enables recording */
+#define DLRECORD_ENV "ELF_DL_RECORD"
+
+#define DLRECORD_MAGIC "ELFDLR1"
+
+/*
+ * Record the calls made through the public loader API to a compact binary
+ * trace, so that a workload can be replayed offline (see bench/dlreplay.c).
+ *
+ * The file starts with the 8 bytes of DLRECORD_MAGIC including its NUL,
+ * followed by records. A record is an opcode byte followed by unsigned LEB128
+ * fields:
+ *
+ *   STRING  length, bytes          defines the next string id, from 0
+ *   OPEN    delta, duration, name, flags, handle
+ *   SYM     delta, duration, handle, name, found
+ *   CLOSE   delta, duration, handle
+ *   GLOBAL  delta, name
+ *
+ * delta is the time in ns since the start of the previous call and duration
+ * the time spent in the call. Names are string ids. Handles are ids from 1
+ * assigned to each distinct handle returned by OPEN, 0 denoting failure. An id
+ * may be reused by a later OPEN once its handle was closed.
+ */
+enum {
+    DLRECORD_STRING,
+    DLRECORD_OPEN,
+    DLRECORD_SYM,
+    DLRECORD_CLOSE,
+    DLRECORD_GLOBAL
+};
+
+bool dlrecord_start(const char* file);
+void dlrecord_flush(void);
+
+bool dlrecord_enabled(void);
+void dlrecord_open(const char* name, int flags, void* handle, uint64_t start, uint64_t end);
+void dlrecord_sym(void* handle, const char* name, void* result, uint64_t start, uint64_t end);
+void dlrecord_close(void* handle, uint64_t start, uint64_t end);
+void dlrecord_global(const char* name, uint64_t start);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef NORLIT_ELF_DLSEARCH_H
+#define NORLIT_ELF_DLSEARCH_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/* Environment variable holding additional search directories */
+#define DLSEARCH_ENV "ELF_LIBRARY_PATH"
+
+void dlsearch_addPath(const char* path);
+bool dlsearch_loadCache(const char* file);
+bool dlsearch_saveCache(const char* file);
+
+/*
+ * Locate and open a library. Names containing a directory separator are used
+ * verbatim. Otherwise DT_RPATH (only if there is no DT_RUNPATH), DLSEARCH_ENV
+ * and DT_RUNPATH are searched, followed by the paths added through
+ * dlsearch_addPath and finally the current directory. Only this last fallback
+ * is cached: the cache is probed in its place and remembers what it found,
+ * by name and level. origin is the path of the requesting library and is used
+ * for $ORIGIN expansion. On success the resolved path is returned through path
+ * and must be freed by the caller.
+ *
+ * Within each search directory the variants in glibc-hwcaps/x86-64-vN are
+ * preferred, for N from level down to 2. A level below 2 disables the probing.
+ * Which variant directories exist is looked up once per search directory.
+ */
+FILE* dlsearch_open(const char* name, const char* origin, const char* rpath, const char* runpath, int level, char** path);
+
+/* x86-64 level of the variant a resolved path points to, 0 if none */
+int dlsearch_level(const char* path);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef NORLIT_ELF_DLSTATS_H
+#define NORLIT_ELF_DLSTATS_H
+
+#include <stdint.h>
+
+#ifdef DL_PERF_COUNTERS
+#include <util/perfcount.h>
+#endif
+
+/* dlinfo request filling a dl_stats_t */
+#define RTLD_DI_STATS 1
+
+enum {
+    DL_PHASE_READ,      /* Locating the file and reading its headers */
+    DL_PHASE_MAP,       /* Reserving the image and loading segments */
+    DL_PHASE_DEPS,      /* Dynamic section parsing and DT_NEEDED loading */
+    DL_PHASE_RESOLVE,   /* Symbol resolution */
+    DL_PHASE_RELOCATE,  /* Applying relocations */
+    DL_PHASE_INIT,      /* Running initializers */
+    DL_PHASE_COUNT
+};
+
+/* Relocation types at or above the last bucket share it */
+#define DL_RELOC_TYPES 64
+
+typedef struct {
+    uint64_t loads;
+    uint64_t phaseNs[DL_PHASE_COUNT];
+    uint64_t bytesRead;
+    uint64_t bytesCopied;
+    uint64_t symbolsExported;
+    uint64_t symbolsImported;
+    uint64_t relocations[DL_RELOC_TYPES];
+    uint64_t pltBypassed;
+    uint64_t bytesShared;
+    uint64_t hashLookups;
+    uint64_t hashProbes;
+    uint64_t hashMaxChain;
+    uint64_t memory;
+} dl_stats_t;
+
+/*
+ * Point in time at which a phase starts. Instrumentation builds (with
+ * DL_PERF_COUNTERS defined) also snapshot hardware counters, which are
+ * aggregated per phase into perfcount buckets.
+ */
+typedef struct {
+    uint64_t ns;
+#ifdef DL_PERF_COUNTERS
+    uint64_t counters[PERFCOUNT_EVENTS];
+#endif
+} dl_mark_t;
+
+uint64_t dlstats_now(void);
+dl_mark_t dlstats_mark(void);
+dl_mark_t dlstats_phase(dl_stats_t* stats, int phase, const char* lib, dl_mark_t start);
+void dlstats_add(dl_stats_t* total, const dl_stats_t* stats);
+
+#endif
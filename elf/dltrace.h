@@ -0,0 +1,21 @@
+#ifndef NORLIT_ELF_DLTRACE_H
+#define NORLIT_ELF_DLTRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Setting this environment variable to a file name enables tracing */
+#define DLTRACE_ENV "ELF_DL_TRACE"
+
+/*
+ * Record loader activity as Chrome trace-event JSON (loadable in
+ * chrome://tracing and Perfetto). Events are buffered in memory and written
+ * to file when the process exits or dltrace_flush is called.
+ */
+bool dltrace_start(const char* file);
+void dltrace_flush(void);
+
+bool dltrace_enabled(void);
+void dltrace_span(const char* name, const char* lib, uint64_t start, uint64_t end);
+
+#endif
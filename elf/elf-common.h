@@ -52,7 +52,8 @@ enum {
     EM_68K = 4,
     EM_88K = 5,
     EM_860 = 7,
-    EM_MIPS = 8
+    EM_MIPS = 8,
+    EM_X86_64 = 62
 };
 
 enum {
@@ -104,6 +105,11 @@ enum {
     DT_DEBUG = 21,
     DT_TEXTREL = 22,
     DT_JMPREL = 23,
+    DT_INIT_ARRAY = 25,
+    DT_FINI_ARRAY = 26,
+    DT_INIT_ARRAYSZ = 27,
+    DT_FINI_ARRAYSZ = 28,
+    DT_RUNPATH = 29,
     DT_LOPROC = 0x70000000,
     DT_HIPROC = 0x7fffffff
 };
@@ -126,6 +132,17 @@ enum {
     STB_HIPROC = 15
 };
 
+enum {
+    STT_NOTYPE = 0,
+    STT_OBJECT = 1,
+    STT_FUNC = 2,
+    STT_SECTION = 3,
+    STT_FILE = 4,
+    STT_GNU_IFUNC = 10,
+    STT_LOPROC = 13,
+    STT_HIPROC = 15
+};
+
 enum {
     PT_NULL = 0,
     PT_LOAD = 1,
@@ -134,8 +151,18 @@ enum {
     PT_NOTE = 4,
     PT_SHLIB = 5,
     PT_PHDR = 6,
+    PT_TLS = 7,
+    PT_GNU_EH_FRAME = 0x6474E550,
+    PT_GNU_STACK = 0x6474E551,
+    PT_GNU_RELRO = 0x6474E552,
     PT_LOPROC = 0x70000000,
     PT_HIPROC = 0x7FFFFFFF
 };
 
+enum {
+    PF_X = 1,
+    PF_W = 2,
+    PF_R = 4
+};
+
 #endif
\ No newline at end of file
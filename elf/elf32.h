@@ -16,7 +16,8 @@ enum {
     R_386_JMP_SLOT = 7,
     R_386_RELATIVE = 8,
     R_386_GOTOFF = 9,
-    R_386_GOTPC = 10
+    R_386_GOTPC = 10,
+    R_386_IRELATIVE = 42
 };
 
 typedef uint16_t Elf32_Half;
@@ -2,15 +2,69 @@
 #define NORLIT_ELF_ELF32_DL_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+#include "elf32.h"
+#include "dlstats.h"
+#include "dladdr.h"
+
+/* Environment variable holding the initial cache limit of ELF32_dlcache */
+#define DLCACHE_ENV "ELF_DL_CACHE"
 
 #define RTLD_LAZY 0
 #define RTLD_NOW 1
 #define RTLD_GLOBAL 2
 #define RTLD_LOCAL 0
+/* Only succeed if the library is already open */
+#define RTLD_NOLOAD 4
+/* Never unload the library, dlclose only drops the reference */
+#define RTLD_NODELETE 0x1000
+/*
+ * Run initializers of independent libraries concurrently. They must not call
+ * into the loader while doing so.
+ */
+#define RTLD_PARALLEL_INIT 0x10000
+
+/* dlinfo request for the x86-64 level of the loaded variant, see dlsearch_open */
+#define RTLD_DI_LEVEL 2
+
+/*
+ * Image description passed to ELF32_iterate_phdr callbacks, laid out like
+ * struct dl_phdr_info. dlpi_adds and dlpi_subs count images loaded and
+ * unloaded so far, so a caller can cache what it derived from a previous
+ * walk for as long as both are unchanged. TLS is not supported.
+ */
+typedef struct {
+    uintptr_t dlpi_addr;
+    const char* dlpi_name;
+    const Elf32_Phdr* dlpi_phdr;
+    uint16_t dlpi_phnum;
+    unsigned long long dlpi_adds;
+    unsigned long long dlpi_subs;
+    size_t dlpi_tls_modid;
+    void* dlpi_tls_data;
+} elf32_phdr_info_t;
+
+typedef int (*elf32_phdr_callback_t)(elf32_phdr_info_t* info, size_t size, void* data);
 
 void* ELF32_dlopen(const char* name, int flags);
+/* Load an image from memory. The buffer is only read during the call. */
+void* ELF32_dlopen_mem(const void* buf, size_t len, const char* name, int flags);
 void* ELF32_dlsym(void* handle, const char* name);
 void ELF32_dlclose(void* handle);
+int ELF32_dlinfo(void* handle, int request, void* arg);
+void ELF32_dlstats(dl_stats_t* stats);
+/* Async-signal-safe, see dladdr_lookup */
+int ELF32_dladdr(const void* addr, dl_info_t* info);
+/* Walk loaded images in load order until the callback returns non-zero */
+int ELF32_iterate_phdr(elf32_phdr_callback_t callback, void* data);
+/*
+ * Keep up to bytes worth of closed libraries resident, already relocated, so
+ * that opening them again only restores their writable segments and reruns
+ * their initializers. 0 disables the cache. The initial limit is read from
+ * DLCACHE_ENV. Libraries loaded while the cache is disabled are never cached.
+ */
+void ELF32_dlcache(size_t bytes);
 char* ELF32_dlerror(void);
 void ELF32_addGlobalSymbol(const char* name, void* symbol);
 
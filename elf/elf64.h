@@ -9,6 +9,7 @@ enum {
     R_X86_64_GLOB_DAT = 6,
     R_X86_64_JUMP_SLOT = 7,
     R_X86_64_RELATIVE = 8,
+    R_X86_64_IRELATIVE = 37,
 };
 
 typedef uint16_t Elf64_Half;
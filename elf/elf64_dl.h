@@ -2,15 +2,121 @@
 #define NORLIT_ELF_ELF64_DL_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+#include "elf64.h"
+#include "dlstats.h"
+#include "dladdr.h"
+#include "dlprofile.h"
+
+/* Environment variable holding the initial cache limit of ELF64_dlcache */
+#define DLCACHE_ENV "ELF_DL_CACHE"
 
 #define RTLD_LAZY 0
 #define RTLD_NOW 1
 #define RTLD_GLOBAL 2
 #define RTLD_LOCAL 0
+/* Only succeed if the library is already open */
+#define RTLD_NOLOAD 4
+/* Never unload the library, dlclose only drops the reference */
+#define RTLD_NODELETE 0x1000
+/*
+ * Run initializers of independent libraries concurrently. They must not call
+ * into the loader while doing so. Initializers run one at a time while any
+ * library loaded with RTLD_LAZYLOAD has PLT entries to bind on first call.
+ */
+#define RTLD_PARALLEL_INIT 0x10000
+/*
+ * Open DT_NEEDED dependencies only once a symbol is needed from them, for
+ * calls through the PLT on the first call. Weak references never open a
+ * dependency. Dependencies inherit the mode. Only effective on x86-64.
+ */
+#define RTLD_LAZYLOAD 0x20000
+/*
+ * Patch the PLT entries of the library into direct jumps to targets within
+ * 2 GB, saving the load of their GOT slot on every call. The number of
+ * entries patched is reported in dl_stats_t.pltBypassed. Only effective on
+ * x86-64, for the lazy PLT layout.
+ */
+#define RTLD_BYPASS_PLT 0x40000
+
+/* Time an image replaced by ELF64_dlreload stays mapped, in nanoseconds */
+#define DLRELOAD_GRACE_NS 1000000000ull
+
+/* dlinfo request for the x86-64 level of the loaded variant, see dlsearch_open */
+#define RTLD_DI_LEVEL 2
+
+/*
+ * Image description passed to ELF64_iterate_phdr callbacks, laid out like
+ * struct dl_phdr_info. dlpi_adds and dlpi_subs count images loaded and
+ * unloaded so far, so a caller can cache what it derived from a previous
+ * walk for as long as both are unchanged. TLS is not supported.
+ */
+typedef struct {
+    uintptr_t dlpi_addr;
+    const char* dlpi_name;
+    const Elf64_Phdr* dlpi_phdr;
+    uint16_t dlpi_phnum;
+    unsigned long long dlpi_adds;
+    unsigned long long dlpi_subs;
+    size_t dlpi_tls_modid;
+    void* dlpi_tls_data;
+} elf64_phdr_info_t;
+
+typedef int (*elf64_phdr_callback_t)(elf64_phdr_info_t* info, size_t size, void* data);
 
+/*
+ * Calls that open, close, look up or change loaded libraries, and lazy
+ * binding, take a recursive loader lock, so they may come from any thread.
+ */
 void* ELF64_dlopen(const char* name, int flags);
+/* Load an image from memory. The buffer is only read during the call. */
+void* ELF64_dlopen_mem(const void* buf, size_t len, const char* name, int flags);
 void* ELF64_dlsym(void* handle, const char* name);
 void ELF64_dlclose(void* handle);
+int ELF64_dlinfo(void* handle, int request, void* arg);
+void ELF64_dlstats(dl_stats_t* stats);
+/* Async-signal-safe, see dladdr_lookup */
+int ELF64_dladdr(const void* addr, dl_info_t* info);
+/* Walk loaded images in load order until the callback returns non-zero */
+int ELF64_iterate_phdr(elf64_phdr_callback_t callback, void* data);
+/*
+ * Keep up to bytes worth of closed libraries resident, already relocated, so
+ * that opening them again only restores their writable segments and reruns
+ * their initializers. 0 disables the cache. The initial limit is read from
+ * DLCACHE_ENV. Libraries loaded while the cache is disabled are never cached.
+ */
+void ELF64_dlcache(size_t bytes);
+/*
+ * Replace a loaded library with the one at path, realloc style: on success
+ * the old handle is invalid and the returned one holds its references, on
+ * failure NULL is returned and the old one is untouched. Every GOT slot of
+ * other libraries bound to the old image is repointed to the new one. Data
+ * is not carried over. The old image stays mapped for DLRELOAD_GRACE_NS so
+ * that threads still running its code can leave it, then it is finalized.
+ */
+void* ELF64_dlreload(void* handle, const char* path);
+/*
+ * Report the calls counted through PLT slots bound while DLPROFILE_ENV (or
+ * dlprofile_enable) selected their symbol, per calling library and symbol.
+ * Each counted call costs about a nanosecond, and counts are approximate
+ * when threads call the same symbol concurrently. x86-64 only.
+ */
+int ELF64_dlprofile(dlprofile_callback_t callback, void* data);
+/*
+ * Namespaces isolate sets of libraries, dlmopen style: a library opened in
+ * one is loaded again in another, with its own data, dependencies and global
+ * scope. Read-only pages identical to those of another load of the same file
+ * are mapped from it rather than kept twice (Linux only). Symbols added with
+ * ELF64_addGlobalSymbol are seen by every namespace, those added with
+ * ELF64_addNamespaceSymbol by one only, taking precedence.
+ */
+void* ELF64_dlnamespace(void);
+/* ELF64_dlopen within ns, NULL standing for the namespace of ELF64_dlopen */
+void* ELF64_dlmopen(void* ns, const char* name, int flags);
+void ELF64_addNamespaceSymbol(void* ns, const char* name, void* symbol);
+/* Free a namespace once all of its libraries are closed */
+int ELF64_dlnamespace_close(void* ns);
 char* ELF64_dlerror(void);
 void ELF64_addGlobalSymbol(const char* name, void* symbol);
 
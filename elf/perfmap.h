@@ -0,0 +1,20 @@
+#ifndef NORLIT_ELF_PERFMAP_H
+#define NORLIT_ELF_PERFMAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Setting this environment variable to a non-empty value enables the map */
+#define PERFMAP_ENV "ELF_DL_PERFMAP"
+
+/*
+ * Describe loaded code in /tmp/perf-<pid>.map so that perf and other
+ * profilers that understand the format can symbolize it.
+ */
+bool perfmap_enable(void);
+bool perfmap_enabled(void);
+void perfmap_add(const void* start, size_t size, const char* name, const char* lib);
+void perfmap_remove(const void* start, size_t size, const char* lib);
+void perfmap_flush(void);
+
+#endif
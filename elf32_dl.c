@@ -3,84 +3,188 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/stat.h>
 
 #include <elf/elf32.h>
 #include <elf/elf32_dl.h>
+#include <elf/dlsearch.h>
+#include <elf/dlpack.h>
+#include <elf/dltrace.h>
+#include <elf/perfmap.h>
+#include <elf/dlrecord.h>
+#include <elf/dladdr.h>
+#include <elf/dlinit.h>
 #include <util/list.h>
 #include <util/hashmap.h>
+#include <util/cpu.h>
+
+/* Identity of the file an image was loaded from. ino is 0 if unknown. */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} file_id_t;
 
 typedef struct dl_handle_t  {
     char* name;
-    char* strtab;
+    char* path;
+    // Copied, relocations may rewrite the string table under a map key
+    char* soname;
+    const char* rpath;
+    const char* runpath;
+    file_id_t fileId;
+    // x86-64 level of the variant that was loaded, 0 for the baseline
+    int level;
     hashmap_t* map;
+    dladdr_image_t* addrImage;
     char* executable;
+    size_t size;
+    uint32_t symbolCount;
+
+    // Initializers run in the order DT_INIT, DT_INIT_ARRAY and finalizers in
+    // the order DT_FINI_ARRAY reversed, DT_FINI
+    void(*init)(void);
+    void(**initArray)(void);
+    size_t initArrayLen;
     void(*fini)(void);
+    void(**finiArray)(void);
+    size_t finiArrayLen;
+    int initState;
+    size_t initIndex;
+    dl_mark_t initStart;
+    // Start of the open that loaded the image, until its "dlopen" trace
+    // span is closed
+    uint64_t openStart;
 
     size_t depDlLen;
     struct dl_handle_t** depDl;
 
+    // Symbol table indices of the IFUNCs defined here, until their
+    // resolvers have run
+    int* ifuncs;
+    int ifuncCount;
+
     int refCount;
     bool resolved;
 
+    dl_stats_t stats;
+
+    // Program headers, kept for ELF32_iterate_phdr
+    Elf32_Phdr* phdr;
+    uint16_t phnum;
+
+    // Writable segments as they were before initializers ran, kept while
+    // the closed-handle cache is enabled so that an image can be revived
+    char* snapshot;
+    size_t snapshotSize;
+    bool nodelete;
+
     list_t globalList;
+    list_t loadedList;
+    list_t cacheList;
 } dl_handle_t;
 
+/* IFUNC resolvers receive the CPU_* feature bits of util/cpu.h */
+typedef void* (*ifunc_resolver_t)(uint64_t features);
+
+enum {
+    INIT_PENDING,
+    INIT_QUEUED,
+    INIT_DONE
+};
+
 static const char* errmsg = NULL;
 static list_t globalHandle = {&globalHandle, &globalHandle};
+static list_t loadedHandle = {&loadedHandle, &loadedHandle};
+static unsigned long long loadedAdds = 0;
+static unsigned long long loadedSubs = 0;
+
+// Closed handles kept resident, most recently closed first
+static list_t cachedHandle = {&cachedHandle, &cachedHandle};
+static size_t cacheBytes = 0;
+static size_t cacheLimit = 0;
+static bool cacheConfigured = false;
+static dl_stats_t totalStats;
+
+void* alloc_exec(size_t size);
+void* exec_alias(void* ptr);
+bool protect_exec(void* ptr, const unsigned char* flags);
+void free_exec(void* ptr);
+
+/*
+ * Segment contents are pulled through a reader so that each PT_LOAD segment
+ * goes straight from its source into its final location in the image.
+ */
+typedef bool (*reader_t)(void* source, uint64_t offset, void* dst, size_t size);
+
+static bool readMemory(void* source, uint64_t offset, void* dst, size_t size) {
+    memcpy(dst, (char*)source + offset, size);
+    return true;
+}
 
-#ifdef _MSC_VER
-#define aligned_alloc _aligned_malloc
-#define aligned_free _aligned_free
-#else
-#define aligned_free free
-#endif
-
-static void* readFile(const char* name) {
-    FILE* file = fopen(name, "rb");
-    if (file == NULL) {
-        return NULL;
+static bool readStream(void* source, uint64_t offset, void* dst, size_t size) {
+    FILE* file = source;
+    if (fseek(file, (long)offset, SEEK_SET) == -1) {
+        return false;
     }
-    if (fseek(file, 0, SEEK_END) == -1) {
-        return NULL;
-    }
-    long length = ftell(file);
-    if (length == -1) {
-        return NULL;
-    }
-    rewind(file);
-    char* filecontents = malloc(length + 1);
-    if (!filecontents) {
-        return NULL;
-    }
-    if (!fread(filecontents, length, 1, file)) {
-        free(filecontents);
-        return NULL;
+    return fread(dst, size, 1, file) == 1;
+}
+
+static hashmap_t* getDlMap() {
+    static hashmap_t* map = NULL;
+    if (!map) {
+        map = hashmap_new_string(64);
     }
-    if (fclose(file) == -1) {
-        free(filecontents);
-        return NULL;
+    return map;
+}
+
+static int fileIdHash(const void* key) {
+    const file_id_t* id = key;
+    return (int)(id->ino ^ (id->ino >> 32) ^ (id->dev * 31));
+}
+
+static int fileIdComparator(const void* a, const void* b) {
+    const file_id_t* x = a;
+    const file_id_t* y = b;
+    return x->dev != y->dev || x->ino != y->ino;
+}
+
+static hashmap_t* getFileMap() {
+    static hashmap_t* map = NULL;
+    if (!map) {
+        map = hashmap_new(fileIdHash, fileIdComparator, 64);
     }
-    filecontents[length] = 0;
-    return filecontents;
+    return map;
 }
 
-static hashmap_t* getDlMap() {
+static hashmap_t* getSonameMap() {
     static hashmap_t* map = NULL;
     if (!map) {
-        map = hashmap_new_string(1);
+        map = hashmap_new_string(64);
     }
     return map;
 }
 
+static dl_handle_t* ELF32_findLoaded(const char* name) {
+    dl_handle_t* handle = hashmap_get(getDlMap(), name);
+    if (!handle) {
+        handle = hashmap_get(getSonameMap(), name);
+    }
+    return handle;
+}
+
 static hashmap_t* getGlobalMap(bool init) {
     static hashmap_t* map = NULL;
     if (!map && init) {
-        map = hashmap_new_string(1);
+        map = hashmap_new_string(64);
     }
     return map;
 }
 
-static int ELF32_validate(Elf32_Ehdr* header) {
+static int ELF32_validate(Elf32_Ehdr* header, size_t len) {
+    if (len < sizeof(Elf32_Ehdr)) {
+        return 0;
+    }
+
     if (header->e_ident[EI_MAG0] != ELFMAG0 ||
             header->e_ident[EI_MAG1] != ELFMAG1 ||
             header->e_ident[EI_MAG2] != ELFMAG2 ||
@@ -104,9 +208,116 @@ static int ELF32_validate(Elf32_Ehdr* header) {
         return 0;
     }
 
+    // Program headers and segment contents must lie within the image. Sums
+    // of 32-bit fields are formed in 64 bits, so they cannot wrap.
+    if (header->e_phentsize != sizeof(Elf32_Phdr) ||
+            header->e_phoff + (uint64_t)header->e_phnum * sizeof(Elf32_Phdr) > len) {
+        return 0;
+    }
+
+    int loads = 0;
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf32_Phdr *program = ELF32_PH_GET(header, i);
+        if (program->p_type == PT_LOAD) {
+            if ((uint64_t)program->p_offset + program->p_filesz > len || program->p_filesz > program->p_memsz) {
+                return 0;
+            }
+            // Rounding the segment up to its alignment must not wrap either
+            if (!program->p_align || (program->p_align & (program->p_align - 1)) ||
+                    (uint64_t)program->p_vaddr + program->p_memsz + program->p_align > 0xFFFFFFFFu) {
+                return 0;
+            }
+            loads++;
+        }
+    }
+    if (!loads) {
+        return 0;
+    }
+
+    // The dynamic section is read from the image, so it must be loaded
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf32_Phdr *dynamic = ELF32_PH_GET(header, i);
+        if (dynamic->p_type != PT_DYNAMIC) {
+            continue;
+        }
+        bool loaded = false;
+        for (int j = 0; j < header->e_phnum && !loaded; j++) {
+            Elf32_Phdr *program = ELF32_PH_GET(header, j);
+            loaded = program->p_type == PT_LOAD && dynamic->p_vaddr >= program->p_vaddr &&
+                dynamic->p_memsz >= sizeof(Elf32_Dyn) &&
+                (uint64_t)dynamic->p_vaddr + dynamic->p_memsz <= (uint64_t)program->p_vaddr + program->p_memsz;
+        }
+        if (!loaded) {
+            return 0;
+        }
+    }
+
     return 1;
 }
 
+/* Whether size bytes at ptr lie within the image, without overflowing */
+static bool elf32_inImage(dl_handle_t* handle, const void* ptr, uint64_t size) {
+    uint64_t offset = (uint64_t)((uintptr_t)ptr - (uintptr_t)handle->executable);
+    return offset <= handle->size && size <= handle->size - offset;
+}
+
+/*
+ * Relocation tables must lie within the image. Their entries are checked as
+ * they are applied, since earlier relocations may rewrite later ones.
+ */
+static bool ELF32_validateRel(dl_handle_t* handle, char* reltab, uint64_t size) {
+    return size % sizeof(Elf32_Rel) == 0 && elf32_inImage(handle, reltab, size);
+}
+
+/*
+ * Read the ELF header and the program headers of file, and pick the reader
+ * for its segments. A packed container (see dlpack.h) stands in for the
+ * library it holds, and must be closed with dlpack_close after loading.
+ */
+static Elf32_Ehdr* ELF32_readHeaders(FILE* file, size_t* len, reader_t* read, void** source) {
+    dlpack_t* pack = dlpack_open(file);
+    long length;
+    if (pack) {
+        *read = dlpack_read;
+        *source = pack;
+        length = (long)dlpack_size(pack);
+    } else {
+        *read = readStream;
+        *source = file;
+        if (fseek(file, 0, SEEK_END) == -1 || (length = ftell(file)) == -1) {
+            return NULL;
+        }
+    }
+
+    // Only the ELF header and the program headers are kept in memory
+    Elf32_Ehdr ehdr;
+    if ((size_t)length < sizeof(ehdr) || !(*read)(*source, 0, &ehdr, sizeof(ehdr))) {
+        dlpack_close(pack);
+        return NULL;
+    }
+    uint64_t hdrsz = ehdr.e_phoff + (uint64_t)ehdr.e_phnum * ehdr.e_phentsize;
+    if (hdrsz < sizeof(ehdr)) {
+        hdrsz = sizeof(ehdr);
+    }
+    if (hdrsz > (uint64_t)length) {
+        dlpack_close(pack);
+        return NULL;
+    }
+
+    Elf32_Ehdr* header = malloc((size_t)hdrsz);
+    if (!header) {
+        dlpack_close(pack);
+        return NULL;
+    }
+    if (!(*read)(*source, 0, header, (size_t)hdrsz)) {
+        free(header);
+        dlpack_close(pack);
+        return NULL;
+    }
+    *len = length;
+    return header;
+}
+
 static void ELF32_findBounds(Elf32_Ehdr* header, uint32_t* loPtr, uint32_t* hiPtr) {
     uint32_t lo = 0xFFFFFFFF, hi = 0;
     for (int i = 0; i < header->e_phnum; i++) {
@@ -128,14 +339,17 @@ static void ELF32_findBounds(Elf32_Ehdr* header, uint32_t* loPtr, uint32_t* hiPt
         *hiPtr = hi;
 }
 
-static void ELF32_loadProgram(Elf32_Ehdr *header, char* mem) {
+static bool ELF32_loadProgram(Elf32_Ehdr *header, char* mem, reader_t read, void* source) {
     for (int i = 0; i < header->e_phnum; i++) {
         Elf32_Phdr *h = ELF32_PH_GET(header, i);
         if (h->p_type == PT_LOAD) {
-            memset(mem + h->p_vaddr + h->p_filesz, 0, h->p_memsz - h->p_filesz);
-            memcpy(mem + h->p_vaddr, ELF32_PH_CONTENT(header, h), h->p_filesz);
+            // alloc_exec hands out demand-zero pages, see ELF64_loadProgram
+            if (h->p_filesz && !read(source, h->p_offset, mem + h->p_vaddr, h->p_filesz)) {
+                return false;
+            }
         }
     }
+    return true;
 }
 
 static int ELF32_findProgram(Elf32_Ehdr* header, int startIndex, int targetType) {
@@ -156,7 +370,7 @@ static void* ELF32_resolveSymbolGlobal(const char* name) {
     }
     dl_handle_t* handle;
     list_forEach(&globalHandle, handle, dl_handle_t, globalList) {
-        void* ret = ELF32_dlsym(handle, name);
+        void* ret = hashmap_get(handle->map, name);
         if (ret) return ret;
     }
     return NULL;
@@ -166,8 +380,10 @@ static bool ELF32_resolveSymbols(dl_handle_t* handle, char* strtab, char *symtab
     /* First element is skipeed */
     for (int i = 1; i < size; i++) {
         Elf32_Sym *symbol = (Elf32_Sym *)(symtab + i * syment);
+        // Imports are rewritten to SHN_ABS below
+        bool defined = symbol->st_shndx != SHN_UNDEF;
 
-        if (symbol->st_shndx == SHN_UNDEF) {
+        if (!defined) {
             // Undefined symbols, we need to resolve from the dependency list
 
             // Get the name of the symbol
@@ -175,7 +391,7 @@ static bool ELF32_resolveSymbols(dl_handle_t* handle, char* strtab, char *symtab
 
             void* result = ELF32_resolveSymbolGlobal(name);
             for (size_t i = 0; !result && i < handle->depDlLen; i++) {
-                result = ELF32_dlsym(handle->depDl[i], name);
+                result = hashmap_get(handle->depDl[i]->map, name);
             }
 
             // It is a error if we cannot resolve a strong symbol
@@ -187,11 +403,36 @@ static bool ELF32_resolveSymbols(dl_handle_t* handle, char* strtab, char *symtab
                 }
             }
 
+            if (result) {
+                handle->stats.symbolsImported++;
+            }
+
             symbol->st_shndx = SHN_ABS;
             symbol->st_value = (uint32_t)result;
         } else if (symbol->st_shndx < SHN_LORESERVE) {
             symbol->st_shndx = SHN_ABS;
             symbol->st_value = (uint32_t)(symbol->st_value + handle->executable);
+
+            int type = ELF32_ST_TYPE(symbol->st_info);
+            // Imports of IFUNC type are bound to the selected implementation
+            // already, only resolvers defined here are called
+            if (type == STT_GNU_IFUNC) {
+                if (!(handle->ifuncCount & (handle->ifuncCount - 1))) {
+                    int* grown = realloc(handle->ifuncs, (handle->ifuncCount ? handle->ifuncCount * 2 : 4) * sizeof(int));
+                    if (!grown) {
+                        errmsg = "Memory allocation failure";
+                        return false;
+                    }
+                    handle->ifuncs = grown;
+                }
+                handle->ifuncs[handle->ifuncCount++] = i;
+            }
+            if (type == STT_FUNC || type == STT_OBJECT) {
+                dladdr_addSymbol(handle->addrImage, (void*)symbol->st_value, symbol->st_size, strtab + symbol->st_name);
+            }
+            if (type == STT_FUNC && symbol->st_size && perfmap_enabled()) {
+                perfmap_add((void*)symbol->st_value, symbol->st_size, strtab + symbol->st_name, handle->name);
+            }
         } else if (symbol->st_shndx != SHN_ABS) {
             errmsg = "Unimplemented st_shndx";
             return false;
@@ -200,18 +441,56 @@ static bool ELF32_resolveSymbols(dl_handle_t* handle, char* strtab, char *symtab
         if (ELF32_ST_BIND(symbol->st_info) & STB_GLOBAL) {
             char *name = strtab + symbol->st_name;
             hashmap_put(handle->map, name, (void*)symbol->st_value);
+            // Resolved imports are visible through the map, but not counted
+            if (defined) {
+                handle->stats.symbolsExported++;
+            }
         }
     }
 
     return true;
 }
 
-static bool ELF32_relocateRel(dl_handle_t* handle, char* reltab, int entsize, int limit, char* symtab, int syment) {
+/*
+ * Call the resolver of every IFUNC symbol defined here, once. Its result
+ * replaces the symbol value, in the symbol table for the deferred relocations
+ * and in the export map, so dependents bind straight to the selected
+ * implementation.
+ */
+static void ELF32_resolveIfuncs(dl_handle_t* handle, char* strtab, char *symtab, int syment) {
+    uint64_t features = cpu_features();
+    for (int i = 0; i < handle->ifuncCount; i++) {
+        Elf32_Sym *symbol = (Elf32_Sym *)(symtab + handle->ifuncs[i] * syment);
+        ifunc_resolver_t resolver = (ifunc_resolver_t)symbol->st_value;
+        symbol->st_value = (Elf32_Addr)resolver(features);
+        if (ELF32_ST_BIND(symbol->st_info) & STB_GLOBAL) {
+            hashmap_put(handle->map, strtab + symbol->st_name, (void*)symbol->st_value);
+        }
+    }
+}
+
+/*
+ * Relocations that need an IFUNC resolver are left for a second pass (with
+ * ifuncPass set), so that resolvers only run once everything else is
+ * relocated. They are counted in deferred.
+ */
+static bool ELF32_relocateRel(dl_handle_t* handle, char* reltab, int entsize, int limit, char* symtab, int syment, bool ifuncPass, size_t* deferred) {
     for (char* end = reltab + limit; reltab<end; reltab += entsize) {
         Elf32_Rel* rel = (Elf32_Rel*)reltab;
+        if ((uint64_t)rel->r_offset + sizeof(uint32_t) > handle->size || ELF32_R_SYM(rel->r_info) >= handle->symbolCount) {
+            errmsg = "Broken shared library";
+            return false;
+        }
         Elf32_Sym *symbol = (Elf32_Sym *)(symtab + ELF32_R_SYM(rel->r_info) * syment);
         uint32_t *ref = (uint32_t *)(handle->executable + rel->r_offset);
-        switch (ELF32_R_TYPE(rel->r_info)) {
+        uint32_t type = ELF32_R_TYPE(rel->r_info);
+        bool ifunc = type == R_386_IRELATIVE || ELF32_ST_TYPE(symbol->st_info) == STT_GNU_IFUNC;
+        if (ifunc != ifuncPass) {
+            *deferred += ifunc;
+            continue;
+        }
+        handle->stats.relocations[type < DL_RELOC_TYPES ? type : DL_RELOC_TYPES - 1]++;
+        switch (type) {
             case R_386_32:
                 *ref += symbol->st_value;
                 break;
@@ -227,6 +506,9 @@ static bool ELF32_relocateRel(dl_handle_t* handle, char* reltab, int entsize, in
             case R_386_RELATIVE:
                 *ref += (int)handle->executable;
                 break;
+            case R_386_IRELATIVE:
+                *ref = (uint32_t)((ifunc_resolver_t)(handle->executable + *ref))(cpu_features());
+                break;
             default:
                 errmsg = "Unimplemented relocation type";
                 // printf("Unknown relocation type %d\n", ELF32_R_TYPE(rel->r_info));
@@ -236,9 +518,79 @@ static bool ELF32_relocateRel(dl_handle_t* handle, char* reltab, int entsize, in
     return true;
 }
 
-static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**initptr)(void)) {
+static void* elf32_dlopenFrom(dl_handle_t* parent, const char* name, int flags);
+static void elf32_dlclose(void* handle);
+
+static size_t elf32_cacheLimit(void) {
+    if (!cacheConfigured) {
+        const char* env = getenv(DLCACHE_ENV);
+        cacheLimit = env ? (size_t)strtoull(env, NULL, 0) : 0;
+        cacheConfigured = true;
+    }
+    return cacheLimit;
+}
+
+/* Copy the writable segments, which initializers modify */
+static bool elf32_snapshot(dl_handle_t* handle) {
+    size_t size = 0;
+    for (uint16_t i = 0; i < handle->phnum; i++) {
+        if (handle->phdr[i].p_type == PT_LOAD && (handle->phdr[i].p_flags & PF_W)) {
+            size += (size_t)handle->phdr[i].p_memsz;
+        }
+    }
+    handle->snapshot = malloc(size ? size : 1);
+    if (!handle->snapshot) {
+        return false;
+    }
+    handle->snapshotSize = size;
+    char* p = handle->snapshot;
+    for (uint16_t i = 0; i < handle->phnum; i++) {
+        Elf32_Phdr* program = &handle->phdr[i];
+        if (program->p_type == PT_LOAD && (program->p_flags & PF_W)) {
+            memcpy(p, handle->executable + program->p_vaddr, (size_t)program->p_memsz);
+            p += program->p_memsz;
+        }
+    }
+    return true;
+}
+
+static void elf32_restore(dl_handle_t* handle) {
+    char* p = handle->snapshot;
+    for (uint16_t i = 0; i < handle->phnum; i++) {
+        Elf32_Phdr* program = &handle->phdr[i];
+        if (program->p_type == PT_LOAD && (program->p_flags & PF_W)) {
+            memcpy(handle->executable + program->p_vaddr, p, (size_t)program->p_memsz);
+            p += program->p_memsz;
+        }
+    }
+}
+
+/*
+ * Take a reference on a handle that was found already loaded. A handle that
+ * was sitting in the cache gets its writable segments back to their state
+ * right after relocation, and its initializers will run again.
+ */
+static void elf32_acquire(dl_handle_t* handle, int flags) {
+    if (handle->refCount++ || !handle->cacheList.prev) {
+        return;
+    }
+    list_remove(&handle->cacheList);
+    handle->cacheList.prev = NULL;
+    cacheBytes -= handle->stats.memory;
+
+    elf32_restore(handle);
+    list_add(&loadedHandle, &handle->loadedList);
+    loadedAdds++;
+    if (flags & RTLD_GLOBAL) {
+        list_add(&globalHandle, &handle->globalList);
+    }
+}
+
+static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, size_t len, reader_t read, void* source) {
+    dl_mark_t start = dlstats_mark();
+
     // Check header
-    if (!ELF32_validate(header)) {
+    if (!ELF32_validate(header, len)) {
         errmsg = "Broken shared library";
         return;
     }
@@ -246,14 +598,54 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
     // Allocate executable memory
     uint32_t size;
     ELF32_findBounds(header, NULL, &size);
-    handle->executable = aligned_alloc(size, 4096);
+    handle->executable = alloc_exec(size);
     if (!handle->executable) {
         errmsg = "Memory allocation failure";
         return;
     }
+    handle->size = size;
+    handle->stats.memory = size + 4096;
+
+    // Load binary image into memory. The image stays writable as a whole,
+    // relocations are applied in place.
+    if (!ELF32_loadProgram(header, exec_alias(handle->executable), read, source)) {
+        errmsg = "Cannot read the shared library";
+        return;
+    }
+    unsigned char* pageFlags = malloc((size + 4095) / 4096 + 1);
+    if (!pageFlags) {
+        errmsg = "Memory allocation failure";
+        return;
+    }
+    memset(pageFlags, PF_R | PF_W | PF_X, (size + 4095) / 4096 + 1);
+    bool protected = protect_exec(handle->executable, pageFlags);
+    free(pageFlags);
+    if (!protected) {
+        errmsg = "Cannot map the shared library";
+        return;
+    }
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf32_Phdr *program = ELF32_PH_GET(header, i);
+        if (program->p_type == PT_LOAD) {
+            if (read == readMemory) {
+                handle->stats.bytesCopied += program->p_filesz;
+            } else {
+                handle->stats.bytesRead += program->p_filesz;
+            }
+        }
+    }
 
-    // Load binary image into memory
-    ELF32_loadProgram(header, handle->executable);
+    handle->phdr = malloc(header->e_phnum * sizeof(Elf32_Phdr));
+    if (!handle->phdr) {
+        errmsg = "Memory allocation failure";
+        return;
+    }
+    for (int i = 0; i < header->e_phnum; i++) {
+        handle->phdr[i] = *ELF32_PH_GET(header, i);
+    }
+    handle->phnum = header->e_phnum;
+    handle->stats.memory += header->e_phnum * sizeof(Elf32_Phdr);
+    start = dlstats_phase(&handle->stats, DL_PHASE_MAP, handle->name, start);
 
     // Find DYNAMIC section. This is mandatory
     int dynamicSection = ELF32_findProgram(header, 0, PT_DYNAMIC);
@@ -262,6 +654,19 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
         return;
     }
 
+    // All tables are read from the loaded image rather than from the file
+    // contents, so the caller's buffer is never written to
+    Elf32_Dyn* dynamic = (Elf32_Dyn*)(handle->executable + ELF32_PH_GET(header, dynamicSection)->p_vaddr);
+    uint32_t dynamicCount = ELF32_PH_GET(header, dynamicSection)->p_memsz / sizeof(Elf32_Dyn);
+    uint32_t terminator = 0;
+    while (terminator < dynamicCount && dynamic[terminator].d_tag != DT_NULL) {
+        terminator++;
+    }
+    if (terminator == dynamicCount) {
+        errmsg = "Broken shared library";
+        return;
+    }
+
     char* strtab = NULL;
     uint32_t strsz = 0;
 
@@ -279,9 +684,18 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
     uint32_t relsz = 0;
     uint32_t relent = 0;
 
+    uint32_t initArraySz = 0;
+    uint32_t finiArraySz = 0;
+
+    uint32_t soname = 0;
+    bool hasSoname = false;
+    uint32_t rpath = 0;
+    bool hasRpath = false;
+    uint32_t runpath = 0;
+    bool hasRunpath = false;
+
     // Initial loop. Retrieve table information
-    for (Elf32_Dyn* dynamics = (Elf32_Dyn*)ELF32_PH_CONTENT(header, ELF32_PH_GET(header, dynamicSection));
-            dynamics->d_tag != DT_NULL; dynamics++) {
+    for (Elf32_Dyn* dynamics = dynamic; dynamics->d_tag != DT_NULL; dynamics++) {
         switch (dynamics->d_tag) {
             case DT_NEEDED:
                 neededLibs++;
@@ -290,16 +704,16 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
                 pltrelsz = dynamics->d_un.d_val;
                 break;
             case DT_PLTGOT:
-                pltgot = ((char*)header + dynamics->d_un.d_ptr);
+                pltgot = (handle->executable + dynamics->d_un.d_ptr);
                 break;
             case DT_HASH:
-                hash = (Elf32_Word*)((char*)header + dynamics->d_un.d_ptr);
+                hash = (Elf32_Word*)(handle->executable + dynamics->d_un.d_ptr);
                 break;
             case DT_STRTAB:
-                strtab = (char*)header + dynamics->d_un.d_ptr;
+                strtab = handle->executable + dynamics->d_un.d_ptr;
                 break;
             case DT_SYMTAB:
-                symtab = (char*)header + dynamics->d_un.d_ptr;
+                symtab = handle->executable + dynamics->d_un.d_ptr;
                 break;
             case DT_STRSZ:
                 strsz = dynamics->d_un.d_val;
@@ -308,13 +722,25 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
                 syment = dynamics->d_un.d_val;
                 break;
             case DT_INIT:
-                *initptr = (void(*)(void))(dynamics->d_un.d_ptr + handle->executable);
+                handle->init = (void(*)(void))(dynamics->d_un.d_ptr + handle->executable);
                 break;
             case DT_FINI:
                 handle->fini = (void(*)(void))(dynamics->d_un.d_ptr + handle->executable);
                 break;
+            case DT_INIT_ARRAY:
+                handle->initArray = (void(**)(void))(dynamics->d_un.d_ptr + handle->executable);
+                break;
+            case DT_FINI_ARRAY:
+                handle->finiArray = (void(**)(void))(dynamics->d_un.d_ptr + handle->executable);
+                break;
+            case DT_INIT_ARRAYSZ:
+                initArraySz = dynamics->d_un.d_val;
+                break;
+            case DT_FINI_ARRAYSZ:
+                finiArraySz = dynamics->d_un.d_val;
+                break;
             case DT_REL:
-                rel = (char*)header + dynamics->d_un.d_ptr;
+                rel = handle->executable + dynamics->d_un.d_ptr;
                 break;
             case DT_RELSZ:
                 relsz = dynamics->d_un.d_val;
@@ -330,7 +756,19 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
                 }
                 break;
             case DT_JMPREL:
-                jmpRel = ((char*)header + dynamics->d_un.d_ptr);
+                jmpRel = (handle->executable + dynamics->d_un.d_ptr);
+                break;
+            case DT_SONAME:
+                soname = dynamics->d_un.d_val;
+                hasSoname = true;
+                break;
+            case DT_RPATH:
+                rpath = dynamics->d_un.d_val;
+                hasRpath = true;
+                break;
+            case DT_RUNPATH:
+                runpath = dynamics->d_un.d_val;
+                hasRunpath = true;
                 break;
             case DT_TEXTREL:
                 break;
@@ -349,9 +787,63 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
         return;
     }
 
-    char* dupstrtab = malloc(strsz);
-    memcpy(dupstrtab, strtab, strsz);
-    handle->strtab = dupstrtab;
+    if (!handle->initArray != !initArraySz || !handle->finiArray != !finiArraySz) {
+        errmsg = "Broken shared library";
+        return;
+    }
+
+    // Every table has to lie within the image before it is read, and every
+    // string offset within the string table
+    if (!elf32_inImage(handle, hash, 2 * sizeof(Elf32_Word)) ||
+            !elf32_inImage(handle, strtab, strsz) || strtab[strsz - 1] ||
+            syment < (int)sizeof(Elf32_Sym) || !elf32_inImage(handle, symtab, (uint64_t)hash[1] * syment) ||
+            hash[1] > INT32_MAX ||
+            (handle->init && !elf32_inImage(handle, (void*)handle->init, 1)) ||
+            (handle->fini && !elf32_inImage(handle, (void*)handle->fini, 1)) ||
+            (handle->initArray && !elf32_inImage(handle, handle->initArray, initArraySz)) ||
+            (handle->finiArray && !elf32_inImage(handle, handle->finiArray, finiArraySz)) ||
+            (pltgot && !elf32_inImage(handle, pltgot, 3 * sizeof(uint32_t))) ||
+            (hasSoname && soname >= strsz) || (hasRpath && rpath >= strsz) || (hasRunpath && runpath >= strsz) ||
+            (rel && (relent != sizeof(Elf32_Rel) || !ELF32_validateRel(handle, rel, relsz))) ||
+            (jmpRel && !ELF32_validateRel(handle, jmpRel, pltrelsz))) {
+        errmsg = "Broken shared library";
+        return;
+    }
+    for (Elf32_Dyn* dynamics = dynamic; dynamics->d_tag != DT_NULL; dynamics++) {
+        if (dynamics->d_tag == DT_NEEDED && dynamics->d_un.d_val >= strsz) {
+            errmsg = "Broken shared library";
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < hash[1]; i++) {
+        if (((Elf32_Sym*)(symtab + i * syment))->st_name >= strsz) {
+            errmsg = "Broken shared library";
+            return;
+        }
+    }
+    handle->symbolCount = hash[1];
+    handle->initArrayLen = initArraySz / sizeof(Elf32_Addr);
+    handle->finiArrayLen = finiArraySz / sizeof(Elf32_Addr);
+
+    // Make the library reachable through its DT_SONAME as well. The first
+    // library to claim a soname keeps it.
+    if (hasSoname) {
+        handle->soname = strdup(strtab + soname);
+        if (!handle->soname) {
+            errmsg = "Memory allocation failure";
+            return;
+        }
+        if (!hashmap_get(getSonameMap(), handle->soname)) {
+            hashmap_put(getSonameMap(), handle->soname, handle);
+        }
+    }
+
+    if (hasRpath) {
+        handle->rpath = strtab + rpath;
+    }
+    if (hasRunpath) {
+        handle->runpath = strtab + runpath;
+    }
 
     // Load dependencies
     if (neededLibs) {
@@ -363,39 +855,44 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
         }
         int processedLibs = 0;
 
-        for (Elf32_Dyn* dynamics = (Elf32_Dyn*)ELF32_PH_CONTENT(header, ELF32_PH_GET(header, dynamicSection));
-                dynamics->d_tag != DT_NULL; dynamics++) {
+        for (Elf32_Dyn* dynamics = dynamic; dynamics->d_tag != DT_NULL; dynamics++) {
             if (dynamics->d_tag == DT_NEEDED) {
-                char* name = dupstrtab + dynamics->d_un.d_val;
-                dl_handle_t* dephandle = ELF32_dlopen(name, RTLD_LAZY);
+                char* name = strtab + dynamics->d_un.d_val;
+                dl_handle_t* dephandle = elf32_dlopenFrom(handle, name, RTLD_LAZY);
                 if (!dephandle) {
                     errmsg = "Cannot load dependency";
                     return;
                 }
+                handle->depDl[processedLibs++] = dephandle;
                 if (!dephandle->resolved) {
                     errmsg = "Recursive dependency";
                     return;
                 }
-                handle->depDl[processedLibs++] = dephandle;
-                break;
             }
         }
     }
 
+    start = dlstats_phase(&handle->stats, DL_PHASE_DEPS, handle->name, start);
+
     // Resolve symbols
-    handle->map = hashmap_new_string(1);
-    if (!ELF32_resolveSymbols(handle, dupstrtab, symtab, hash[1], syment)) {
+    hashmap_counters_t before, after;
+    hashmap_counters(&before);
+    // One bucket per symbol, hash[1] being the symbol count
+    handle->map = hashmap_new_string(hash[1]);
+    handle->addrImage = dladdr_newImage(handle->executable, handle->size, handle->path, hash[1]);
+    bool resolved = ELF32_resolveSymbols(handle, strtab, symtab, hash[1], syment);
+    hashmap_counters(&after);
+    handle->stats.hashLookups += after.lookups - before.lookups;
+    handle->stats.hashProbes += after.probes - before.probes;
+    start = dlstats_phase(&handle->stats, DL_PHASE_RESOLVE, handle->name, start);
+    if (!resolved) {
         return;
     }
+    perfmap_flush();
 
-    if (rel) {
-        if (!relsz || !relent) {
-            errmsg = "Broken shared library";
-            return;
-        }
-        if (!ELF32_relocateRel(handle, rel, relent, relsz, symtab, syment)) {
-            return;
-        }
+    if (rel && (!relsz || !relent)) {
+        errmsg = "Broken shared library";
+        return;
     }
 
     // Jump Relocation. This can actually be done lazily,
@@ -408,100 +905,513 @@ static void elf32_dlopen_doit(dl_handle_t* handle, Elf32_Ehdr* header, void(**in
         if (pltRel == DT_RELA) {
             errmsg = "Unimplemented RELA";
             return;
-        } else {
-            if (!ELF32_relocateRel(handle, jmpRel, sizeof(Elf32_Rel), pltrelsz, symtab, syment)) {
-                return;
-            }
         }
     }
 
+    // IFUNC resolvers run between the two passes
+    size_t deferred = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (rel && !ELF32_relocateRel(handle, rel, relent, relsz, symtab, syment, pass, &deferred)) {
+            return;
+        }
+        if (jmpRel && !ELF32_relocateRel(handle, jmpRel, sizeof(Elf32_Rel), pltrelsz, symtab, syment, pass, &deferred)) {
+            return;
+        }
+        if (pass == 0 && handle->ifuncCount) {
+            ELF32_resolveIfuncs(handle, strtab, symtab, syment);
+            free(handle->ifuncs);
+            handle->ifuncs = NULL;
+            handle->ifuncCount = 0;
+        }
+        if (!deferred) {
+            break;
+        }
+    }
+
+    if (elf32_cacheLimit() && !elf32_snapshot(handle)) {
+        errmsg = "Memory allocation failure";
+        return;
+    }
+
+    start = dlstats_phase(&handle->stats, DL_PHASE_RELOCATE, handle->name, start);
+
+    hashmap_info_t info;
+    hashmap_info(handle->map, &info);
+    handle->stats.hashMaxChain = info.maxChain;
+    handle->stats.memory += handle->snapshotSize + sizeof(dl_handle_t) + strlen(handle->name) + strlen(handle->path) + 2 +
+        handle->depDlLen * sizeof(dl_handle_t*) + info.memory + dladdr_imageSize(handle->addrImage);
+    handle->stats.loads = 1;
+
     handle->resolved = true;
 }
 
-void* ELF32_dlopen(const char* name, int flags) {
-    // A shared library will only be attached once
-    dl_handle_t* handle = hashmap_get(getDlMap(), name);
-    if (handle) {
-        handle->refCount++;
-        return handle;
+static void elf32_runInit(void* node) {
+    dl_handle_t* handle = (dl_handle_t*)node;
+    handle->initStart = dlstats_mark();
+    if (handle->init) {
+        handle->init();
+    }
+    for (size_t i = 0; i < handle->initArrayLen; i++) {
+        // 0 and -1 are placeholders left by some toolchains
+        void(*init)(void) = handle->initArray[i];
+        if (init && init != (void(*)(void))-1) {
+            init();
+        }
+    }
+}
+
+static void elf32_initDone(void* node) {
+    dl_handle_t* handle = (dl_handle_t*)node;
+    dl_mark_t end = dlstats_phase(&handle->stats, DL_PHASE_INIT, handle->name, handle->initStart);
+    totalStats.phaseNs[DL_PHASE_INIT] += end.ns - handle->initStart.ns;
+    handle->initState = INIT_DONE;
+}
+
+static void elf32_runFini(dl_handle_t* handle) {
+    for (size_t i = handle->finiArrayLen; i-- > 0; ) {
+        void(*fini)(void) = handle->finiArray[i];
+        if (fini && fini != (void(*)(void))-1) {
+            fini();
+        }
+    }
+    if (handle->fini) {
+        handle->fini();
     }
+}
 
-    Elf32_Ehdr* header = readFile(name);
-    if (!header) {
-        errmsg = "Cannot open the shared library";
+/* Append the handles below handle that still need initializing, dependencies first */
+static bool elf32_collectInit(dl_handle_t* handle, dl_handle_t*** order, size_t* count, size_t* capacity) {
+    if (handle->initState != INIT_PENDING) {
+        return true;
+    }
+    handle->initState = INIT_QUEUED;
+    for (size_t i = 0; i < handle->depDlLen; i++) {
+        if (!elf32_collectInit(handle->depDl[i], order, count, capacity)) {
+            return false;
+        }
+    }
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 8;
+        dl_handle_t** list = realloc(*order, grown * sizeof(dl_handle_t*));
+        if (!list) {
+            return false;
+        }
+        *order = list;
+        *capacity = grown;
+    }
+    handle->initIndex = *count;
+    (*order)[(*count)++] = handle;
+    return true;
+}
+
+static void elf32_resetInit(dl_handle_t* handle) {
+    if (handle->initState == INIT_QUEUED) {
+        handle->initState = INIT_PENDING;
+        for (size_t i = 0; i < handle->depDlLen; i++) {
+            elf32_resetInit(handle->depDl[i]);
+        }
+    }
+}
+
+/*
+ * Run the initializers of handle and of its dependencies that have not run
+ * yet, dependencies first. Libraries whose initializers are already running
+ * further up the stack, when an initializer opens a library, are skipped.
+ */
+static bool elf32_initialize(dl_handle_t* handle, bool parallel) {
+    dl_handle_t** order = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t* depStart = NULL;
+    size_t* deps = NULL;
+
+    bool ok = elf32_collectInit(handle, &order, &count, &capacity);
+    if (ok && count) {
+        size_t edges = 0;
+        for (size_t i = 0; i < count; i++) {
+            edges += order[i]->depDlLen;
+        }
+        depStart = malloc((count + 1) * sizeof(size_t));
+        deps = malloc((edges ? edges : 1) * sizeof(size_t));
+        ok = depStart && deps;
+    }
+    if (!ok) {
+        elf32_resetInit(handle);
+        free(order);
+        free(depStart);
+        free(deps);
+        errmsg = "Memory allocation failure";
+        return false;
+    }
+
+    if (count) {
+        // Only edges inside this graph matter, the rest is initialized already
+        size_t edges = 0;
+        for (size_t i = 0; i < count; i++) {
+            depStart[i] = edges;
+            for (size_t j = 0; j < order[i]->depDlLen; j++) {
+                dl_handle_t* dep = order[i]->depDl[j];
+                if (dep->initState == INIT_QUEUED && dep->initIndex < i && order[dep->initIndex] == dep) {
+                    deps[edges++] = dep->initIndex;
+                }
+            }
+        }
+        depStart[count] = edges;
+        dlinit_run((void**)order, count, depStart, deps, elf32_runInit, elf32_initDone, parallel);
+    }
+
+    free(order);
+    free(depStart);
+    free(deps);
+    return true;
+}
+
+/* Close the "dlopen" trace span of an image loaded by the current open */
+static void elf32_traceOpen(dl_handle_t* handle) {
+    if (handle->openStart) {
+        dltrace_span("dlopen", handle->name, handle->openStart, dlstats_now());
+        handle->openStart = 0;
+    }
+}
+
+/*
+ * Initialize the result of a top-level open, which fails if that fails. The
+ * trace span of a library loaded by the open includes its initializers.
+ */
+static void* elf32_initRoot(dl_handle_t* handle, int flags) {
+    if (!handle) {
+        return NULL;
+    }
+    bool initialized = elf32_initialize(handle, flags & RTLD_PARALLEL_INIT);
+    elf32_traceOpen(handle);
+    if (!initialized) {
+        elf32_dlclose(handle);
         return NULL;
     }
+    if (flags & RTLD_NODELETE) {
+        handle->nodelete = true;
+    }
+    return handle;
+}
 
-    handle = calloc(sizeof(dl_handle_t), 1);
+static void* elf32_dlopen_image(const char* name, const char* path, const file_id_t* id, Elf32_Ehdr* header, size_t len, reader_t read, void* source, int flags, dl_mark_t start) {
+    dl_handle_t* handle = calloc(sizeof(dl_handle_t), 1);
     if (!handle) {
-        free(header);
         errmsg = "Memory allocation failure";
         return NULL;
     }
     handle->name = strdup(name);
-    if (!handle->name) {
-        free(header);
+    handle->path = strdup(path);
+    if (!handle->name || !handle->path) {
+        free(handle->name);
+        free(handle->path);
         free(handle);
         errmsg = "Memory allocation failure";
         return NULL;
     }
     handle->refCount = 1;
+    handle->level = dlsearch_level(handle->path);
     hashmap_put(getDlMap(), handle->name, handle);
+    if (id && id->ino) {
+        handle->fileId = *id;
+        hashmap_put(getFileMap(), &handle->fileId, handle);
+    }
 
-    void(*init)(void) = NULL;
+    dlstats_phase(&handle->stats, DL_PHASE_READ, handle->name, start);
 
-    elf32_dlopen_doit(handle, header, &init);
-    free(header);
+    elf32_dlopen_doit(handle, header, len, read, source);
 
     if (!handle->resolved) {
-        ELF32_dlclose(handle);
+        elf32_dlclose(handle);
+        dltrace_span("dlopen", name, start.ns, dlstats_now());
         return NULL;
     }
 
+    // Published before initializers run, so that faults in them resolve
+    dladdr_insert(handle->addrImage);
+    list_add(&loadedHandle, &handle->loadedList);
+    loadedAdds++;
+
     if (flags & RTLD_GLOBAL) {
         list_add(&globalHandle, &handle->globalList);
     }
 
-    if (init)
-        init();
+    dlstats_add(&totalStats, &handle->stats);
+    handle->openStart = start.ns;
+    return handle;
+}
+
+static void* elf32_dlopenFrom(dl_handle_t* parent, const char* name, int flags) {
+    // A shared library will only be attached once
+    dl_handle_t* handle = ELF32_findLoaded(name);
+    if (handle && !(handle->cacheList.prev && (flags & RTLD_NOLOAD))) {
+        elf32_acquire(handle, flags);
+        return handle;
+    }
+    if (flags & RTLD_NOLOAD) {
+        errmsg = "Library not loaded";
+        return NULL;
+    }
+
+    dl_mark_t start = dlstats_mark();
+    char* path;
+    // There are no x86-64 level variants of 32-bit libraries
+    FILE* file = parent ?
+        dlsearch_open(name, parent->path, parent->rpath, parent->runpath, 0, &path) :
+        dlsearch_open(name, NULL, NULL, NULL, 0, &path);
+    if (!file) {
+        errmsg = "Cannot open the shared library";
+        return NULL;
+    }
+
+    // Different paths (relative, absolute, symlinks) may name a file that is
+    // already loaded
+    file_id_t id = {0, 0};
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0) {
+        id.dev = st.st_dev;
+        id.ino = st.st_ino;
+    }
+    if (id.ino) {
+        handle = hashmap_get(getFileMap(), &id);
+        if (handle) {
+            fclose(file);
+            free(path);
+            elf32_acquire(handle, flags);
+            return handle;
+        }
+    }
+
+    size_t len;
+    reader_t read;
+    void* source;
+    Elf32_Ehdr* header = ELF32_readHeaders(file, &len, &read, &source);
+    if (!header) {
+        fclose(file);
+        free(path);
+        errmsg = "Broken shared library";
+        return NULL;
+    }
 
+    handle = elf32_dlopen_image(name, path, &id, header, len, read, source, flags, start);
+    // A dependency is traced up to its load, a root until it is initialized
+    if (handle && parent) {
+        elf32_traceOpen(handle);
+    }
+    free(header);
+    if (read == dlpack_read) {
+        dlpack_close(source);
+    }
+    fclose(file);
+    free(path);
     return handle;
 }
 
-void ELF32_dlclose(void* handle) {
+void* ELF32_dlopen(const char* name, int flags) {
+    if (!dlrecord_enabled()) {
+        return elf32_initRoot(elf32_dlopenFrom(NULL, name, flags), flags);
+    }
+    uint64_t start = dlstats_now();
+    void* handle = elf32_initRoot(elf32_dlopenFrom(NULL, name, flags), flags);
+    dlrecord_open(name, flags, handle, start, dlstats_now());
+    return handle;
+}
+
+static void* elf32_dlopenMem(const void* buf, size_t len, const char* name, int flags) {
+    dl_handle_t* handle = ELF32_findLoaded(name);
+    if (handle && !(handle->cacheList.prev && (flags & RTLD_NOLOAD))) {
+        elf32_acquire(handle, flags);
+    } else if (flags & RTLD_NOLOAD) {
+        errmsg = "Library not loaded";
+        return NULL;
+    } else {
+        handle = elf32_dlopen_image(name, name, NULL, (Elf32_Ehdr*)buf, len, readMemory, (void*)buf, flags, dlstats_mark());
+    }
+    return elf32_initRoot(handle, flags);
+}
+
+/* Recorded as a regular open, a replay looks the name up as a file */
+void* ELF32_dlopen_mem(const void* buf, size_t len, const char* name, int flags) {
+    if (!dlrecord_enabled()) {
+        return elf32_dlopenMem(buf, len, name, flags);
+    }
+    uint64_t start = dlstats_now();
+    void* handle = elf32_dlopenMem(buf, len, name, flags);
+    dlrecord_open(name, flags, handle, start, dlstats_now());
+    return handle;
+}
+
+static void elf32_destroy(dl_handle_t* thandle);
+
+/*
+ * Finalize a handle whose last reference went away and keep it in the cache,
+ * evicting the least recently closed handles beyond the limit. Its
+ * dependencies stay referenced until it is evicted.
+ */
+static bool elf32_park(dl_handle_t* handle) {
+    if (!handle->snapshot || !handle->resolved || handle->stats.memory > elf32_cacheLimit()) {
+        return false;
+    }
+
+    if (handle->initState == INIT_DONE) {
+        elf32_runFini(handle);
+    }
+    handle->initState = INIT_PENDING;
+    if (handle->globalList.prev) {
+        list_remove(&handle->globalList);
+        handle->globalList.prev = NULL;
+    }
+    list_remove(&handle->loadedList);
+    handle->loadedList.prev = NULL;
+    loadedSubs++;
+
+    list_addFirst(&cachedHandle, &handle->cacheList);
+    cacheBytes += handle->stats.memory;
+    while (cacheBytes > cacheLimit) {
+        dl_handle_t* victim = container_of(cachedHandle.prev, dl_handle_t, cacheList);
+        list_remove(&victim->cacheList);
+        victim->cacheList.prev = NULL;
+        cacheBytes -= victim->stats.memory;
+        elf32_destroy(victim);
+    }
+    return true;
+}
+
+static void elf32_dlclose(void* handle) {
     dl_handle_t* thandle = (dl_handle_t*)handle;
     if (--thandle->refCount) return;
 
-    if (thandle->resolved && thandle->fini)
-        thandle->fini();
+    // Kept loaded, and initialized, for the lifetime of the process
+    if (thandle->nodelete) return;
+
+    if (!elf32_park(thandle)) {
+        elf32_destroy(thandle);
+    }
+}
+
+static void elf32_destroy(dl_handle_t* thandle) {
+    if (thandle->initState == INIT_DONE)
+        elf32_runFini(thandle);
+
+    if (thandle->resolved) {
+        totalStats.memory -= thandle->stats.memory;
+    }
 
     // If it was in the global list, remove it from the list
     if (thandle->globalList.prev) {
         list_remove(&thandle->globalList);
     }
+    if (thandle->loadedList.prev) {
+        list_remove(&thandle->loadedList);
+        loadedSubs++;
+    }
 
     hashmap_remove(getDlMap(), thandle->name);
+    if (thandle->soname && hashmap_get(getSonameMap(), thandle->soname) == thandle) {
+        hashmap_remove(getSonameMap(), thandle->soname);
+    }
+    if (thandle->fileId.ino) {
+        hashmap_remove(getFileMap(), &thandle->fileId);
+    }
 
     if (thandle->depDl) {
         for (size_t i = 0; i < thandle->depDlLen; i++) {
             if (thandle->depDl[i])
-                ELF32_dlclose(thandle->depDl[i]);
+                elf32_dlclose(thandle->depDl[i]);
         }
         free(thandle->depDl);
     }
     if (thandle->map)
         hashmap_dispose(thandle->map);
-    if (thandle->executable)
-        aligned_free(thandle->executable);
-    if (thandle->strtab)
-        free(thandle->strtab);
+    dladdr_remove(thandle->addrImage);
+    if (thandle->executable) {
+        perfmap_remove(thandle->executable, thandle->size, thandle->name);
+        free_exec(thandle->executable);
+    }
+    free(thandle->phdr);
+    free(thandle->ifuncs);
+    free(thandle->soname);
+    free(thandle->snapshot);
     free(thandle->name);
+    free(thandle->path);
     free(thandle);
 }
 
+void ELF32_dlclose(void* handle) {
+    if (!dlrecord_enabled()) {
+        elf32_dlclose(handle);
+        return;
+    }
+    uint64_t start = dlstats_now();
+    elf32_dlclose(handle);
+    dlrecord_close(handle, start, dlstats_now());
+}
+
 void* ELF32_dlsym(void* handle, const char* name) {
     dl_handle_t* thandle = (dl_handle_t*)handle;
-    return hashmap_get(thandle->map, name);
+    if (!dlrecord_enabled()) {
+        return hashmap_get(thandle->map, name);
+    }
+    uint64_t start = dlstats_now();
+    void* symbol = hashmap_get(thandle->map, name);
+    dlrecord_sym(handle, name, symbol, start, dlstats_now());
+    return symbol;
+}
+
+int ELF32_dlinfo(void* handle, int request, void* arg) {
+    dl_handle_t* thandle = (dl_handle_t*)handle;
+    switch (request) {
+        case RTLD_DI_STATS:
+            *(dl_stats_t*)arg = thandle->stats;
+            return 0;
+        case RTLD_DI_LEVEL:
+            *(int*)arg = thandle->level;
+            return 0;
+        default:
+            errmsg = "Unsupported dlinfo request";
+            return -1;
+    }
+}
+
+void ELF32_dlcache(size_t bytes) {
+    cacheLimit = bytes;
+    cacheConfigured = true;
+    while (cacheBytes > cacheLimit) {
+        dl_handle_t* victim = container_of(cachedHandle.prev, dl_handle_t, cacheList);
+        list_remove(&victim->cacheList);
+        victim->cacheList.prev = NULL;
+        cacheBytes -= victim->stats.memory;
+        elf32_destroy(victim);
+    }
+}
+
+void ELF32_dlstats(dl_stats_t* stats) {
+    *stats = totalStats;
+}
+
+int ELF32_dladdr(const void* addr, dl_info_t* info) {
+    return dladdr_lookup(addr, info);
+}
+
+int ELF32_iterate_phdr(elf32_phdr_callback_t callback, void* data) {
+    elf32_phdr_info_t info;
+    info.dlpi_adds = loadedAdds;
+    info.dlpi_subs = loadedSubs;
+    info.dlpi_tls_modid = 0;
+    info.dlpi_tls_data = NULL;
+
+    dl_handle_t* handle;
+    list_forEach(&loadedHandle, handle, dl_handle_t, loadedList) {
+        info.dlpi_addr = (uintptr_t)handle->executable;
+        info.dlpi_name = handle->path;
+        info.dlpi_phdr = handle->phdr;
+        info.dlpi_phnum = handle->phnum;
+        int ret = callback(&info, sizeof(info), data);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
 }
 
 char* ELF32_dlerror(void) {
@@ -511,5 +1421,8 @@ char* ELF32_dlerror(void) {
 }
 
 void ELF32_addGlobalSymbol(const char* name, void* symbol) {
+    if (dlrecord_enabled()) {
+        dlrecord_global(name, dlstats_now());
+    }
     hashmap_put(getGlobalMap(true), name, symbol);
 }
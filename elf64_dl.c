@@ -3,52 +3,267 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+
+// Lazy loading needs the PLT trampoline, which exists for x86-64 ELF hosts
+#if defined(__x86_64__) && defined(__ELF__)
+#define ELF64_LAZY_BINDING
+#endif
+#ifndef _MSC_VER
+#include <pthread.h>
+#endif
 
 #include <elf/elf64.h>
 #include <elf/elf64_dl.h>
+#include <elf/dlsearch.h>
+#include <elf/dlpack.h>
+#include <elf/dltrace.h>
+#include <elf/perfmap.h>
+#include <elf/dlrecord.h>
+#include <elf/dladdr.h>
+#include <elf/dlinit.h>
+#include <elf/dlprofile.h>
 #include <util/list.h>
 #include <util/hashmap.h>
+#include <util/cpu.h>
+
+// GOT slots repointed by ELF64_dlreload may be read by other threads
+#ifdef _MSC_VER
+#include <Windows.h>
+#define atomic_storeSlot(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#else
+#define atomic_storeSlot(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+/* Identity of the file an image was loaded from. ino is 0 if unknown. */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} file_id_t;
+
+/*
+ * Libraries that see each other, see ELF64_dlmopen. Each namespace has its
+ * own dedup maps, global scope and host symbols.
+ */
+typedef struct {
+    hashmap_t* dlMap;
+    hashmap_t* fileMap;
+    hashmap_t* sonameMap;
+    hashmap_t* globalMap;
+    list_t globalHandle;
+} dl_namespace_t;
+
+/*
+ * A GOT slot of importer bound to a symbol defined in another image, and the
+ * PLT entry jumping straight to that symbol instead of through the slot
+ */
+typedef struct {
+    struct dl_handle_t* importer;
+    uint64_t* slot;
+    Elf64_Sym* symbol;
+    unsigned char* plt;
+} dl_binding_t;
 
 typedef struct dl_handle_t  {
+    dl_namespace_t* ns;
     char* name;
-    char* strtab;
+    char* path;
+    // Copied, relocations may rewrite the string table under a map key
+    char* soname;
+    const char* rpath;
+    const char* runpath;
+    file_id_t fileId;
+    // x86-64 level of the variant that was loaded, 0 for the baseline
+    int level;
     hashmap_t* map;
+    dladdr_image_t* addrImage;
     char* executable;
+    size_t size;
+    // Writable alias of the image and the PF_* flags of each of its pages,
+    // plus PAGE_PATCHED, see elf64_writable
+    char* alias;
+    unsigned char* pageFlags;
+
+    // Initializers run in the order DT_INIT, DT_INIT_ARRAY and finalizers in
+    // the order DT_FINI_ARRAY reversed, DT_FINI
+    void(*init)(void);
+    void(**initArray)(void);
+    size_t initArrayLen;
     void(*fini)(void);
+    void(**finiArray)(void);
+    size_t finiArrayLen;
+    int initState;
+    size_t initIndex;
+    dl_mark_t initStart;
+    // Start of the open that loaded the image, until its "dlopen" trace
+    // span is closed
+    uint64_t openStart;
 
     size_t depDlLen;
     struct dl_handle_t** depDl;
 
+    // With RTLD_LAZYLOAD, depDl entries stay NULL until a symbol is needed
+    // from them. The tables below are kept to bind PLT entries then.
+    bool lazyLoad;
+    bool lazyPlt;
+    // With RTLD_BYPASS_PLT, PLT entries jump to their target directly
+    bool bypassPlt;
+    const char** depNames;
+    char* strtab;
+    char* symtab;
+    uint64_t syment;
+    uint64_t symbolCount;
+    char* jmpRel;
+
+    // Symbol table indices of the IFUNCs defined here, until their
+    // resolvers have run
+    int* ifuncs;
+    int ifuncCount;
+
     int refCount;
     bool resolved;
 
+    dl_stats_t stats;
+
+    // Program headers, kept for ELF64_iterate_phdr
+    Elf64_Phdr* phdr;
+    uint16_t phnum;
+
+    // Writable segments as they were before initializers ran, kept while
+    // the closed-handle cache is enabled so that an image can be revived
+    char* snapshot;
+    size_t snapshotSize;
+    bool nodelete;
+
+    // Reverse dependency index for ELF64_dlreload: the slots of other images
+    // bound to this one, and the images this one has slots bound to
+    dl_binding_t* bindings;
+    size_t bindingCount;
+    size_t bindingCapacity;
+    struct dl_handle_t** providers;
+    size_t providerCount;
+    uint64_t retiredAt;
+
     list_t globalList;
+    list_t loadedList;
+    list_t cacheList;
 } dl_handle_t;
 
+/* IFUNC resolvers receive the CPU_* feature bits of util/cpu.h */
+typedef void* (*ifunc_resolver_t)(uint64_t features);
+
+enum {
+    INIT_PENDING,
+    INIT_QUEUED,
+    INIT_DONE
+};
+
 static const char* errmsg = NULL;
-static list_t globalHandle = {&globalHandle, &globalHandle};
+// Namespace of ELF64_dlopen, whose host symbols all namespaces see
+static dl_namespace_t baseNamespace = {NULL, NULL, NULL, NULL, {&baseNamespace.globalHandle, &baseNamespace.globalHandle}};
+static list_t loadedHandle = {&loadedHandle, &loadedHandle};
+static unsigned long long loadedAdds = 0;
+static unsigned long long loadedSubs = 0;
+
+// Images replaced by ELF64_dlreload, freed once the grace period is over
+static list_t retiredHandle = {&retiredHandle, &retiredHandle};
+
+// Closed handles kept resident, most recently closed first
+static list_t cachedHandle = {&cachedHandle, &cachedHandle};
+static size_t cacheBytes = 0;
+static size_t cacheLimit = 0;
+static bool cacheConfigured = false;
+static dl_stats_t totalStats;
 
-void* readFile(const char* name);
 void* alloc_exec(size_t size);
+void* exec_alias(void* ptr);
+bool protect_exec(void* ptr, const unsigned char* flags);
+bool share_exec(void* dst, const void* src, size_t offset, size_t len);
 void free_exec(void* ptr);
 
-static hashmap_t* getDlMap() {
-    static hashmap_t* map = NULL;
-    if (!map) {
-        map = hashmap_new_string(1);
+/*
+ * Segment contents are pulled through a reader so that each PT_LOAD segment
+ * goes straight from its source into its final location in the image.
+ */
+typedef bool (*reader_t)(void* source, uint64_t offset, void* dst, size_t size);
+
+static bool readMemory(void* source, uint64_t offset, void* dst, size_t size) {
+    memcpy(dst, (char*)source + offset, size);
+    return true;
+}
+
+static bool readStream(void* source, uint64_t offset, void* dst, size_t size) {
+    FILE* file = source;
+    if (fseek(file, (long)offset, SEEK_SET) == -1) {
+        return false;
     }
-    return map;
+    return fread(dst, size, 1, file) == 1;
+}
+
+static hashmap_t* getDlMap(dl_namespace_t* ns) {
+    if (!ns->dlMap) {
+        ns->dlMap = hashmap_new_string(64);
+    }
+    return ns->dlMap;
+}
+
+static int fileIdHash(const void* key) {
+    const file_id_t* id = key;
+    return (int)(id->ino ^ (id->ino >> 32) ^ (id->dev * 31));
+}
+
+static int fileIdComparator(const void* a, const void* b) {
+    const file_id_t* x = a;
+    const file_id_t* y = b;
+    return x->dev != y->dev || x->ino != y->ino;
+}
+
+static hashmap_t* getFileMap(dl_namespace_t* ns) {
+    if (!ns->fileMap) {
+        ns->fileMap = hashmap_new(fileIdHash, fileIdComparator, 64);
+    }
+    return ns->fileMap;
+}
+
+static hashmap_t* getSonameMap(dl_namespace_t* ns) {
+    if (!ns->sonameMap) {
+        ns->sonameMap = hashmap_new_string(64);
+    }
+    return ns->sonameMap;
+}
+
+static dl_handle_t* ELF64_findLoaded(dl_namespace_t* ns, const char* name) {
+    dl_handle_t* handle = hashmap_get(getDlMap(ns), name);
+    if (!handle) {
+        handle = hashmap_get(getSonameMap(ns), name);
+    }
+    return handle;
 }
 
-static hashmap_t* getGlobalMap(bool init) {
+static hashmap_t* getGlobalMap(dl_namespace_t* ns, bool init) {
+    if (!ns->globalMap && init) {
+        ns->globalMap = hashmap_new_string(64);
+    }
+    return ns->globalMap;
+}
+
+/* One image per file whose untouched pages later loads map, see elf64_share */
+static hashmap_t* getSharedMap() {
     static hashmap_t* map = NULL;
-    if (!map && init) {
-        map = hashmap_new_string(1);
+    if (!map) {
+        map = hashmap_new(fileIdHash, fileIdComparator, 64);
     }
     return map;
 }
 
-static int ELF64_validate(Elf64_Ehdr* header) {
+/* Largest image accepted, well below where segment arithmetic could wrap */
+#define ELF64_MAX_IMAGE (1ull << 40)
+
+static int ELF64_validate(Elf64_Ehdr* header, size_t len) {
+    if (len < sizeof(Elf64_Ehdr)) {
+        return 0;
+    }
+
     if (header->e_ident[EI_MAG0] != ELFMAG0 ||
             header->e_ident[EI_MAG1] != ELFMAG1 ||
             header->e_ident[EI_MAG2] != ELFMAG2 ||
@@ -72,9 +287,121 @@ static int ELF64_validate(Elf64_Ehdr* header) {
         return 0;
     }
 
+    // Program headers and segment contents must lie within the image. The
+    // buffer may come from anywhere, so sums are never formed unchecked.
+    if (header->e_phentsize != sizeof(Elf64_Phdr) || header->e_phoff > len ||
+            (uint64_t)header->e_phnum * sizeof(Elf64_Phdr) > len - header->e_phoff) {
+        return 0;
+    }
+
+    int loads = 0;
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf64_Phdr *program = ELF64_PH_GET(header, i);
+        if (program->p_type == PT_LOAD) {
+            if (program->p_offset > len || program->p_filesz > len - program->p_offset ||
+                    program->p_filesz > program->p_memsz) {
+                return 0;
+            }
+            // Alignment is a power of two, and rounding the segment up to it
+            // stays within the largest image accepted
+            if (!program->p_align || (program->p_align & (program->p_align - 1)) ||
+                    program->p_align > ELF64_MAX_IMAGE || program->p_vaddr > ELF64_MAX_IMAGE ||
+                    program->p_memsz > ELF64_MAX_IMAGE - program->p_vaddr) {
+                return 0;
+            }
+            loads++;
+        }
+    }
+    if (!loads) {
+        return 0;
+    }
+
+    // The dynamic section is read from the image, so it must be loaded
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf64_Phdr *dynamic = ELF64_PH_GET(header, i);
+        if (dynamic->p_type != PT_DYNAMIC) {
+            continue;
+        }
+        bool loaded = false;
+        for (int j = 0; j < header->e_phnum && !loaded; j++) {
+            Elf64_Phdr *program = ELF64_PH_GET(header, j);
+            loaded = program->p_type == PT_LOAD && dynamic->p_vaddr >= program->p_vaddr &&
+                dynamic->p_vaddr - program->p_vaddr <= program->p_memsz &&
+                dynamic->p_memsz >= sizeof(Elf64_Dyn) &&
+                dynamic->p_memsz <= program->p_memsz - (dynamic->p_vaddr - program->p_vaddr);
+        }
+        if (!loaded) {
+            return 0;
+        }
+    }
+
     return 1;
 }
 
+/* Whether size bytes at ptr lie within the image, without overflowing */
+static bool elf64_inImage(dl_handle_t* handle, const void* ptr, uint64_t size) {
+    uint64_t offset = (uint64_t)((uintptr_t)ptr - (uintptr_t)handle->executable);
+    return offset <= handle->size && size <= handle->size - offset;
+}
+
+/*
+ * Relocation tables must lie within the image. Their entries are checked as
+ * they are applied, since earlier relocations may rewrite later ones.
+ */
+static bool ELF64_validateRela(dl_handle_t* handle, char* reltab, uint64_t size) {
+    return size % sizeof(Elf64_Rela) == 0 && elf64_inImage(handle, reltab, size);
+}
+
+/*
+ * Read the ELF header and the program headers of file, and pick the reader
+ * for its segments. A packed container (see dlpack.h) stands in for the
+ * library it holds, and must be closed with dlpack_close after loading.
+ */
+static Elf64_Ehdr* ELF64_readHeaders(FILE* file, size_t* len, reader_t* read, void** source) {
+    dlpack_t* pack = dlpack_open(file);
+    long length;
+    if (pack) {
+        *read = dlpack_read;
+        *source = pack;
+        length = (long)dlpack_size(pack);
+    } else {
+        *read = readStream;
+        *source = file;
+        if (fseek(file, 0, SEEK_END) == -1 || (length = ftell(file)) == -1) {
+            return NULL;
+        }
+    }
+
+    // Only the ELF header and the program headers are kept in memory
+    Elf64_Ehdr ehdr;
+    if ((size_t)length < sizeof(ehdr) || !(*read)(*source, 0, &ehdr, sizeof(ehdr))) {
+        dlpack_close(pack);
+        return NULL;
+    }
+    if (ehdr.e_phoff > (uint64_t)length ||
+            (uint64_t)ehdr.e_phnum * ehdr.e_phentsize > (uint64_t)length - ehdr.e_phoff) {
+        dlpack_close(pack);
+        return NULL;
+    }
+    uint64_t hdrsz = ehdr.e_phoff + (uint64_t)ehdr.e_phnum * ehdr.e_phentsize;
+    if (hdrsz < sizeof(ehdr)) {
+        hdrsz = sizeof(ehdr);
+    }
+
+    Elf64_Ehdr* header = malloc((size_t)hdrsz);
+    if (!header) {
+        dlpack_close(pack);
+        return NULL;
+    }
+    if (!(*read)(*source, 0, header, (size_t)hdrsz)) {
+        free(header);
+        dlpack_close(pack);
+        return NULL;
+    }
+    *len = length;
+    return header;
+}
+
 static void ELF64_findBounds(Elf64_Ehdr* header, uint64_t* loPtr, uint64_t* hiPtr) {
     uint64_t lo = 0xFFFFFFFF, hi = 0;
     for (int i = 0; i < header->e_phnum; i++) {
@@ -96,14 +423,67 @@ static void ELF64_findBounds(Elf64_Ehdr* header, uint64_t* loPtr, uint64_t* hiPt
         *hiPtr = hi;
 }
 
-static void ELF64_loadProgram(Elf64_Ehdr *header, char* mem) {
+static bool ELF64_loadProgram(Elf64_Ehdr *header, char* mem, reader_t read, void* source) {
     for (int i = 0; i < header->e_phnum; i++) {
         Elf64_Phdr *h = ELF64_PH_GET(header, i);
         if (h->p_type == PT_LOAD) {
-            memset(mem + h->p_vaddr + h->p_filesz, 0, (size_t)(h->p_memsz - h->p_filesz));
-            memcpy(mem + h->p_vaddr, ELF64_PH_CONTENT(header, h), (size_t)h->p_filesz);
+            // alloc_exec hands out demand-zero pages, so the bss part
+            // (p_memsz - p_filesz) is left alone and never gets committed
+            // unless the library actually touches it.
+            if (h->p_filesz && !read(source, h->p_offset, mem + h->p_vaddr, (size_t)h->p_filesz)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* OR the flags of every loadable segment into the pages it covers */
+static unsigned char* ELF64_pageFlags(Elf64_Ehdr* header, uint64_t size) {
+    unsigned char* flags = calloc((size_t)((size + 4095) / 4096), 1);
+    if (!flags) {
+        return NULL;
+    }
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf64_Phdr *h = ELF64_PH_GET(header, i);
+        if (h->p_type == PT_LOAD && h->p_memsz) {
+            for (uint64_t page = h->p_vaddr / 4096; page <= (h->p_vaddr + h->p_memsz - 1) / 4096; page++) {
+                flags[page] |= h->p_flags & (PF_R | PF_W | PF_X);
+            }
         }
     }
+    return flags;
+}
+
+/* Page flag of read-only pages the loader writes to, which are never shared */
+#define PAGE_PATCHED 0x80
+
+/*
+ * Address the loader writes to for an offset into the image. Writable pages
+ * are private to the execution view, the others are only writable through
+ * the alias. Writes never change page protections, so they are safe while
+ * other threads run the image.
+ */
+static inline void* elf64_writable(dl_handle_t* handle, uint64_t offset) {
+    unsigned char* flags = &handle->pageFlags[offset / 4096];
+    if (*flags & PF_W) {
+        return handle->executable + offset;
+    }
+    *flags |= PAGE_PATCHED;
+    return handle->alias + offset;
+}
+
+/* Mark a range written through the alias at any time, see elf64_writable */
+static void elf64_markPatched(dl_handle_t* handle, uint64_t offset, uint64_t size) {
+    if (offset >= handle->size) {
+        return;
+    }
+    if (size > handle->size - offset) {
+        size = handle->size - offset;
+    }
+    for (uint64_t page = offset / 4096; size && page <= (offset + size - 1) / 4096; page++) {
+        handle->pageFlags[page] |= PAGE_PATCHED;
+    }
 }
 
 static int ELF64_findProgram(Elf64_Ehdr* header, int startIndex, int targetType) {
@@ -116,15 +496,20 @@ static int ELF64_findProgram(Elf64_Ehdr* header, int startIndex, int targetType)
     return -1;
 }
 
-static void* ELF64_resolveSymbolGlobal(const char* name) {
-    hashmap_t* map = getGlobalMap(false);
+static void* ELF64_resolveSymbolGlobal(dl_namespace_t* ns, const char* name) {
+    hashmap_t* map = getGlobalMap(ns, false);
     if (map) {
         void* ret = hashmap_get(map, name);
         if (ret) return ret;
     }
+    map = getGlobalMap(&baseNamespace, false);
+    if (ns != &baseNamespace && map) {
+        void* ret = hashmap_get(map, name);
+        if (ret) return ret;
+    }
     dl_handle_t* handle;
-    list_forEach(&globalHandle, handle, dl_handle_t, globalList) {
-        void* ret = ELF64_dlsym(handle, name);
+    list_forEach(&ns->globalHandle, handle, dl_handle_t, globalList) {
+        void* ret = hashmap_get(handle->map, name);
         if (ret) return ret;
     }
     return NULL;
@@ -134,16 +519,26 @@ static bool ELF64_resolveSymbols(dl_handle_t* handle, char* strtab, char *symtab
     /* First element is skipeed */
     for (int i = 1; i < size; i++) {
         Elf64_Sym *symbol = (Elf64_Sym *)(symtab + i * syment);
+        // Imports are rewritten to SHN_ABS below
+        bool defined = symbol->st_shndx != SHN_UNDEF;
 
-        if (symbol->st_shndx == SHN_UNDEF) {
+        if (!defined) {
             // Undefined symbols, we need to resolve from the dependency list
 
             // Get the name of the symbol
             char *name = strtab + symbol->st_name;
 
-            void* result = ELF64_resolveSymbolGlobal(name);
+            void* result = ELF64_resolveSymbolGlobal(handle->ns, name);
             for (size_t i = 0; !result && i < handle->depDlLen; i++) {
-                result = ELF64_dlsym(handle->depDl[i], name);
+                if (handle->depDl[i]) {
+                    result = hashmap_get(handle->depDl[i]->map, name);
+                }
+            }
+
+            // Strong symbols may come from a dependency that is not open yet.
+            // Weak ones never cause a dependency to be opened.
+            if (!result && handle->lazyLoad && !(ELF64_ST_BIND(symbol->st_info) & STB_WEAK)) {
+                continue;
             }
 
             // It is a error if we cannot resolve a strong symbol
@@ -155,11 +550,36 @@ static bool ELF64_resolveSymbols(dl_handle_t* handle, char* strtab, char *symtab
                 }
             }
 
+            if (result) {
+                handle->stats.symbolsImported++;
+            }
+
             symbol->st_shndx = SHN_ABS;
             symbol->st_value = (uint64_t)result;
         } else if (symbol->st_shndx < SHN_LORESERVE) {
             symbol->st_shndx = SHN_ABS;
             symbol->st_value = (uint64_t)(symbol->st_value + handle->executable);
+
+            int type = ELF64_ST_TYPE(symbol->st_info);
+            // Imports of IFUNC type are bound to the selected implementation
+            // already, only resolvers defined here are called
+            if (type == STT_GNU_IFUNC) {
+                if (!(handle->ifuncCount & (handle->ifuncCount - 1))) {
+                    int* grown = realloc(handle->ifuncs, (handle->ifuncCount ? handle->ifuncCount * 2 : 4) * sizeof(int));
+                    if (!grown) {
+                        errmsg = "Memory allocation failure";
+                        return false;
+                    }
+                    handle->ifuncs = grown;
+                }
+                handle->ifuncs[handle->ifuncCount++] = i;
+            }
+            if (type == STT_FUNC || type == STT_OBJECT) {
+                dladdr_addSymbol(handle->addrImage, (void*)symbol->st_value, symbol->st_size, strtab + symbol->st_name);
+            }
+            if (type == STT_FUNC && symbol->st_size && perfmap_enabled()) {
+                perfmap_add((void*)symbol->st_value, symbol->st_size, strtab + symbol->st_name, handle->name);
+            }
         } else if (symbol->st_shndx != SHN_ABS) {
             errmsg = "Unimplemented st_shndx";
             return false;
@@ -168,26 +588,555 @@ static bool ELF64_resolveSymbols(dl_handle_t* handle, char* strtab, char *symtab
         if (ELF64_ST_BIND(symbol->st_info) & STB_GLOBAL) {
             char *name = strtab + symbol->st_name;
             hashmap_put(handle->map, name, (void*)symbol->st_value);
+            // Resolved imports are visible through the map, but not counted
+            if (defined) {
+                handle->stats.symbolsExported++;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Call the resolver of every IFUNC symbol defined here, once. Its result
+ * replaces the symbol value, in the symbol table for the deferred relocations
+ * and in the export map, so dependents bind straight to the selected
+ * implementation.
+ */
+static void ELF64_resolveIfuncs(dl_handle_t* handle, char* strtab, char *symtab, uint64_t syment) {
+    uint64_t features = cpu_features();
+    for (int i = 0; i < handle->ifuncCount; i++) {
+        Elf64_Sym *symbol = (Elf64_Sym *)(symtab + handle->ifuncs[i] * syment);
+        ifunc_resolver_t resolver = (ifunc_resolver_t)symbol->st_value;
+        symbol->st_value = (Elf64_Addr)resolver(features);
+        if (ELF64_ST_BIND(symbol->st_info) & STB_GLOBAL) {
+            hashmap_put(handle->map, strtab + symbol->st_name, (void*)symbol->st_value);
+        }
+    }
+}
+
+static void* elf64_dlopenFrom(dl_namespace_t* ns, dl_handle_t* parent, const char* name, int flags);
+static void elf64_dlclose(void* handle);
+static bool elf64_initialize(dl_handle_t* handle, bool parallel);
+
+static size_t elf64_cacheLimit(void) {
+    if (!cacheConfigured) {
+        const char* env = getenv(DLCACHE_ENV);
+        cacheLimit = env ? (size_t)strtoull(env, NULL, 0) : 0;
+        cacheConfigured = true;
+    }
+    return cacheLimit;
+}
+
+/* Copy the writable segments, which initializers and lazy binding modify */
+static bool elf64_snapshot(dl_handle_t* handle) {
+    size_t size = 0;
+    for (uint16_t i = 0; i < handle->phnum; i++) {
+        if (handle->phdr[i].p_type == PT_LOAD && (handle->phdr[i].p_flags & PF_W)) {
+            size += (size_t)handle->phdr[i].p_memsz;
+        }
+    }
+    handle->snapshot = malloc(size ? size : 1);
+    if (!handle->snapshot) {
+        return false;
+    }
+    handle->snapshotSize = size;
+    char* p = handle->snapshot;
+    for (uint16_t i = 0; i < handle->phnum; i++) {
+        Elf64_Phdr* program = &handle->phdr[i];
+        if (program->p_type == PT_LOAD && (program->p_flags & PF_W)) {
+            memcpy(p, handle->executable + program->p_vaddr, (size_t)program->p_memsz);
+            p += program->p_memsz;
+        }
+    }
+    return true;
+}
+
+static void elf64_restore(dl_handle_t* handle) {
+    char* p = handle->snapshot;
+    for (uint16_t i = 0; i < handle->phnum; i++) {
+        Elf64_Phdr* program = &handle->phdr[i];
+        if (program->p_type == PT_LOAD && (program->p_flags & PF_W)) {
+            memcpy(handle->executable + program->p_vaddr, p, (size_t)program->p_memsz);
+            p += program->p_memsz;
+        }
+    }
+}
+
+/*
+ * Take a reference on a handle that was found already loaded. A handle that
+ * was sitting in the cache gets its writable segments back to their state
+ * right after relocation, and its initializers will run again.
+ */
+static void elf64_acquire(dl_handle_t* handle, int flags) {
+    if (handle->refCount++ || !handle->cacheList.prev) {
+        return;
+    }
+    list_remove(&handle->cacheList);
+    handle->cacheList.prev = NULL;
+    cacheBytes -= handle->stats.memory;
+
+    elf64_restore(handle);
+    list_add(&loadedHandle, &handle->loadedList);
+    loadedAdds++;
+    if (flags & RTLD_GLOBAL) {
+        list_add(&handle->ns->globalHandle, &handle->globalList);
+    }
+}
+
+static dl_handle_t* elf64_findProvider(dl_handle_t* importer, uint64_t value) {
+    for (size_t i = 0; i < importer->depDlLen; i++) {
+        dl_handle_t* dep = importer->depDl[i];
+        if (dep && value - (uint64_t)dep->executable < dep->size) {
+            return dep;
+        }
+    }
+    dl_handle_t* handle;
+    list_forEach(&loadedHandle, handle, dl_handle_t, loadedList) {
+        if (value - (uint64_t)handle->executable < handle->size) {
+            return handle;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add a slot to the reverse dependency index of the image defining its
+ * symbol. Symbols of the importer itself or of the host are not tracked.
+ * Relocation binds every slot once. A slot bound lazily afterwards may have
+ * been bound before, by an earlier life of an image revived from the cache
+ * or by another thread entering the same PLT entry, and keeps one entry.
+ */
+static bool elf64_recordBinding(dl_handle_t* importer, uint64_t* slot, Elf64_Sym* symbol, unsigned char* plt) {
+    uint64_t value = symbol->st_value;
+    if (value - (uint64_t)importer->executable < importer->size) {
+        return true;
+    }
+    dl_handle_t* provider = elf64_findProvider(importer, value);
+    if (!provider) {
+        return true;
+    }
+
+    if (importer->resolved) {
+        for (size_t j = 0; j < provider->bindingCount; j++) {
+            dl_binding_t* binding = &provider->bindings[j];
+            if (binding->importer == importer && binding->slot == slot) {
+                binding->symbol = symbol;
+                binding->plt = plt;
+                return true;
+            }
+        }
+    }
+
+    if (provider->bindingCount == provider->bindingCapacity) {
+        size_t capacity = provider->bindingCapacity ? provider->bindingCapacity * 2 : 16;
+        dl_binding_t* bindings = realloc(provider->bindings, capacity * sizeof(dl_binding_t));
+        if (!bindings) {
+            return false;
+        }
+        provider->bindings = bindings;
+        provider->bindingCapacity = capacity;
+    }
+
+    size_t i = 0;
+    while (i < importer->providerCount && importer->providers[i] != provider) {
+        i++;
+    }
+    if (i == importer->providerCount) {
+        dl_handle_t** providers = realloc(importer->providers, (i + 1) * sizeof(dl_handle_t*));
+        if (!providers) {
+            return false;
+        }
+        providers[i] = provider;
+        importer->providers = providers;
+        importer->providerCount++;
+    }
+
+    dl_binding_t* binding = &provider->bindings[provider->bindingCount++];
+    binding->importer = importer;
+    binding->slot = slot;
+    binding->symbol = symbol;
+    binding->plt = plt;
+    return true;
+}
+
+/* Drop the index entries linking a handle about to be freed to other images */
+static void elf64_forgetBindings(dl_handle_t* handle) {
+    for (size_t i = 0; i < handle->providerCount; i++) {
+        dl_handle_t* provider = handle->providers[i];
+        size_t kept = 0;
+        for (size_t j = 0; j < provider->bindingCount; j++) {
+            if (provider->bindings[j].importer != handle) {
+                provider->bindings[kept++] = provider->bindings[j];
+            }
+        }
+        provider->bindingCount = kept;
+    }
+    for (size_t i = 0; i < handle->bindingCount; i++) {
+        dl_handle_t* importer = handle->bindings[i].importer;
+        for (size_t j = 0; j < importer->providerCount; j++) {
+            if (importer->providers[j] == handle) {
+                importer->providers[j] = importer->providers[--importer->providerCount];
+                break;
+            }
         }
     }
+    free(handle->bindings);
+    free(handle->providers);
+}
+
+/*
+ * Send the calls through a PLT slot to a counting trampoline if the profiler
+ * selects its symbol. Returns where the target of the calls is stored from
+ * now on, the slot itself if nothing changed.
+ */
+static uint64_t* elf64_profileSlot(dl_handle_t* handle, uint64_t* slot, Elf64_Sym* symbol) {
+    const char* name = handle->strtab + symbol->st_name;
+    uint64_t* target;
+    if (!symbol->st_value || !dlprofile_selected(name)) {
+        return slot;
+    }
+    void* trampoline = dlprofile_trampoline(handle->name, name, (void*)symbol->st_value, &target);
+    if (!trampoline) {
+        return slot;
+    }
+    *slot = (uint64_t)trampoline;
+    return target;
+}
+
+/*
+ * Make a PLT entry jump to target with a jmp rel32 if it is in reach, or else
+ * through its GOT slot again. The first 8 bytes of the entry are replaced
+ * with a single store, so threads running it see either jump.
+ */
+static bool elf64_patchPlt(dl_handle_t* handle, unsigned char* stub, uint64_t* slot, uint64_t target) {
+    unsigned char code[8];
+    memcpy(code, stub, 8);
+    int64_t rel = (int64_t)target - (int64_t)(stub + 5);
+    bool direct = rel == (int32_t)rel;
+    if (direct) {
+        int32_t rel32 = (int32_t)rel;
+        code[0] = 0xe9;
+        memcpy(code + 1, &rel32, 4);
+        code[5] = 0x90;
+    } else {
+        int32_t disp = (int32_t)((char*)slot - (char*)(stub + 6));
+        code[0] = 0xff;
+        code[1] = 0x25;
+        memcpy(code + 2, &disp, 4);
+    }
+    uint64_t word;
+    memcpy(&word, code, 8);
+    atomic_storeSlot((uint64_t*)elf64_writable(handle, (uint64_t)(stub - (unsigned char*)handle->executable)), word);
+    return direct;
+}
+
+/*
+ * Bypass the PLT entry of the GOT slot at offset, entry being the address the
+ * slot held before binding. Only the lazy PLT layout is recognized, in which
+ * that is the push following `jmp *slot(%rip)`. Returns the patched entry.
+ */
+static unsigned char* elf64_bypassPlt(dl_handle_t* handle, uint64_t offset, uint64_t entry, uint64_t target) {
+    uint64_t at = entry - 6 - (uint64_t)handle->executable;
+    if (at >= handle->size || handle->size - at < 8 || at % 8 || !(handle->pageFlags[at / 4096] & PF_X)) {
+        return NULL;
+    }
+    unsigned char* stub = (unsigned char*)handle->executable + at;
+    int32_t disp;
+    memcpy(&disp, stub + 2, 4);
+    if (stub[0] != 0xff || stub[1] != 0x25 || (int64_t)at + 6 + disp != (int64_t)offset) {
+        return NULL;
+    }
+    if (!elf64_patchPlt(handle, stub, (uint64_t*)(handle->executable + offset), target)) {
+        return NULL;
+    }
+    // Entries bound lazily are counted after the totals took the handle's
+    handle->stats.pltBypassed++;
+    if (handle->resolved) {
+        totalStats.pltBypassed++;
+    }
+    return stub;
+}
+
+/* Open DT_NEEDED entry index of a handle in lazy mode and initialize it */
+static bool elf64_loadLazyDep(dl_handle_t* handle, size_t index) {
+    dl_handle_t* dep = elf64_dlopenFrom(handle->ns, handle, handle->depNames[index], RTLD_LAZYLOAD);
+    if (!dep) {
+        errmsg = "Cannot load dependency";
+        return false;
+    }
+    if (!dep->resolved) {
+        elf64_dlclose(dep);
+        errmsg = "Recursive dependency";
+        return false;
+    }
+    if (!elf64_initialize(dep, false)) {
+        elf64_dlclose(dep);
+        return false;
+    }
+    handle->depDl[index] = dep;
+    return true;
+}
 
+/*
+ * Bind a symbol left undefined in lazy mode. Open dependencies are searched
+ * first, then the others are opened in DT_NEEDED order until one defines
+ * the symbol, so a symbol defined twice binds to the copy that is already
+ * loaded. The result is cached in the symbol table.
+ */
+static bool elf64_lazyResolve(dl_handle_t* handle, Elf64_Sym* symbol) {
+    if (symbol->st_shndx != SHN_UNDEF) {
+        return true;
+    }
+    const char* name = handle->strtab + symbol->st_name;
+    void* result = NULL;
+    for (size_t i = 0; !result && i < handle->depDlLen; i++) {
+        if (handle->depDl[i]) {
+            result = hashmap_get(handle->depDl[i]->map, name);
+        }
+    }
+    for (size_t i = 0; !result && i < handle->depDlLen; i++) {
+        if (!handle->depDl[i]) {
+            if (!elf64_loadLazyDep(handle, i)) {
+                return false;
+            }
+            result = hashmap_get(handle->depDl[i]->map, name);
+        }
+    }
+    if (!result) {
+        errmsg = "Unresolved symbol";
+        return false;
+    }
+    handle->stats.symbolsImported++;
+    symbol->st_shndx = SHN_ABS;
+    symbol->st_value = (uint64_t)result;
     return true;
 }
 
-static bool ELF64_relocateRela(dl_handle_t* handle, char* reltab, uint64_t entsize, uint64_t limit, char* symtab, uint64_t syment) {
+#ifdef ELF64_LAZY_BINDING
+/* Bytes elf64_lazyTrampoline reserves for xsave, 0 to use fxsave instead */
+__attribute__((visibility("hidden"))) uint64_t elf64_xsaveSize;
+
+/* Handles with PLT entries bound on first call, which parallel init avoids */
+static size_t lazyHandles = 0;
+#endif
+
+/*
+ * The loader lock serializes the public entry points with each other and
+ * with lazy binding. It is recursive, as initializers and finalizers run with
+ * it held and may call back into the loader.
+ */
+#ifdef _MSC_VER
+static CRITICAL_SECTION loaderLock;
+static INIT_ONCE loaderOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK elf64_initLoader(PINIT_ONCE once, PVOID param, PVOID* context) {
+    (void)once;
+    (void)param;
+    (void)context;
+    InitializeCriticalSection(&loaderLock);
+    return TRUE;
+}
+
+static void elf64_lock(void) {
+    InitOnceExecuteOnce(&loaderOnce, elf64_initLoader, NULL, NULL);
+    EnterCriticalSection(&loaderLock);
+}
+
+static void elf64_unlock(void) {
+    LeaveCriticalSection(&loaderLock);
+}
+#else
+static pthread_mutex_t loaderLock;
+static pthread_once_t loaderOnce = PTHREAD_ONCE_INIT;
+
+static void elf64_initLoader(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&loaderLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+#ifdef ELF64_LAZY_BINDING
+    elf64_xsaveSize = cpu_xsaveSize();
+#endif
+}
+
+static void elf64_lock(void) {
+    pthread_once(&loaderOnce, elf64_initLoader);
+    pthread_mutex_lock(&loaderLock);
+}
+
+static void elf64_unlock(void) {
+    pthread_mutex_unlock(&loaderLock);
+}
+#endif
+
+#ifdef ELF64_LAZY_BINDING
+/*
+ * Called through elf64_lazyTrampoline on the first call through a PLT entry
+ * left unbound. The GOT entry is updated so later calls go straight to the
+ * target. Bindings hold the loader lock, so they are serialized with each
+ * other and with the rest of the loader.
+ */
+__attribute__((visibility("hidden"))) void* elf64_lazyBind(dl_handle_t* handle, uint64_t index) {
+    elf64_lock();
+    Elf64_Rela* rel = (Elf64_Rela*)handle->jmpRel + index;
+    Elf64_Sym* symbol = (Elf64_Sym*)(handle->symtab + ELF64_R_SYM(rel->r_info) * handle->syment);
+    if (!elf64_lazyResolve(handle, symbol)) {
+        fprintf(stderr, "%s: cannot bind %s: %s\n", handle->name, handle->strtab + symbol->st_name, errmsg);
+        abort();
+    }
+    uint64_t* slot = elf64_writable(handle, rel->r_offset);
+    uint64_t entry = *slot;
+    *slot = symbol->st_value;
+    uint64_t* target = elf64_profileSlot(handle, slot, symbol);
+    unsigned char* stub = handle->bypassPlt ? elf64_bypassPlt(handle, rel->r_offset, entry, *slot) : NULL;
+    elf64_recordBinding(handle, target, symbol, target == slot ? stub : NULL);
+    elf64_unlock();
+    return (void*)*slot;
+}
+
+/*
+ * PLT0 jumps here with GOT[1] (the handle) and the relocation index pushed
+ * by the PLT entry on the stack. Argument registers are preserved across the
+ * binding: the integer ones on the stack, and the x87, SSE, AVX and AVX-512
+ * state (mask 0xee) with xsave into a 64-byte aligned area of
+ * elf64_xsaveSize bytes, as the binding may run code that clobbers any of
+ * them (vzeroupper in the string functions, for one). The xsave header must
+ * be zeroed beforehand, as xsave leaves its reserved bytes alone.
+ */
+void elf64_lazyTrampoline(void);
+__asm__(
+    ".text\n"
+    ".globl elf64_lazyTrampoline\n"
+    ".hidden elf64_lazyTrampoline\n"
+    ".type elf64_lazyTrampoline, @function\n"
+    "elf64_lazyTrampoline:\n"
+#ifdef __CET__
+    "    endbr64\n"
+#endif
+    "    pushq %rbx\n"
+    "    movq %rsp, %rbx\n"
+    "    pushq %rax\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
+    "    pushq %rdi\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    movq elf64_xsaveSize(%rip), %r11\n"
+    "    testq %r11, %r11\n"
+    "    jz 1f\n"
+    "    subq %r11, %rsp\n"
+    "    andq $-64, %rsp\n"
+    "    xorl %eax, %eax\n"
+    "    movq %rax, 512(%rsp)\n"
+    "    movq %rax, 520(%rsp)\n"
+    "    movq %rax, 528(%rsp)\n"
+    "    movq %rax, 536(%rsp)\n"
+    "    movq %rax, 544(%rsp)\n"
+    "    movq %rax, 552(%rsp)\n"
+    "    movq %rax, 560(%rsp)\n"
+    "    movq %rax, 568(%rsp)\n"
+    "    movl $0xee, %eax\n"
+    "    xorl %edx, %edx\n"
+    "    xsave (%rsp)\n"
+    "    jmp 2f\n"
+    "1:\n"
+    "    subq $512, %rsp\n"
+    "    andq $-64, %rsp\n"
+    "    fxsave (%rsp)\n"
+    "2:\n"
+    "    movq 8(%rbx), %rdi\n"
+    "    movq 16(%rbx), %rsi\n"
+    "    call elf64_lazyBind\n"
+    "    movq %rax, %r11\n"
+    "    cmpq $0, elf64_xsaveSize(%rip)\n"
+    "    je 3f\n"
+    "    movl $0xee, %eax\n"
+    "    xorl %edx, %edx\n"
+    "    xrstor (%rsp)\n"
+    "    jmp 4f\n"
+    "3:\n"
+    "    fxrstor (%rsp)\n"
+    "4:\n"
+    "    leaq -64(%rbx), %rsp\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
+    "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    popq %rax\n"
+    "    popq %rbx\n"
+    "    addq $16, %rsp\n"
+    "    jmp *%r11\n"
+    ".size elf64_lazyTrampoline, .-elf64_lazyTrampoline\n"
+);
+#endif
+
+/*
+ * Relocations that need an IFUNC resolver are left for a second pass (with
+ * ifuncPass set), so that resolvers only run once everything else is
+ * relocated. They are counted in deferred.
+ */
+static bool ELF64_relocateRela(dl_handle_t* handle, char* reltab, uint64_t entsize, uint64_t limit, char* symtab, uint64_t syment, bool ifuncPass, size_t* deferred) {
     for (char* end = reltab + limit; reltab<end; reltab += entsize) {
         Elf64_Rela* rel = (Elf64_Rela*)reltab;
+        if (rel->r_offset > handle->size - sizeof(uint64_t) || ELF64_R_SYM(rel->r_info) >= handle->symbolCount) {
+            errmsg = "Broken shared library";
+            return false;
+        }
         Elf64_Sym *symbol = (Elf64_Sym *)(symtab + ELF64_R_SYM(rel->r_info) * syment);
-        uint64_t *ref = (uint64_t *)(handle->executable + rel->r_offset);
-        switch (ELF64_R_TYPE(rel->r_info)) {
+        uint64_t *ref = elf64_writable(handle, rel->r_offset);
+        uint32_t type = ELF64_R_TYPE(rel->r_info);
+        bool ifunc = type == R_X86_64_IRELATIVE || ELF64_ST_TYPE(symbol->st_info) == STT_GNU_IFUNC;
+        if (ifunc != ifuncPass) {
+            *deferred += ifunc;
+            continue;
+        }
+        handle->stats.relocations[type < DL_RELOC_TYPES ? type : DL_RELOC_TYPES - 1]++;
+
+        // Symbols left undefined in lazy mode. PLT entries keep pointing into
+        // the PLT until first called, anything else needs the address now.
+        if (symbol->st_shndx == SHN_UNDEF && ELF64_R_SYM(rel->r_info)) {
+            if (type == R_X86_64_JUMP_SLOT && handle->lazyPlt) {
+                *ref += (uint64_t)handle->executable;
+                continue;
+            }
+            if (!elf64_lazyResolve(handle, symbol)) {
+                return false;
+            }
+        }
+
+        switch (type) {
             case R_X86_64_GLOB_DAT:
+            case R_X86_64_JUMP_SLOT: {
+                uint64_t entry = *ref + (uint64_t)handle->executable;
+                unsigned char* plt = NULL;
                 *ref = symbol->st_value;
+                // Only calls are profiled, function addresses stay comparable
+                if (type == R_X86_64_JUMP_SLOT) {
+                    uint64_t* target = elf64_profileSlot(handle, ref, symbol);
+                    unsigned char* stub = handle->bypassPlt ? elf64_bypassPlt(handle, rel->r_offset, entry, *ref) : NULL;
+                    // A reload retargets a trampoline, not the entry jumping to it
+                    plt = target == ref ? stub : NULL;
+                    ref = target;
+                }
+                if (!elf64_recordBinding(handle, ref, symbol, plt)) {
+                    errmsg = "Memory allocation failure";
+                    return false;
+                }
                 break;
-            case R_X86_64_JUMP_SLOT:
-                *ref = symbol->st_value;
-                break;
+            }
             case R_X86_64_RELATIVE:
-                *ref = rel->r_addend + (int)handle->executable;
+                *ref = rel->r_addend + (uint64_t)handle->executable;
+                break;
+            case R_X86_64_IRELATIVE:
+                *ref = (uint64_t)((ifunc_resolver_t)(handle->executable + rel->r_addend))(cpu_features());
                 break;
             default:
                 errmsg = "Unimplemented relocation type";
@@ -198,9 +1147,11 @@ static bool ELF64_relocateRela(dl_handle_t* handle, char* reltab, uint64_t entsi
     return true;
 }
 
-static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**initptr)(void)) {
+static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, size_t len, reader_t read, void* source) {
+    dl_mark_t start = dlstats_mark();
+
     // Check header
-    if (!ELF64_validate(header)) {
+    if (!ELF64_validate(header, len)) {
         errmsg = "Broken shared library";
         return;
     }
@@ -213,23 +1164,75 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
         errmsg = "Memory allocation failure";
         return;
     }
-
-    // Load binary image into memory
-    ELF64_loadProgram(header, handle->executable);
-
-    // Find DYNAMIC section. This is mandatory
-    int dynamicSection = ELF64_findProgram(header, 0, PT_DYNAMIC);
-    if (dynamicSection == -1) {
-        errmsg = "Broken shared library";
+    handle->size = size;
+    handle->alias = exec_alias(handle->executable);
+    handle->pageFlags = ELF64_pageFlags(header, size);
+    if (!handle->pageFlags) {
+        errmsg = "Memory allocation failure";
         return;
     }
+    handle->stats.memory = size + 4096 + (size + 4095) / 4096;
+
+    // Load binary image into memory. Protections are final before any of
+    // its code runs, IFUNC resolvers included.
+    if (!ELF64_loadProgram(header, handle->alias, read, source)) {
+        errmsg = "Cannot read the shared library";
+        return;
+    }
+    if (!protect_exec(handle->executable, handle->pageFlags)) {
+        errmsg = "Cannot map the shared library";
+        return;
+    }
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf64_Phdr *program = ELF64_PH_GET(header, i);
+        if (program->p_type == PT_LOAD) {
+            if (read == readMemory) {
+                handle->stats.bytesCopied += program->p_filesz;
+            } else {
+                handle->stats.bytesRead += program->p_filesz;
+            }
+        }
+    }
+
+    handle->phdr = malloc(header->e_phnum * sizeof(Elf64_Phdr));
+    if (!handle->phdr) {
+        errmsg = "Memory allocation failure";
+        return;
+    }
+    for (int i = 0; i < header->e_phnum; i++) {
+        handle->phdr[i] = *ELF64_PH_GET(header, i);
+    }
+    handle->phnum = header->e_phnum;
+    handle->stats.memory += header->e_phnum * sizeof(Elf64_Phdr);
+    start = dlstats_phase(&handle->stats, DL_PHASE_MAP, handle->name, start);
+
+    // Find DYNAMIC section. This is mandatory
+    int dynamicSection = ELF64_findProgram(header, 0, PT_DYNAMIC);
+    if (dynamicSection == -1) {
+        errmsg = "Broken shared library";
+        return;
+    }
+
+    // All tables are read from the loaded image rather than from the file
+    // contents, so the caller's buffer is never written to
+    Elf64_Dyn* dynamic = (Elf64_Dyn*)(handle->executable + ELF64_PH_GET(header, dynamicSection)->p_vaddr);
+    uint64_t dynamicCount = ELF64_PH_GET(header, dynamicSection)->p_memsz / sizeof(Elf64_Dyn);
+    uint64_t terminator = 0;
+    while (terminator < dynamicCount && dynamic[terminator].d_tag != DT_NULL) {
+        terminator++;
+    }
+    if (terminator == dynamicCount) {
+        errmsg = "Broken shared library";
+        return;
+    }
+
+    char* strtab = NULL;
+    uint64_t strsz = 0;
 
-    char* strtab = NULL;
-    uint64_t strsz = 0;
-
     char* pltgot = NULL;
     Elf64_Word* hash = NULL;
     char *symtab = NULL;
+    uint64_t symtabOffset = 0;
     uint64_t syment = 0;
     int neededLibs = 0;
 
@@ -241,9 +1244,18 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
     uint64_t relasz = 0;
     uint64_t relaent = 0;
 
+    uint64_t initArraySz = 0;
+    uint64_t finiArraySz = 0;
+
+    uint64_t soname = 0;
+    bool hasSoname = false;
+    uint64_t rpath = 0;
+    bool hasRpath = false;
+    uint64_t runpath = 0;
+    bool hasRunpath = false;
+
     // Initial loop. Retrieve table information
-    for (Elf64_Dyn* dynamics = (Elf64_Dyn*)ELF64_PH_CONTENT(header, ELF64_PH_GET(header, dynamicSection));
-            dynamics->d_tag != DT_NULL; dynamics++) {
+    for (Elf64_Dyn* dynamics = dynamic; dynamics->d_tag != DT_NULL; dynamics++) {
         switch (dynamics->d_tag) {
             case DT_NEEDED:
                 neededLibs++;
@@ -252,16 +1264,27 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
                 pltrelsz = dynamics->d_un.d_val;
                 break;
             case DT_PLTGOT:
-                pltgot = ((char*)header + dynamics->d_un.d_ptr);
+                // GOT[0..2] are the ones the loader touches
+                if (dynamics->d_un.d_ptr > handle->size || handle->size - dynamics->d_un.d_ptr < 3 * sizeof(uint64_t)) {
+                    errmsg = "Broken shared library";
+                    return;
+                }
+                pltgot = elf64_writable(handle, dynamics->d_un.d_ptr);
                 break;
             case DT_HASH:
-                hash = (Elf64_Word*)((char*)header + dynamics->d_un.d_ptr);
+                hash = (Elf64_Word*)(handle->executable + dynamics->d_un.d_ptr);
                 break;
             case DT_STRTAB:
-                strtab = (char*)header + dynamics->d_un.d_ptr;
+                strtab = handle->executable + dynamics->d_un.d_ptr;
                 break;
             case DT_SYMTAB:
-                symtab = (char*)header + dynamics->d_un.d_ptr;
+                // Symbol values are rewritten as they are resolved
+                if (dynamics->d_un.d_ptr >= handle->size) {
+                    errmsg = "Broken shared library";
+                    return;
+                }
+                symtab = elf64_writable(handle, dynamics->d_un.d_ptr);
+                symtabOffset = dynamics->d_un.d_ptr;
                 break;
             case DT_STRSZ:
                 strsz = dynamics->d_un.d_val;
@@ -270,13 +1293,25 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
                 syment = dynamics->d_un.d_val;
                 break;
             case DT_INIT:
-                *initptr = (void(*)(void))(dynamics->d_un.d_ptr + handle->executable);
+                handle->init = (void(*)(void))(dynamics->d_un.d_ptr + handle->executable);
                 break;
             case DT_FINI:
                 handle->fini = (void(*)(void))(dynamics->d_un.d_ptr + handle->executable);
                 break;
+            case DT_INIT_ARRAY:
+                handle->initArray = (void(**)(void))(dynamics->d_un.d_ptr + handle->executable);
+                break;
+            case DT_FINI_ARRAY:
+                handle->finiArray = (void(**)(void))(dynamics->d_un.d_ptr + handle->executable);
+                break;
+            case DT_INIT_ARRAYSZ:
+                initArraySz = dynamics->d_un.d_val;
+                break;
+            case DT_FINI_ARRAYSZ:
+                finiArraySz = dynamics->d_un.d_val;
+                break;
             case DT_RELA:
-                rela = (char*)header + dynamics->d_un.d_ptr;
+                rela = handle->executable + dynamics->d_un.d_ptr;
                 break;
             case DT_RELASZ:
                 relasz = dynamics->d_un.d_val;
@@ -292,7 +1327,19 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
                 }
                 break;
             case DT_JMPREL:
-                jmpRel = ((char*)header + dynamics->d_un.d_ptr);
+                jmpRel = (handle->executable + dynamics->d_un.d_ptr);
+                break;
+            case DT_SONAME:
+                soname = dynamics->d_un.d_val;
+                hasSoname = true;
+                break;
+            case DT_RPATH:
+                rpath = dynamics->d_un.d_val;
+                hasRpath = true;
+                break;
+            case DT_RUNPATH:
+                runpath = dynamics->d_un.d_val;
+                hasRunpath = true;
                 break;
             case DT_TEXTREL:
                 break;
@@ -309,12 +1356,85 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
         return;
     }
 
-    char* dupstrtab = malloc((size_t)strsz);
-    memcpy(dupstrtab, strtab, (size_t)strsz);
-    handle->strtab = dupstrtab;
+    if (!handle->initArray != !initArraySz || !handle->finiArray != !finiArraySz) {
+        errmsg = "Broken shared library";
+        return;
+    }
+
+    // Every table has to lie within the image before it is read, and every
+    // string offset within the string table
+    if (!elf64_inImage(handle, hash, 2 * sizeof(Elf64_Word)) || hash[1] > INT32_MAX ||
+            !elf64_inImage(handle, strtab, strsz) || strtab[strsz - 1] ||
+            syment < sizeof(Elf64_Sym) || symtabOffset > handle->size ||
+            hash[1] > (handle->size - symtabOffset) / syment ||
+            (handle->init && !elf64_inImage(handle, (void*)handle->init, 1)) ||
+            (handle->fini && !elf64_inImage(handle, (void*)handle->fini, 1)) ||
+            (handle->initArray && !elf64_inImage(handle, handle->initArray, initArraySz)) ||
+            (handle->finiArray && !elf64_inImage(handle, handle->finiArray, finiArraySz)) ||
+            (hasSoname && soname >= strsz) || (hasRpath && rpath >= strsz) || (hasRunpath && runpath >= strsz) ||
+            (rela && (relaent != sizeof(Elf64_Rela) || !ELF64_validateRela(handle, rela, relasz))) ||
+            (jmpRel && !ELF64_validateRela(handle, jmpRel, pltrelsz))) {
+        errmsg = "Broken shared library";
+        return;
+    }
+    for (Elf64_Dyn* dynamics = dynamic; dynamics->d_tag != DT_NULL; dynamics++) {
+        if (dynamics->d_tag == DT_NEEDED && dynamics->d_un.d_val >= strsz) {
+            errmsg = "Broken shared library";
+            return;
+        }
+    }
+    for (uint64_t i = 0; i < hash[1]; i++) {
+        if (((Elf64_Sym*)(symtab + i * syment))->st_name >= strsz) {
+            errmsg = "Broken shared library";
+            return;
+        }
+    }
+    handle->initArrayLen = initArraySz / sizeof(Elf64_Addr);
+    handle->finiArrayLen = finiArraySz / sizeof(Elf64_Addr);
+
+    // Make the library reachable through its DT_SONAME as well. The first
+    // library to claim a soname keeps it.
+    if (hasSoname) {
+        handle->soname = strdup(strtab + soname);
+        if (!handle->soname) {
+            errmsg = "Memory allocation failure";
+            return;
+        }
+        if (!hashmap_get(getSonameMap(handle->ns), handle->soname)) {
+            hashmap_put(getSonameMap(handle->ns), handle->soname, handle);
+        }
+    }
+
+    if (hasRpath) {
+        handle->rpath = strtab + rpath;
+    }
+    if (hasRunpath) {
+        handle->runpath = strtab + runpath;
+    }
+
+    handle->strtab = strtab;
+    handle->symtab = symtab;
+    handle->syment = syment;
+    handle->symbolCount = hash[1];
+    elf64_markPatched(handle, symtabOffset, (uint64_t)hash[1] * syment);
+    handle->jmpRel = jmpRel;
 
-    // Load dependencies
-    if (neededLibs) {
+    // Load dependencies, or only record their names in lazy mode
+    if (neededLibs && handle->lazyLoad) {
+        handle->depDlLen = neededLibs;
+        handle->depDl = calloc(neededLibs, sizeof(dl_handle_t*));
+        handle->depNames = calloc(neededLibs, sizeof(const char*));
+        if (!handle->depDl || !handle->depNames) {
+            errmsg = "Memory allocation failure";
+            return;
+        }
+        int processedLibs = 0;
+        for (Elf64_Dyn* dynamics = dynamic; dynamics->d_tag != DT_NULL; dynamics++) {
+            if (dynamics->d_tag == DT_NEEDED) {
+                handle->depNames[processedLibs++] = strtab + dynamics->d_un.d_val;
+            }
+        }
+    } else if (neededLibs) {
         handle->depDlLen = neededLibs;
         handle->depDl = calloc(neededLibs, sizeof(dl_handle_t*));
         if (!handle->depDl) {
@@ -323,39 +1443,44 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
         }
         int processedLibs = 0;
 
-        for (Elf64_Dyn* dynamics = (Elf64_Dyn*)ELF64_PH_CONTENT(header, ELF64_PH_GET(header, dynamicSection));
-                dynamics->d_tag != DT_NULL; dynamics++) {
+        for (Elf64_Dyn* dynamics = dynamic; dynamics->d_tag != DT_NULL; dynamics++) {
             if (dynamics->d_tag == DT_NEEDED) {
-                char* name = dupstrtab + dynamics->d_un.d_val;
-                dl_handle_t* dephandle = ELF64_dlopen(name, RTLD_LAZY);
+                char* name = strtab + dynamics->d_un.d_val;
+                dl_handle_t* dephandle = elf64_dlopenFrom(handle->ns, handle, name, RTLD_LAZY);
                 if (!dephandle) {
                     errmsg = "Cannot load dependency";
                     return;
                 }
+                handle->depDl[processedLibs++] = dephandle;
                 if (!dephandle->resolved) {
                     errmsg = "Recursive dependency";
                     return;
                 }
-                handle->depDl[processedLibs++] = dephandle;
-                break;
             }
         }
     }
 
+    start = dlstats_phase(&handle->stats, DL_PHASE_DEPS, handle->name, start);
+
     // Resolve symbols
-    handle->map = hashmap_new_string(1);
-    if (!ELF64_resolveSymbols(handle, dupstrtab, symtab, hash[1], syment)) {
+    hashmap_counters_t before, after;
+    hashmap_counters(&before);
+    // One bucket per symbol, hash[1] being the symbol count
+    handle->map = hashmap_new_string(hash[1]);
+    handle->addrImage = dladdr_newImage(handle->executable, handle->size, handle->path, hash[1]);
+    bool resolved = ELF64_resolveSymbols(handle, strtab, symtab, hash[1], syment);
+    hashmap_counters(&after);
+    handle->stats.hashLookups += after.lookups - before.lookups;
+    handle->stats.hashProbes += after.probes - before.probes;
+    start = dlstats_phase(&handle->stats, DL_PHASE_RESOLVE, handle->name, start);
+    if (!resolved) {
         return;
     }
+    perfmap_flush();
 
-    if (rela) {
-        if (!relasz || !relaent) {
-            errmsg = "Broken shared library";
-            return;
-        }
-        if (!ELF64_relocateRela(handle, rela, relaent, relasz, symtab, syment)) {
-            return;
-        }
+    if (rela && (!relasz || !relaent)) {
+        errmsg = "Broken shared library";
+        return;
     }
 
     // Jump Relocation. This can actually be done lazily,
@@ -365,103 +1490,854 @@ static void elf64_dlopen_doit(dl_handle_t* handle, Elf64_Ehdr* header, void(**in
             errmsg = "Broken shared library";
             return;
         }
-        if (pltRel == DT_RELA) {
-            if (!ELF64_relocateRela(handle, jmpRel, sizeof(Elf64_Rela), pltrelsz, symtab, syment)) {
-                return;
-            }
-        } else {
+        if (pltRel != DT_RELA) {
             errmsg = "Unimplemented REL";
             return;
         }
     }
 
+    // PLT entries can only be bound lazily with a PLT and its GOT
+    handle->lazyPlt = handle->lazyLoad && pltgot && jmpRel;
+#ifdef ELF64_LAZY_BINDING
+    lazyHandles += handle->lazyPlt;
+#endif
+
+    // IFUNC resolvers run between the two passes
+    size_t deferred = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (rela && !ELF64_relocateRela(handle, rela, relaent, relasz, symtab, syment, pass, &deferred)) {
+            return;
+        }
+        if (jmpRel && !ELF64_relocateRela(handle, jmpRel, sizeof(Elf64_Rela), pltrelsz, symtab, syment, pass, &deferred)) {
+            return;
+        }
+        if (pass == 0 && handle->ifuncCount) {
+            ELF64_resolveIfuncs(handle, strtab, symtab, syment);
+            free(handle->ifuncs);
+            handle->ifuncs = NULL;
+            handle->ifuncCount = 0;
+        }
+        if (!deferred) {
+            break;
+        }
+    }
+
+#ifdef ELF64_LAZY_BINDING
+    // PLT0 pushes GOT[1] and jumps to GOT[2]
+    if (handle->lazyPlt) {
+        ((uint64_t*)pltgot)[1] = (uint64_t)handle;
+        ((uint64_t*)pltgot)[2] = (uint64_t)elf64_lazyTrampoline;
+    }
+#endif
+
+    if (elf64_cacheLimit() && !elf64_snapshot(handle)) {
+        errmsg = "Memory allocation failure";
+        return;
+    }
+
+    start = dlstats_phase(&handle->stats, DL_PHASE_RELOCATE, handle->name, start);
+
+    hashmap_info_t info;
+    hashmap_info(handle->map, &info);
+    handle->stats.hashMaxChain = info.maxChain;
+    handle->stats.memory += handle->snapshotSize + sizeof(dl_handle_t) + strlen(handle->name) + strlen(handle->path) + 2 +
+        handle->depDlLen * (handle->depNames ? 2 : 1) * sizeof(dl_handle_t*) + info.memory + dladdr_imageSize(handle->addrImage);
+    handle->stats.loads = 1;
+
     handle->resolved = true;
 }
 
-void* ELF64_dlopen(const char* name, int flags) {
-    // A shared library will only be attached once
-    dl_handle_t* handle = hashmap_get(getDlMap(), name);
-    if (handle) {
-        handle->refCount++;
-        return handle;
+static void elf64_runInit(void* node) {
+    dl_handle_t* handle = (dl_handle_t*)node;
+    handle->initStart = dlstats_mark();
+    if (handle->init) {
+        handle->init();
+    }
+    for (size_t i = 0; i < handle->initArrayLen; i++) {
+        // 0 and -1 are placeholders left by some toolchains
+        void(*init)(void) = handle->initArray[i];
+        if (init && init != (void(*)(void))-1) {
+            init();
+        }
     }
+}
 
-    Elf64_Ehdr* header = readFile(name);
-    if (!header) {
-        errmsg = "Cannot open the shared library";
+static void elf64_initDone(void* node) {
+    dl_handle_t* handle = (dl_handle_t*)node;
+    dl_mark_t end = dlstats_phase(&handle->stats, DL_PHASE_INIT, handle->name, handle->initStart);
+    totalStats.phaseNs[DL_PHASE_INIT] += end.ns - handle->initStart.ns;
+    handle->initState = INIT_DONE;
+}
+
+static void elf64_runFini(dl_handle_t* handle) {
+    for (size_t i = handle->finiArrayLen; i-- > 0; ) {
+        void(*fini)(void) = handle->finiArray[i];
+        if (fini && fini != (void(*)(void))-1) {
+            fini();
+        }
+    }
+    if (handle->fini) {
+        handle->fini();
+    }
+}
+
+/* Append the handles below handle that still need initializing, dependencies first */
+static bool elf64_collectInit(dl_handle_t* handle, dl_handle_t*** order, size_t* count, size_t* capacity) {
+    if (handle->initState != INIT_PENDING) {
+        return true;
+    }
+    handle->initState = INIT_QUEUED;
+    for (size_t i = 0; i < handle->depDlLen; i++) {
+        if (handle->depDl[i] && !elf64_collectInit(handle->depDl[i], order, count, capacity)) {
+            return false;
+        }
+    }
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 8;
+        dl_handle_t** list = realloc(*order, grown * sizeof(dl_handle_t*));
+        if (!list) {
+            return false;
+        }
+        *order = list;
+        *capacity = grown;
+    }
+    handle->initIndex = *count;
+    (*order)[(*count)++] = handle;
+    return true;
+}
+
+static void elf64_resetInit(dl_handle_t* handle) {
+    if (handle->initState == INIT_QUEUED) {
+        handle->initState = INIT_PENDING;
+        for (size_t i = 0; i < handle->depDlLen; i++) {
+            if (handle->depDl[i]) {
+                elf64_resetInit(handle->depDl[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Run the initializers of handle and of its dependencies that have not run
+ * yet, dependencies first. Libraries whose initializers are already running
+ * further up the stack, when an initializer opens a library, are skipped.
+ */
+static bool elf64_initialize(dl_handle_t* handle, bool parallel) {
+    dl_handle_t** order = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t* depStart = NULL;
+    size_t* deps = NULL;
+
+    bool ok = elf64_collectInit(handle, &order, &count, &capacity);
+    if (ok && count) {
+        size_t edges = 0;
+        for (size_t i = 0; i < count; i++) {
+            edges += order[i]->depDlLen;
+        }
+        depStart = malloc((count + 1) * sizeof(size_t));
+        deps = malloc((edges ? edges : 1) * sizeof(size_t));
+        ok = depStart && deps;
+    }
+    if (!ok) {
+        elf64_resetInit(handle);
+        free(order);
+        free(depStart);
+        free(deps);
+        errmsg = "Memory allocation failure";
+        return false;
+    }
+
+    if (count) {
+        // Only edges inside this graph matter, the rest is initialized already
+        size_t edges = 0;
+        for (size_t i = 0; i < count; i++) {
+            depStart[i] = edges;
+            for (size_t j = 0; j < order[i]->depDlLen; j++) {
+                dl_handle_t* dep = order[i]->depDl[j];
+                if (dep && dep->initState == INIT_QUEUED && dep->initIndex < i && order[dep->initIndex] == dep) {
+                    deps[edges++] = dep->initIndex;
+                }
+            }
+        }
+        depStart[count] = edges;
+#ifdef ELF64_LAZY_BINDING
+        // A worker binding a PLT entry would wait for the lock held here
+        parallel = parallel && !lazyHandles;
+#endif
+        dlinit_run((void**)order, count, depStart, deps, elf64_runInit, elf64_initDone, parallel);
+    }
+
+    free(order);
+    free(depStart);
+    free(deps);
+    return true;
+}
+
+/* Close the "dlopen" trace span of an image loaded by the current open */
+static void elf64_traceOpen(dl_handle_t* handle) {
+    if (handle->openStart) {
+        dltrace_span("dlopen", handle->name, handle->openStart, dlstats_now());
+        handle->openStart = 0;
+    }
+}
+
+/*
+ * Initialize the result of a top-level open, which fails if that fails. The
+ * trace span of a library loaded by the open includes its initializers.
+ */
+static void* elf64_initRoot(dl_handle_t* handle, int flags) {
+    if (!handle) {
+        return NULL;
+    }
+    bool initialized = elf64_initialize(handle, flags & RTLD_PARALLEL_INIT);
+    elf64_traceOpen(handle);
+    if (!initialized) {
+        elf64_dlclose(handle);
         return NULL;
     }
+    if (flags & RTLD_NODELETE) {
+        handle->nodelete = true;
+    }
+    return handle;
+}
+
+static bool elf64_shareable(dl_handle_t* handle, dl_handle_t* donor, size_t page) {
+    unsigned char flags = handle->pageFlags[page];
+    return flags && !(flags & (PF_W | PAGE_PATCHED)) && flags == donor->pageFlags[page] &&
+        memcmp(handle->executable + page * 4096, donor->executable + page * 4096, 4096) == 0;
+}
+
+/*
+ * Map the pages an image has in common with another load of the same file,
+ * typically from another namespace, over its own copies. Only read-only pages
+ * that neither image ever had written by the loader qualify, and they are
+ * compared anyway. Images whose PLT entries are patched take no part.
+ */
+static void elf64_share(dl_handle_t* handle) {
+    if (!handle->fileId.ino || handle->bypassPlt) {
+        return;
+    }
+    dl_handle_t* donor = hashmap_get(getSharedMap(), &handle->fileId);
+    if (!donor) {
+        hashmap_put(getSharedMap(), &handle->fileId, handle);
+        return;
+    }
+    if (donor->size != handle->size) {
+        return;
+    }
+    size_t pages = (handle->size + 4095) / 4096;
+    for (size_t first = 0, last; first < pages; first = last + 1) {
+        for (last = first; last < pages && handle->pageFlags[last] == handle->pageFlags[first] &&
+             elf64_shareable(handle, donor, last); last++);
+        if (last == first) {
+            continue;
+        }
+        if (share_exec(handle->executable, donor->executable, first * 4096, (last - first) * 4096)) {
+            handle->stats.bytesShared += (last - first) * 4096;
+            continue;
+        }
+        // The donor may itself map the run from several images
+        for (size_t page = first; page < last; page++) {
+            if (share_exec(handle->executable, donor->executable, page * 4096, 4096)) {
+                handle->stats.bytesShared += 4096;
+            }
+        }
+    }
+}
+
+/* Hand the pages of an image about to be freed over to another load of it */
+static void elf64_unshare(dl_handle_t* handle) {
+    if (!handle->fileId.ino || hashmap_get(getSharedMap(), &handle->fileId) != handle) {
+        return;
+    }
+    hashmap_remove(getSharedMap(), &handle->fileId);
+    dl_handle_t* other;
+    list_forEach(&loadedHandle, other, dl_handle_t, loadedList) {
+        if (other != handle && !other->bypassPlt && !fileIdComparator(&other->fileId, &handle->fileId)) {
+            hashmap_put(getSharedMap(), &other->fileId, other);
+            break;
+        }
+    }
+}
 
-    handle = calloc(sizeof(dl_handle_t), 1);
+static void* elf64_dlopen_image(dl_namespace_t* ns, const char* name, const char* path, const file_id_t* id, Elf64_Ehdr* header, size_t len, reader_t read, void* source, int flags, dl_mark_t start) {
+    dl_handle_t* handle = calloc(sizeof(dl_handle_t), 1);
     if (!handle) {
-        free(header);
         errmsg = "Memory allocation failure";
         return NULL;
     }
     handle->name = strdup(name);
-    if (!handle->name) {
-        free(header);
+    handle->path = strdup(path);
+    if (!handle->name || !handle->path) {
+        free(handle->name);
+        free(handle->path);
         free(handle);
         errmsg = "Memory allocation failure";
         return NULL;
     }
+    handle->ns = ns;
     handle->refCount = 1;
-    hashmap_put(getDlMap(), handle->name, handle);
+    handle->level = dlsearch_level(handle->path);
+#ifdef ELF64_LAZY_BINDING
+    handle->lazyLoad = (flags & RTLD_LAZYLOAD) != 0;
+    handle->bypassPlt = (flags & RTLD_BYPASS_PLT) != 0;
+#endif
+    hashmap_put(getDlMap(ns), handle->name, handle);
+    if (id && id->ino) {
+        handle->fileId = *id;
+        hashmap_put(getFileMap(ns), &handle->fileId, handle);
+    }
 
-    void(*init)(void) = NULL;
+    dlstats_phase(&handle->stats, DL_PHASE_READ, handle->name, start);
 
-    elf64_dlopen_doit(handle, header, &init);
-    free(header);
+    elf64_dlopen_doit(handle, header, len, read, source);
 
     if (!handle->resolved) {
-        ELF64_dlclose(handle);
+        elf64_dlclose(handle);
+        dltrace_span("dlopen", name, start.ns, dlstats_now());
         return NULL;
     }
+    elf64_share(handle);
+
+    // Published before initializers run, so that faults in them resolve
+    dladdr_insert(handle->addrImage);
+    list_add(&loadedHandle, &handle->loadedList);
+    loadedAdds++;
 
     if (flags & RTLD_GLOBAL) {
-        list_add(&globalHandle, &handle->globalList);
+        list_add(&ns->globalHandle, &handle->globalList);
+    }
+
+    dlstats_add(&totalStats, &handle->stats);
+    handle->openStart = start.ns;
+    return handle;
+}
+
+static void* elf64_dlopenFrom(dl_namespace_t* ns, dl_handle_t* parent, const char* name, int flags) {
+    // A shared library will only be attached once per namespace
+    dl_handle_t* handle = ELF64_findLoaded(ns, name);
+    if (handle && !(handle->cacheList.prev && (flags & RTLD_NOLOAD))) {
+        elf64_acquire(handle, flags);
+        return handle;
+    }
+    if (flags & RTLD_NOLOAD) {
+        errmsg = "Library not loaded";
+        return NULL;
+    }
+
+    dl_mark_t start = dlstats_mark();
+    char* path;
+    // Dependencies of a variant stay at its level
+    int level = parent && parent->level ? parent->level : cpu_level();
+    FILE* file = parent ?
+        dlsearch_open(name, parent->path, parent->rpath, parent->runpath, level, &path) :
+        dlsearch_open(name, NULL, NULL, NULL, level, &path);
+    if (!file) {
+        errmsg = "Cannot open the shared library";
+        return NULL;
+    }
+
+    // Different paths (relative, absolute, symlinks) may name a file that is
+    // already loaded
+    file_id_t id = {0, 0};
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0) {
+        id.dev = st.st_dev;
+        id.ino = st.st_ino;
+    }
+    if (id.ino) {
+        handle = hashmap_get(getFileMap(ns), &id);
+        if (handle) {
+            fclose(file);
+            free(path);
+            elf64_acquire(handle, flags);
+            return handle;
+        }
+    }
+
+    size_t len;
+    reader_t read;
+    void* source;
+    Elf64_Ehdr* header = ELF64_readHeaders(file, &len, &read, &source);
+    if (!header) {
+        fclose(file);
+        free(path);
+        errmsg = "Broken shared library";
+        return NULL;
+    }
+
+    handle = elf64_dlopen_image(ns, name, path, &id, header, len, read, source, flags, start);
+    // A dependency is traced up to its load, a root until it is initialized
+    if (handle && parent) {
+        elf64_traceOpen(handle);
+    }
+    free(header);
+    if (read == dlpack_read) {
+        dlpack_close(source);
     }
+    fclose(file);
+    free(path);
+    return handle;
+}
 
-    if (init)
-        init();
+void* ELF64_dlopen(const char* name, int flags) {
+    return ELF64_dlmopen(NULL, name, flags);
+}
 
+/* Recorded as a regular open, a replay loads everything in one namespace */
+void* ELF64_dlmopen(void* ns, const char* name, int flags) {
+    dl_namespace_t* space = ns ? ns : &baseNamespace;
+    elf64_lock();
+    bool record = dlrecord_enabled();
+    uint64_t start = record ? dlstats_now() : 0;
+    void* handle = elf64_initRoot(elf64_dlopenFrom(space, NULL, name, flags), flags);
+    if (record) {
+        dlrecord_open(name, flags, handle, start, dlstats_now());
+    }
+    elf64_unlock();
     return handle;
 }
 
-void ELF64_dlclose(void* handle) {
+static void* elf64_dlopenMem(const void* buf, size_t len, const char* name, int flags) {
+    dl_handle_t* handle = ELF64_findLoaded(&baseNamespace, name);
+    if (handle && !(handle->cacheList.prev && (flags & RTLD_NOLOAD))) {
+        elf64_acquire(handle, flags);
+    } else if (flags & RTLD_NOLOAD) {
+        errmsg = "Library not loaded";
+        return NULL;
+    } else {
+        handle = elf64_dlopen_image(&baseNamespace, name, name, NULL, (Elf64_Ehdr*)buf, len, readMemory, (void*)buf, flags, dlstats_mark());
+    }
+    return elf64_initRoot(handle, flags);
+}
+
+/* Recorded as a regular open, a replay looks the name up as a file */
+void* ELF64_dlopen_mem(const void* buf, size_t len, const char* name, int flags) {
+    elf64_lock();
+    bool record = dlrecord_enabled();
+    uint64_t start = record ? dlstats_now() : 0;
+    void* handle = elf64_dlopenMem(buf, len, name, flags);
+    if (record) {
+        dlrecord_open(name, flags, handle, start, dlstats_now());
+    }
+    elf64_unlock();
+    return handle;
+}
+
+static void elf64_destroy(dl_handle_t* thandle);
+
+/*
+ * Finalize a handle whose last reference went away and keep it in the cache,
+ * evicting the least recently closed handles beyond the limit. Its
+ * dependencies stay referenced until it is evicted.
+ */
+static bool elf64_park(dl_handle_t* handle) {
+    if (!handle->snapshot || !handle->resolved || handle->stats.memory > elf64_cacheLimit()) {
+        return false;
+    }
+
+    if (handle->initState == INIT_DONE) {
+        elf64_runFini(handle);
+    }
+    handle->initState = INIT_PENDING;
+    if (handle->globalList.prev) {
+        list_remove(&handle->globalList);
+        handle->globalList.prev = NULL;
+    }
+    list_remove(&handle->loadedList);
+    handle->loadedList.prev = NULL;
+    loadedSubs++;
+
+    list_addFirst(&cachedHandle, &handle->cacheList);
+    cacheBytes += handle->stats.memory;
+    while (cacheBytes > cacheLimit) {
+        dl_handle_t* victim = container_of(cachedHandle.prev, dl_handle_t, cacheList);
+        list_remove(&victim->cacheList);
+        victim->cacheList.prev = NULL;
+        cacheBytes -= victim->stats.memory;
+        elf64_destroy(victim);
+    }
+    return true;
+}
+
+static void elf64_dlclose(void* handle) {
     dl_handle_t* thandle = (dl_handle_t*)handle;
     if (--thandle->refCount) return;
 
-    if (thandle->resolved && thandle->fini)
-        thandle->fini();
+    // Kept loaded, and initialized, for the lifetime of the process
+    if (thandle->nodelete) return;
+
+    if (!elf64_park(thandle)) {
+        elf64_destroy(thandle);
+    }
+}
+
+static void elf64_destroy(dl_handle_t* thandle) {
+    if (thandle->initState == INIT_DONE)
+        elf64_runFini(thandle);
+#ifdef ELF64_LAZY_BINDING
+    lazyHandles -= thandle->lazyPlt;
+#endif
+
+    if (thandle->resolved) {
+        totalStats.memory -= thandle->stats.memory;
+    }
 
     // If it was in the global list, remove it from the list
     if (thandle->globalList.prev) {
         list_remove(&thandle->globalList);
     }
+    if (thandle->loadedList.prev) {
+        list_remove(&thandle->loadedList);
+        loadedSubs++;
+    }
 
-    hashmap_remove(getDlMap(), thandle->name);
+    // A reloaded image may have handed its names over to its replacement
+    dl_namespace_t* ns = thandle->ns;
+    if (hashmap_get(getDlMap(ns), thandle->name) == thandle) {
+        hashmap_remove(getDlMap(ns), thandle->name);
+    }
+    if (thandle->soname && hashmap_get(getSonameMap(ns), thandle->soname) == thandle) {
+        hashmap_remove(getSonameMap(ns), thandle->soname);
+    }
+    if (thandle->fileId.ino && hashmap_get(getFileMap(ns), &thandle->fileId) == thandle) {
+        hashmap_remove(getFileMap(ns), &thandle->fileId);
+    }
+    elf64_unshare(thandle);
+    elf64_forgetBindings(thandle);
 
     if (thandle->depDl) {
         for (size_t i = 0; i < thandle->depDlLen; i++) {
             if (thandle->depDl[i])
-                ELF64_dlclose(thandle->depDl[i]);
+                elf64_dlclose(thandle->depDl[i]);
         }
         free(thandle->depDl);
+        free(thandle->depNames);
     }
     if (thandle->map)
         hashmap_dispose(thandle->map);
-    if (thandle->executable)
+    dladdr_remove(thandle->addrImage);
+    if (thandle->executable) {
+        perfmap_remove(thandle->executable, thandle->size, thandle->name);
         free_exec(thandle->executable);
-    if (thandle->strtab)
-        free(thandle->strtab);
+    }
+    free(thandle->phdr);
+    free(thandle->ifuncs);
+    free(thandle->pageFlags);
+    free(thandle->soname);
+    free(thandle->snapshot);
     free(thandle->name);
+    free(thandle->path);
     free(thandle);
 }
 
+/* Free the images replaced by ELF64_dlreload whose grace period is over */
+static void elf64_reap(void) {
+    uint64_t now = dlstats_now();
+    while (retiredHandle.next != &retiredHandle) {
+        dl_handle_t* handle = container_of(retiredHandle.next, dl_handle_t, cacheList);
+        if (now - handle->retiredAt < DLRELOAD_GRACE_NS) {
+            break;
+        }
+        list_remove(&handle->cacheList);
+        handle->cacheList.prev = NULL;
+        elf64_destroy(handle);
+    }
+}
+
+void ELF64_dlclose(void* handle) {
+    elf64_lock();
+    elf64_reap();
+    bool record = dlrecord_enabled();
+    uint64_t start = record ? dlstats_now() : 0;
+    elf64_dlclose(handle);
+    if (record) {
+        dlrecord_close(handle, start, dlstats_now());
+    }
+    elf64_unlock();
+}
+
+/* Locate a slot of a parked handle in its snapshot, which acquire restores */
+static uint64_t* elf64_snapshotSlot(dl_handle_t* handle, uint64_t* slot) {
+    char* p = handle->snapshot;
+    uint64_t offset = (uint64_t)((char*)slot - handle->executable);
+    for (uint16_t i = 0; i < handle->phnum; i++) {
+        Elf64_Phdr* program = &handle->phdr[i];
+        if (program->p_type == PT_LOAD && (program->p_flags & PF_W)) {
+            if (offset - program->p_vaddr < program->p_memsz) {
+                return (uint64_t*)(p + (offset - program->p_vaddr));
+            }
+            p += program->p_memsz;
+        }
+    }
+    return NULL;
+}
+
+/* Take an image out of every lookup structure, so a reload does not find it */
+static void elf64_unpublish(dl_handle_t* handle, bool* ownsSoname) {
+    dl_namespace_t* ns = handle->ns;
+    hashmap_remove(getDlMap(ns), handle->name);
+    *ownsSoname = handle->soname && hashmap_get(getSonameMap(ns), handle->soname) == handle;
+    if (*ownsSoname) {
+        hashmap_remove(getSonameMap(ns), handle->soname);
+    }
+    if (handle->fileId.ino) {
+        hashmap_remove(getFileMap(ns), &handle->fileId);
+    }
+    list_remove(&handle->loadedList);
+    if (handle->globalList.prev) {
+        list_remove(&handle->globalList);
+    }
+}
+
+static void elf64_republish(dl_handle_t* handle, bool ownsSoname) {
+    dl_namespace_t* ns = handle->ns;
+    hashmap_put(getDlMap(ns), handle->name, handle);
+    if (ownsSoname) {
+        hashmap_put(getSonameMap(ns), handle->soname, handle);
+    }
+    if (handle->fileId.ino) {
+        hashmap_put(getFileMap(ns), &handle->fileId, handle);
+    }
+    list_add(&loadedHandle, &handle->loadedList);
+    if (handle->globalList.prev) {
+        list_add(&ns->globalHandle, &handle->globalList);
+    }
+}
+
+static void elf64_replaceDep(dl_handle_t* handle, dl_handle_t* old, dl_handle_t* replacement) {
+    for (size_t i = 0; i < handle->depDlLen; i++) {
+        if (handle->depDl[i] == old) {
+            handle->depDl[i] = replacement;
+        }
+    }
+}
+
+/* Point every slot bound to the old image at the same symbol in the new one */
+static void elf64_rebind(dl_handle_t* old, dl_handle_t* handle) {
+    for (size_t i = 0; i < old->bindingCount; i++) {
+        dl_binding_t* binding = &old->bindings[i];
+        dl_handle_t* importer = binding->importer;
+        const char* name = importer->strtab + binding->symbol->st_name;
+        uint64_t value = (uint64_t)hashmap_get(handle->map, name);
+
+        atomic_storeSlot(binding->slot, value);
+        if (binding->plt) {
+            elf64_patchPlt(importer, binding->plt, binding->slot, value);
+        }
+        if (importer->cacheList.prev) {
+            uint64_t* saved = elf64_snapshotSlot(importer, binding->slot);
+            if (saved) {
+                *saved = value;
+            }
+        }
+        // Undefined globals are exported again by the importer
+        if (hashmap_get(importer->map, name) == (void*)binding->symbol->st_value) {
+            hashmap_put(importer->map, name, (void*)value);
+        }
+        binding->symbol->st_value = value;
+
+        for (size_t j = 0; j < importer->providerCount; j++) {
+            if (importer->providers[j] == old) {
+                importer->providers[j] = handle;
+            }
+        }
+    }
+
+    // The new image takes over the old bindings, and the references held on
+    // the old image by its dependents
+    free(handle->bindings);
+    handle->bindings = old->bindings;
+    handle->bindingCount = old->bindingCount;
+    handle->bindingCapacity = old->bindingCapacity;
+    old->bindings = NULL;
+    old->bindingCount = 0;
+    old->bindingCapacity = 0;
+
+    dl_handle_t* other;
+    list_forEach(&loadedHandle, other, dl_handle_t, loadedList) {
+        elf64_replaceDep(other, old, handle);
+    }
+    list_forEach(&cachedHandle, other, dl_handle_t, cacheList) {
+        elf64_replaceDep(other, old, handle);
+    }
+    list_forEach(&retiredHandle, other, dl_handle_t, cacheList) {
+        elf64_replaceDep(other, old, handle);
+    }
+}
+
+static void* elf64_dlreload(dl_handle_t* old, const char* name) {
+    if (old->cacheList.prev) {
+        errmsg = "Library not loaded";
+        return NULL;
+    }
+
+    dl_mark_t start = dlstats_mark();
+    char* path;
+    FILE* file = dlsearch_open(name, NULL, NULL, NULL, cpu_level(), &path);
+    if (!file) {
+        errmsg = "Cannot open the shared library";
+        return NULL;
+    }
+    file_id_t id = {0, 0};
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0) {
+        id.dev = st.st_dev;
+        id.ino = st.st_ino;
+    }
+    if (id.ino && hashmap_get(getFileMap(old->ns), &id) && hashmap_get(getFileMap(old->ns), &id) != old) {
+        fclose(file);
+        free(path);
+        errmsg = "Library already loaded";
+        return NULL;
+    }
+    size_t len;
+    reader_t read;
+    void* source;
+    Elf64_Ehdr* header = ELF64_readHeaders(file, &len, &read, &source);
+    if (!header) {
+        fclose(file);
+        free(path);
+        errmsg = "Broken shared library";
+        return NULL;
+    }
+
+    bool ownsSoname;
+    bool global = old->globalList.prev != NULL;
+    elf64_unpublish(old, &ownsSoname);
+    dl_handle_t* handle = elf64_dlopen_image(old->ns, old->name, path, &id, header, len, read, source,
+                                             (global ? RTLD_GLOBAL : 0) | (old->lazyLoad ? RTLD_LAZYLOAD : 0) |
+                                             (old->bypassPlt ? RTLD_BYPASS_PLT : 0), start);
+    free(header);
+    if (read == dlpack_read) {
+        dlpack_close(source);
+    }
+    fclose(file);
+    free(path);
+
+    // Every image bound to the old one must find what it imported. This is
+    // checked before the initializers of the new image have run, so that a
+    // rejected image never runs code.
+    for (size_t i = 0; handle && i < old->bindingCount; i++) {
+        dl_binding_t* binding = &old->bindings[i];
+        if (!hashmap_get(handle->map, binding->importer->strtab + binding->symbol->st_name)) {
+            elf64_traceOpen(handle);
+            elf64_destroy(handle);
+            handle = NULL;
+            errmsg = "Unresolved symbol";
+        }
+    }
+    if (handle) {
+        bool initialized = elf64_initialize(handle, false);
+        elf64_traceOpen(handle);
+        if (!initialized) {
+            elf64_destroy(handle);
+            handle = NULL;
+        }
+    }
+    if (!handle) {
+        elf64_republish(old, ownsSoname);
+        return NULL;
+    }
+
+    elf64_rebind(old, handle);
+    handle->refCount = old->refCount;
+    handle->nodelete = old->nodelete;
+    old->refCount = 0;
+    old->globalList.prev = NULL;
+    old->loadedList.prev = NULL;
+    loadedSubs++;
+
+    old->retiredAt = dlstats_now();
+    list_add(&retiredHandle, &old->cacheList);
+    return handle;
+}
+
+void* ELF64_dlreload(void* handle, const char* path) {
+    elf64_lock();
+    elf64_reap();
+    void* result = elf64_dlreload((dl_handle_t*)handle, path);
+    elf64_unlock();
+    return result;
+}
+
 void* ELF64_dlsym(void* handle, const char* name) {
     dl_handle_t* thandle = (dl_handle_t*)handle;
-    return hashmap_get(thandle->map, name);
+    elf64_lock();
+    bool record = dlrecord_enabled();
+    uint64_t start = record ? dlstats_now() : 0;
+    void* symbol = hashmap_get(thandle->map, name);
+    if (record) {
+        dlrecord_sym(handle, name, symbol, start, dlstats_now());
+    }
+    elf64_unlock();
+    return symbol;
+}
+
+int ELF64_dlinfo(void* handle, int request, void* arg) {
+    dl_handle_t* thandle = (dl_handle_t*)handle;
+    switch (request) {
+        case RTLD_DI_STATS:
+            *(dl_stats_t*)arg = thandle->stats;
+            return 0;
+        case RTLD_DI_LEVEL:
+            *(int*)arg = thandle->level;
+            return 0;
+        default:
+            errmsg = "Unsupported dlinfo request";
+            return -1;
+    }
+}
+
+void ELF64_dlcache(size_t bytes) {
+    elf64_lock();
+    cacheLimit = bytes;
+    cacheConfigured = true;
+    while (cacheBytes > cacheLimit) {
+        dl_handle_t* victim = container_of(cachedHandle.prev, dl_handle_t, cacheList);
+        list_remove(&victim->cacheList);
+        victim->cacheList.prev = NULL;
+        cacheBytes -= victim->stats.memory;
+        elf64_destroy(victim);
+    }
+    elf64_unlock();
+}
+
+void ELF64_dlstats(dl_stats_t* stats) {
+    *stats = totalStats;
+}
+
+int ELF64_dlprofile(dlprofile_callback_t callback, void* data) {
+    return dlprofile_walk(callback, data);
+}
+
+int ELF64_dladdr(const void* addr, dl_info_t* info) {
+    return dladdr_lookup(addr, info);
+}
+
+int ELF64_iterate_phdr(elf64_phdr_callback_t callback, void* data) {
+    elf64_lock();
+    elf64_phdr_info_t info;
+    info.dlpi_adds = loadedAdds;
+    info.dlpi_subs = loadedSubs;
+    info.dlpi_tls_modid = 0;
+    info.dlpi_tls_data = NULL;
+
+    dl_handle_t* handle;
+    list_forEach(&loadedHandle, handle, dl_handle_t, loadedList) {
+        info.dlpi_addr = (uintptr_t)handle->executable;
+        info.dlpi_name = handle->path;
+        info.dlpi_phdr = handle->phdr;
+        info.dlpi_phnum = handle->phnum;
+        int ret = callback(&info, sizeof(info), data);
+        if (ret) {
+            elf64_unlock();
+            return ret;
+        }
+    }
+    elf64_unlock();
+    return 0;
 }
 
 char* ELF64_dlerror(void) {
@@ -471,5 +2347,82 @@ char* ELF64_dlerror(void) {
 }
 
 void ELF64_addGlobalSymbol(const char* name, void* symbol) {
-    hashmap_put(getGlobalMap(true), name, symbol);
+    elf64_lock();
+    if (dlrecord_enabled()) {
+        dlrecord_global(name, dlstats_now());
+    }
+    hashmap_put(getGlobalMap(&baseNamespace, true), name, symbol);
+    elf64_unlock();
+}
+
+void* ELF64_dlnamespace(void) {
+    dl_namespace_t* ns = calloc(sizeof(dl_namespace_t), 1);
+    if (!ns) {
+        errmsg = "Memory allocation failure";
+        return NULL;
+    }
+    ns->globalHandle.prev = ns->globalHandle.next = &ns->globalHandle;
+    return ns;
+}
+
+void ELF64_addNamespaceSymbol(void* ns, const char* name, void* symbol) {
+    elf64_lock();
+    hashmap_put(getGlobalMap(ns ? ns : &baseNamespace, true), name, symbol);
+    elf64_unlock();
+}
+
+static int elf64_dlnamespaceClose(void* ns) {
+    dl_namespace_t* space = ns;
+    if (!space || space == &baseNamespace) {
+        errmsg = "Invalid namespace";
+        return -1;
+    }
+    // Closed handles of the namespace are dropped from the cache. Freeing
+    // one may cache its dependencies, so look again from the start.
+    for (;;) {
+        dl_handle_t* victim = NULL;
+        dl_handle_t* handle;
+        list_forEach(&cachedHandle, handle, dl_handle_t, cacheList) {
+            if (handle->ns == space) {
+                victim = handle;
+                break;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+        list_remove(&victim->cacheList);
+        victim->cacheList.prev = NULL;
+        cacheBytes -= victim->stats.memory;
+        elf64_destroy(victim);
+    }
+    elf64_reap();
+    dl_handle_t* handle;
+    list_forEach(&loadedHandle, handle, dl_handle_t, loadedList) {
+        if (handle->ns == space) {
+            errmsg = "Namespace in use";
+            return -1;
+        }
+    }
+    list_forEach(&retiredHandle, handle, dl_handle_t, cacheList) {
+        if (handle->ns == space) {
+            errmsg = "Namespace in use";
+            return -1;
+        }
+    }
+    hashmap_t* maps[] = { space->dlMap, space->fileMap, space->sonameMap, space->globalMap };
+    for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+        if (maps[i]) {
+            hashmap_dispose(maps[i]);
+        }
+    }
+    free(space);
+    return 0;
+}
+
+int ELF64_dlnamespace_close(void* ns) {
+    elf64_lock();
+    int result = elf64_dlnamespaceClose(ns);
+    elf64_unlock();
+    return result;
 }
@@ -3,8 +3,29 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include <util/cpu.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HASHMAP_CRC32
+#include <nmmintrin.h>
+#endif
+
+#ifdef DL_PERF_COUNTERS
+#include <util/perfcount.h>
+
+/*
+ * Instrumentation builds attribute hardware counters to the lookup functions.
+ * The plain implementations are compiled under an _uncounted name and wrapped
+ * at the end of this file.
+ */
+#define hashmap_put hashmap_put_uncounted
+#define hashmap_get hashmap_get_uncounted
+#define hashmap_remove hashmap_remove_uncounted
+#endif
+
 typedef struct node_t {
     int hash;
+    size_t len;
     const void *key;
     void *data;
     struct node_t *next;
@@ -13,6 +34,7 @@ typedef struct node_t {
 struct hashmap_t {
     comparator_t compare;
     hash_t hash;
+    bool string;
     int size;
     node_t *node[0];
 };
@@ -24,6 +46,15 @@ typedef struct {
     node_t *next;
 } iterator_t;
 
+// Per thread, so that counting costs no shared cache line
+#ifdef _MSC_VER
+#define HASHMAP_THREAD __declspec(thread)
+#else
+#define HASHMAP_THREAD _Thread_local
+#endif
+
+static HASHMAP_THREAD hashmap_counters_t counters;
+
 int string_comparator(const void *a, const void *b) {
     return strcmp(a, b);
 }
@@ -37,14 +68,90 @@ int string_hash(const void *key) {
     return h;
 }
 
+/*
+ * Keys of string maps are hashed together with their length, eight (or with
+ * SSE4.2, CRC32 over eight) bytes at a time. The stored length lets a compare
+ * bail out before touching the key, and equal lengths allow memcmp.
+ */
+static unsigned string_hash_word(const char *key, size_t len) {
+    uint64_t h = len * 0x9E3779B97F4A7C15ull;
+    uint64_t w;
+    for (; len >= 8; len -= 8, key += 8) {
+        memcpy(&w, key, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, key, len);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 29;
+    return (unsigned)(h ^ h >> 32);
+}
+
+#ifdef HASHMAP_CRC32
+#ifdef __GNUC__
+__attribute__((target("sse4.2")))
+#endif
+static unsigned string_hash_crc32(const char *key, size_t len) {
+    uint32_t h = (uint32_t)len;
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t w;
+    for (; len >= 8; len -= 8, key += 8) {
+        memcpy(&w, key, 8);
+        h = (uint32_t)_mm_crc32_u64(h, w);
+    }
+#endif
+    uint32_t v;
+    for (; len >= 4; len -= 4, key += 4) {
+        memcpy(&v, key, 4);
+        h = _mm_crc32_u32(h, v);
+    }
+    for (; len; len--, key++) {
+        h = _mm_crc32_u8(h, (unsigned char)*key);
+    }
+    // CRC bits are well mixed, but a final multiply spreads them for %
+    return h * 0x9E3779B1u ^ h >> 16;
+}
+#endif
+
+static unsigned (*stringHash)(const char *, size_t) = NULL;
+
+static void string_hash_select(void) {
+    if (!stringHash) {
+        stringHash = string_hash_word;
+#ifdef HASHMAP_CRC32
+        if (cpu_has(CPU_SSE42)) {
+            stringHash = string_hash_crc32;
+        }
+#endif
+    }
+}
+
+unsigned string_hash_len(const char *key, size_t len) {
+    string_hash_select();
+    return stringHash(key, len);
+}
+
 hashmap_t *hashmap_new_string(int size) {
-    return hashmap_new(string_hash, string_comparator, size);
+    hashmap_t *hm = hashmap_new(string_hash, string_comparator, size);
+    if (hm) {
+        string_hash_select();
+        hm->string = true;
+    }
+    return hm;
 }
 
 hashmap_t *hashmap_new(hash_t h, comparator_t c, int size) {
+    if (size < 1) {
+        size = 1;
+    }
     hashmap_t *hm = malloc(sizeof(hashmap_t) + sizeof(node_t *)*size);
+    if (!hm) {
+        return NULL;
+    }
     hm->compare = c;
     hm->hash = h;
+    hm->string = false;
     hm->size = size;
     int i;
     for (i = 0; i < size; i++) {
@@ -53,13 +160,32 @@ hashmap_t *hashmap_new(hash_t h, comparator_t c, int size) {
     return hm;
 }
 
+static int hashmap_hash(hashmap_t *hm, const void *key, size_t *len) {
+    if (hm->string) {
+        *len = strlen(key);
+        return (int)stringHash(key, *len);
+    }
+    *len = 0;
+    return hm->hash(key);
+}
+
+static bool hashmap_equals(hashmap_t *hm, const node_t *c, const void *key, int hash, size_t len) {
+    if (c->hash != hash || c->len != len) {
+        return false;
+    }
+    return hm->string ? memcmp(c->key, key, len) == 0 : hm->compare(c->key, key) == 0;
+}
+
 void *hashmap_put(hashmap_t *hm, const void *key, void *data) {
-    int hash = hm->hash(key);
+    size_t len;
+    int hash = hashmap_hash(hm, key, &len);
     int bucket = (unsigned int)(hash) % hm->size;
     node_t **n = &hm->node[bucket];
+    counters.lookups++;
     while (*n != NULL) {
         node_t *c = *n;
-        if (c->hash == hash && hm->compare(c->key, key) == 0) {
+        counters.probes++;
+        if (hashmap_equals(hm, c, key, hash, len)) {
             void *backup = c->data;
             c->data = data;
             return backup;
@@ -69,6 +195,7 @@ void *hashmap_put(hashmap_t *hm, const void *key, void *data) {
     *n = malloc(sizeof(node_t));
     node_t *mn = *n;
     mn->hash = hash;
+    mn->len = len;
     mn->key = key;
     mn->data = data;
     mn->next = NULL;
@@ -76,12 +203,15 @@ void *hashmap_put(hashmap_t *hm, const void *key, void *data) {
 }
 
 void *hashmap_get(hashmap_t *hm, const void *key) {
-    int hash = hm->hash(key);
+    size_t len;
+    int hash = hashmap_hash(hm, key, &len);
     int bucket = (unsigned int)(hash) % hm->size;
     node_t **n = &hm->node[bucket];
+    counters.lookups++;
     while (*n != NULL) {
         node_t *c = *n;
-        if (c->hash == hash && hm->compare(c->key, key) == 0) {
+        counters.probes++;
+        if (hashmap_equals(hm, c, key, hash, len)) {
             return c->data;
         }
         n = &c->next;
@@ -90,12 +220,15 @@ void *hashmap_get(hashmap_t *hm, const void *key) {
 }
 
 void *hashmap_remove(hashmap_t *hm, const void *key) {
-    int hash = hm->hash(key);
+    size_t len;
+    int hash = hashmap_hash(hm, key, &len);
     int bucket = (unsigned int)(hash) % hm->size;
     node_t **n = &hm->node[bucket];
+    counters.lookups++;
     while (*n != NULL) {
         node_t *c = *n;
-        if (c->hash == hash && hm->compare(c->key, key) == 0) {
+        counters.probes++;
+        if (hashmap_equals(hm, c, key, hash, len)) {
             *n = c->next;
             void *data = c->data;
             free(c);
@@ -150,3 +283,68 @@ pair_t *hashmap_next(pair_t *it) {
         return NULL;
     }
 }
+
+void hashmap_counters(hashmap_counters_t *c) {
+    *c = counters;
+}
+
+void hashmap_info(hashmap_t *hm, hashmap_info_t *info) {
+    info->buckets = hm->size;
+    info->entries = 0;
+    info->maxChain = 0;
+    int i;
+    for (i = 0; i < hm->size; i++) {
+        int chain = 0;
+        node_t *mn;
+        for (mn = hm->node[i]; mn != NULL; mn = mn->next) {
+            chain++;
+        }
+        info->entries += chain;
+        if (chain > info->maxChain) {
+            info->maxChain = chain;
+        }
+    }
+    info->memory = sizeof(hashmap_t) + sizeof(node_t *) * hm->size + sizeof(node_t) * info->entries;
+}
+
+#ifdef DL_PERF_COUNTERS
+#undef hashmap_put
+#undef hashmap_get
+#undef hashmap_remove
+
+void *hashmap_put(hashmap_t *hm, const void *key, void *data) {
+    static int bucket = -2;
+    if (bucket == -2) {
+        bucket = perfcount_bucket("hashmap_put");
+    }
+    uint64_t start[PERFCOUNT_EVENTS];
+    perfcount_read(start);
+    void *ret = hashmap_put_uncounted(hm, key, data);
+    perfcount_account(bucket, start);
+    return ret;
+}
+
+void *hashmap_get(hashmap_t *hm, const void *key) {
+    static int bucket = -2;
+    if (bucket == -2) {
+        bucket = perfcount_bucket("hashmap_get");
+    }
+    uint64_t start[PERFCOUNT_EVENTS];
+    perfcount_read(start);
+    void *ret = hashmap_get_uncounted(hm, key);
+    perfcount_account(bucket, start);
+    return ret;
+}
+
+void *hashmap_remove(hashmap_t *hm, const void *key) {
+    static int bucket = -2;
+    if (bucket == -2) {
+        bucket = perfcount_bucket("hashmap_remove");
+    }
+    uint64_t start[PERFCOUNT_EVENTS];
+    perfcount_read(start);
+    void *ret = hashmap_remove_uncounted(hm, key);
+    perfcount_account(bucket, start);
+    return ret;
+}
+#endif
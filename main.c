@@ -1,7 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <elf/elf32_dl.h>
-#include <direct.h>
+#include <elf/dlsearch.h>
 
 #include <math.h>
 #include <Windows.h>
@@ -15,7 +15,7 @@ void munmap(void* ptr, int size) {
 }
 
 int main(void) {
-    _chdir("test");
+    dlsearch_addPath("test");
     const char* filename = "libmain.so";
 
     ELF32_addGlobalSymbol("puts", puts);
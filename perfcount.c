@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <util/perfcount.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#define PERFCOUNT_THREAD __declspec(thread)
+#else
+#define PERFCOUNT_THREAD _Thread_local
+#endif
+
+typedef struct {
+    const char* name;
+    uint64_t calls;
+    uint64_t values[PERFCOUNT_EVENTS];
+} bucket_t;
+
+static const char* const eventNames[PERFCOUNT_EVENTS] = {
+    "cycles", "instructions", "llc-misses", "dtlb-misses", "branch-misses"
+};
+
+static bucket_t buckets[PERFCOUNT_BUCKETS];
+static int bucketCount = 0;
+
+/*
+ * perf events count the thread that opened them, so each thread opens its own
+ * group on first use and closes it when it exits. A delta is only meaningful
+ * between two reads on the same thread.
+ */
+typedef struct {
+    // -1 until the first read, then 1 if counting and 0 if unavailable
+    int state;
+    int fds[PERFCOUNT_EVENTS];
+    // Position of each event in a group read, or -1 if it could not be opened
+    int slots[PERFCOUNT_EVENTS];
+    int members;
+} perfcount_group_t;
+
+static PERFCOUNT_THREAD perfcount_group_t group = { .state = -1 };
+
+#ifdef __linux__
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t groupKey;
+
+static int perfcount_open(uint32_t type, uint64_t config, int leader) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/* Close the group of an exiting thread, members before the leader */
+static void perfcount_close(void* data) {
+    perfcount_group_t* closed = data;
+    for (int i = PERFCOUNT_EVENTS; i-- > 0; ) {
+        if (closed->fds[i] >= 0) {
+            close(closed->fds[i]);
+            closed->fds[i] = -1;
+        }
+    }
+    closed->state = 0;
+}
+#endif
+
+static void perfcount_exit(void) {
+    if (bucketCount) {
+        perfcount_report(stderr);
+    }
+}
+
+#ifdef __linux__
+static void perfcount_once(void) {
+    atexit(perfcount_exit);
+    pthread_key_create(&groupKey, perfcount_close);
+}
+#endif
+
+static void perfcount_init(void) {
+    group.state = 0;
+    group.members = 0;
+    for (int i = 0; i < PERFCOUNT_EVENTS; i++) {
+        group.fds[i] = -1;
+        group.slots[i] = -1;
+    }
+#ifdef __linux__
+    pthread_once(&once, perfcount_once);
+    static const uint32_t types[PERFCOUNT_EVENTS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+    };
+    static const uint64_t configs[PERFCOUNT_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    // Cycles lead the group. Other events are optional, as not every CPU or
+    // hypervisor exposes all of them.
+    for (int i = 0; i < PERFCOUNT_EVENTS; i++) {
+        int fd = perfcount_open(types[i], configs[i], group.fds[0]);
+        if (fd < 0) {
+            if (i == 0) {
+                return;
+            }
+            continue;
+        }
+        group.fds[i] = fd;
+        group.slots[i] = group.members++;
+    }
+    pthread_setspecific(groupKey, &group);
+    if (ioctl(group.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+        return;
+    }
+    group.state = 1;
+#else
+    static bool registered = false;
+    if (!registered) {
+        atexit(perfcount_exit);
+        registered = true;
+    }
+#endif
+}
+
+bool perfcount_available(void) {
+    if (group.state == -1) {
+        perfcount_init();
+    }
+    return group.state == 1;
+}
+
+void perfcount_read(uint64_t values[PERFCOUNT_EVENTS]) {
+    memset(values, 0, sizeof(uint64_t) * PERFCOUNT_EVENTS);
+    if (!perfcount_available()) {
+        return;
+    }
+#ifdef __linux__
+    uint64_t data[1 + PERFCOUNT_EVENTS];
+    if (read(group.fds[0], data, sizeof(uint64_t) * (1 + group.members)) <= 0) {
+        return;
+    }
+    for (int i = 0; i < PERFCOUNT_EVENTS; i++) {
+        if (group.slots[i] >= 0) {
+            values[i] = data[1 + group.slots[i]];
+        }
+    }
+#endif
+}
+
+int perfcount_bucket(const char* name) {
+    for (int i = 0; i < bucketCount; i++) {
+        if (strcmp(buckets[i].name, name) == 0) {
+            return i;
+        }
+    }
+    if (bucketCount == PERFCOUNT_BUCKETS) {
+        return -1;
+    }
+    buckets[bucketCount].name = name;
+    return bucketCount++;
+}
+
+void perfcount_account(int bucket, const uint64_t start[PERFCOUNT_EVENTS]) {
+    uint64_t now[PERFCOUNT_EVENTS];
+    perfcount_read(now);
+    if (bucket < 0) {
+        return;
+    }
+    buckets[bucket].calls++;
+    for (int i = 0; i < PERFCOUNT_EVENTS; i++) {
+        buckets[bucket].values[i] += now[i] - start[i];
+    }
+}
+
+uint64_t perfcount_get(int bucket, uint64_t values[PERFCOUNT_EVENTS]) {
+    memcpy(values, buckets[bucket].values, sizeof(uint64_t) * PERFCOUNT_EVENTS);
+    return buckets[bucket].calls;
+}
+
+void perfcount_report(FILE* file) {
+    if (!perfcount_available()) {
+        fprintf(file, "perfcount: hardware counters unavailable\n");
+        return;
+    }
+    fprintf(file, "%-20s %12s", "bucket", "calls");
+    for (int i = 0; i < PERFCOUNT_EVENTS; i++) {
+        fprintf(file, " %14s", group.slots[i] >= 0 ? eventNames[i] : "-");
+    }
+    fputc('\n', file);
+    for (int b = 0; b < bucketCount; b++) {
+        fprintf(file, "%-20s %12llu", buckets[b].name, (unsigned long long)buckets[b].calls);
+        for (int i = 0; i < PERFCOUNT_EVENTS; i++) {
+            fprintf(file, " %14llu", (unsigned long long)buckets[b].values[i]);
+        }
+        fputc('\n', file);
+    }
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <elf/perfmap.h>
+
+#ifdef _MSC_VER
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+static int state = -1;
+static FILE* map = NULL;
+
+bool perfmap_enable(void) {
+    if (!map) {
+        char name[64];
+        snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+        map = fopen(name, "a");
+        if (!map) {
+            return false;
+        }
+    }
+    state = 1;
+    return true;
+}
+
+bool perfmap_enabled(void) {
+    if (state == -1) {
+        const char* value = getenv(PERFMAP_ENV);
+        state = 0;
+        if (value && *value) {
+            perfmap_enable();
+        }
+    }
+    return state == 1;
+}
+
+void perfmap_add(const void* start, size_t size, const char* name, const char* lib) {
+    if (perfmap_enabled()) {
+        fprintf(map, "%llx %llx %s [%s]\n", (unsigned long long)(size_t)start, (unsigned long long)size, name, lib);
+    }
+}
+
+/*
+ * The format is append-only, so an unloaded image is marked by a single entry
+ * covering the whole range. Code loaded there later is appended after it.
+ */
+void perfmap_remove(const void* start, size_t size, const char* lib) {
+    if (perfmap_enabled()) {
+        fprintf(map, "%llx %llx [unloaded %s]\n", (unsigned long long)(size_t)start, (unsigned long long)size, lib);
+        fflush(map);
+    }
+}
+
+void perfmap_flush(void) {
+    if (map) {
+        fflush(map);
+    }
+}
@@ -1,51 +1,240 @@
-#include <stdio.h>
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _MSC_VER
 #include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include <elf/elf-common.h>
+
+/*
+ * Images are backed by an anonymous shared memory object mapped twice: the
+ * execution view returned by alloc_exec and a writable alias of it. The
+ * execution view is never made writable where it holds code or read-only
+ * data, so code is patched through the alias without changing protections.
+ * Where memory objects are unavailable both views are the same read, write
+ * and execute mapping.
+ *
+ * The page before the execution view holds the header, written through the
+ * alias.
+ */
+typedef struct {
+    size_t size;
+    char* alias;
+    // Kept until protect_exec remaps the writable pages, -1 afterwards
+    int fd;
+} exec_header_t;
+
+#define EXEC_PAGE 4096
+
+static exec_header_t* exec_header(void* ptr) {
+    return (exec_header_t*)((char*)ptr - EXEC_PAGE);
+}
 
-void* readFile(const char* name) {
-    FILE* file = fopen(name, "rb");
-    if (file == NULL) {
+/*
+ * Reserve an image. The memory is backed by demand-zero pages on both
+ * platforms, so pages are only committed when first touched and the loader
+ * can rely on the region being zero-filled (i.e. it never needs to clear bss).
+ * The returned execution view is only readable and executable until
+ * protect_exec, writes go through exec_alias.
+ */
+void* alloc_exec(size_t size) {
+    size_t total = size + EXEC_PAGE;
+#ifdef _MSC_VER
+    HANDLE section = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_EXECUTE_READWRITE | SEC_COMMIT,
+                                       (DWORD)((uint64_t)total >> 32), (DWORD)total, NULL);
+    if (!section) {
         return NULL;
     }
-    if (fseek(file, 0, SEEK_END) == -1) {
+    char* ptr = MapViewOfFile(section, FILE_MAP_ALL_ACCESS | FILE_MAP_EXECUTE, 0, 0, total);
+    char* alias = ptr ? MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, total) : NULL;
+    // The views keep the section alive
+    CloseHandle(section);
+    if (!alias) {
+        if (ptr) {
+            UnmapViewOfFile(ptr);
+        }
         return NULL;
     }
-    long length = ftell(file);
-    if (length == -1) {
-        return NULL;
+    DWORD old;
+    VirtualProtect(ptr, total, PAGE_EXECUTE_READ, &old);
+    int fd = -1;
+#else
+    char* ptr = MAP_FAILED;
+    char* alias = MAP_FAILED;
+    int fd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+    fd = (int)syscall(SYS_memfd_create, "elf-image", 1 /* MFD_CLOEXEC */);
+    if (fd >= 0 && ftruncate(fd, (off_t)total) == 0) {
+        ptr = mmap(NULL, total, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        alias = ptr == MAP_FAILED ? MAP_FAILED : mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     }
-    rewind(file);
-    char* filecontents = malloc(length + 1);
-    if (!filecontents) {
-        return NULL;
+    if (alias == MAP_FAILED) {
+        if (ptr != MAP_FAILED) {
+            munmap(ptr, total);
+        }
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
     }
-    if (!fread(filecontents, length, 1, file)) {
-        free(filecontents);
-        return NULL;
+#endif
+    if (fd < 0) {
+        ptr = alias = mmap(NULL, total, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return NULL;
+        }
     }
-    if (fclose(file) == -1) {
-        free(filecontents);
-        return NULL;
+#endif
+    exec_header_t* header = (exec_header_t*)alias;
+    header->size = size;
+    header->alias = alias + EXEC_PAGE;
+    header->fd = fd;
+    return ptr + EXEC_PAGE;
+}
+
+/* Writable view of an image, the image itself without a separate alias */
+void* exec_alias(void* ptr) {
+    return exec_header(ptr)->alias;
+}
+
+#ifndef _MSC_VER
+/*
+ * Move a range of the execution view to anonymous memory with the same
+ * contents and release the range of the memory object, so that the pages are
+ * not held twice. Only the extents of the object that hold data are copied,
+ * pages never written such as bss stay demand-zero. Where the object cannot
+ * tell its holes, the whole range is copied.
+ */
+static bool exec_private(exec_header_t* header, char* image, size_t offset, size_t len, int prot) {
+    if (mmap(image + offset, len, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        return false;
+    }
+    off_t pos = (off_t)(offset + EXEC_PAGE);
+    off_t end = pos + (off_t)len;
+    while (pos < end) {
+        off_t data = pos;
+        off_t hole = end;
+#ifdef SEEK_DATA
+        data = lseek(header->fd, pos, SEEK_DATA);
+        if (data < 0) {
+            data = errno == ENXIO ? end : pos;
+        } else if (data < end) {
+            hole = lseek(header->fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > end) {
+                hole = end;
+            }
+        }
+#endif
+        if (data >= end) {
+            break;
+        }
+        memcpy(image + (data - EXEC_PAGE), header->alias + (data - EXEC_PAGE), (size_t)(hole - data));
+        pos = hole;
     }
-    filecontents[length] = 0;
-    return filecontents;
+#ifdef MADV_REMOVE
+    madvise(header->alias + offset, len, MADV_REMOVE);
+#endif
+    return true;
 }
+#endif
 
-void* alloc_exec(size_t size) {
+/*
+ * Give each page of the execution view the protection of the segments
+ * covering it, flags holding their PF_* bits page by page. Writable pages are
+ * moved to private anonymous memory, so that they are copied on fork like any
+ * other data, and must from now on be written through the execution view:
+ * the alias reads them as zeros. Called once, before the image runs.
+ */
+bool protect_exec(void* ptr, const unsigned char* flags) {
+    exec_header_t* header = exec_header(ptr);
+    char* image = ptr;
+    size_t pages = (header->size + EXEC_PAGE - 1) / EXEC_PAGE;
+    if (header->alias == image) {
+        return true;
+    }
+    bool ok = true;
+    for (size_t first = 0, last; first < pages; first = last) {
+        last = first + 1;
+        while (last < pages && flags[last] == flags[first]) {
+            last++;
+        }
+        size_t offset = first * EXEC_PAGE;
+        size_t len = (last - first) * EXEC_PAGE;
 #ifdef _MSC_VER
-    char* ptr = VirtualAlloc(NULL, size + 4096, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-    *(size_t*)ptr = size;
-    return ptr + 4096;
+        DWORD protect = flags[first] & PF_W ?
+            (flags[first] & PF_X ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE) :
+            (flags[first] & PF_X ? PAGE_EXECUTE_READ : PAGE_READONLY);
+        DWORD old;
+        ok = ok && VirtualProtect(image + offset, len, protect, &old);
+#else
+        int prot = PROT_READ | (flags[first] & PF_W ? PROT_WRITE : 0) | (flags[first] & PF_X ? PROT_EXEC : 0);
+        if (flags[first] & PF_W) {
+            ok = ok && exec_private(header, image, offset, len, prot);
+        } else if (!(flags[first] & PF_X)) {
+            ok = ok && mprotect(image + offset, len, prot) == 0;
+        }
+#endif
+    }
+#ifndef _MSC_VER
+    close(header->fd);
+    ((exec_header_t*)(header->alias - EXEC_PAGE))->fd = -1;
+#endif
+    return ok;
+}
+
+/*
+ * Map pages of the execution view of src over the same range of dst, so that
+ * both images use one copy of them, and release the copy dst had. The pages
+ * must be identical, read-only in both images and never written again.
+ */
+bool share_exec(void* dst, const void* src, size_t offset, size_t len) {
+#if defined(__linux__) && defined(MREMAP_FIXED)
+    exec_header_t* header = exec_header(dst);
+    if (header->alias == (char*)dst || exec_header((void*)src)->alias == (char*)src) {
+        return false;
+    }
+    // With a zero old size, mremap duplicates a shared mapping
+    if (mremap((char*)src + offset, 0, len, MREMAP_MAYMOVE | MREMAP_FIXED, (char*)dst + offset) == MAP_FAILED) {
+        return false;
+    }
+    madvise(header->alias + offset, len, MADV_REMOVE);
+    return true;
 #else
-    return aligned_alloc(size, 4096);
+    (void)dst;
+    (void)src;
+    (void)offset;
+    (void)len;
+    return false;
 #endif
 }
 
 void free_exec(void* ptr) {
+    exec_header_t* header = exec_header(ptr);
+    char* alias = header->alias - EXEC_PAGE;
 #ifdef _MSC_VER
-    size_t* oldPtr = (size_t*)((char*)ptr - 4096);
-    VirtualFree(oldPtr, *oldPtr, MEM_RELEASE);
+    UnmapViewOfFile(header);
+    UnmapViewOfFile(alias);
 #else
-    free(ptr);
+    size_t total = header->size + EXEC_PAGE;
+    int fd = header->fd;
+    if (alias != (char*)header) {
+        munmap(alias, total);
+    }
+    munmap(header, total);
+    if (fd >= 0) {
+        close(fd);
+    }
 #endif
-}
\ No newline at end of file
+}
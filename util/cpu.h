@@ -0,0 +1,55 @@
+#ifndef NORLIT_LIB_UTIL_CPU_H
+#define NORLIT_LIB_UTIL_CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Instruction set extensions of the host CPU, detected once through cpuid.
+ * AVX features are only reported when the OS saves the wider registers.
+ * Every feature reads as absent on other architectures.
+ */
+enum {
+    CPU_SSE3 = 1 << 0,
+    CPU_SSSE3 = 1 << 1,
+    CPU_SSE41 = 1 << 2,
+    CPU_SSE42 = 1 << 3,
+    CPU_POPCNT = 1 << 4,
+    CPU_CX16 = 1 << 5,
+    CPU_LAHF = 1 << 6,
+    CPU_MOVBE = 1 << 7,
+    CPU_FMA = 1 << 8,
+    CPU_F16C = 1 << 9,
+    CPU_AVX = 1 << 10,
+    CPU_AVX2 = 1 << 11,
+    CPU_BMI1 = 1 << 12,
+    CPU_BMI2 = 1 << 13,
+    CPU_LZCNT = 1 << 14,
+    CPU_AVX512F = 1 << 15,
+    CPU_AVX512BW = 1 << 16,
+    CPU_AVX512CD = 1 << 17,
+    CPU_AVX512DQ = 1 << 18,
+    CPU_AVX512VL = 1 << 19
+};
+
+/* Feature sets of the x86-64 microarchitecture levels */
+#define CPU_X86_64_V2 (CPU_CX16 | CPU_LAHF | CPU_POPCNT | CPU_SSE3 | CPU_SSE41 | CPU_SSE42 | CPU_SSSE3)
+#define CPU_X86_64_V3 (CPU_X86_64_V2 | CPU_AVX | CPU_AVX2 | CPU_BMI1 | CPU_BMI2 | CPU_F16C | CPU_FMA | CPU_LZCNT | CPU_MOVBE)
+#define CPU_X86_64_V4 (CPU_X86_64_V3 | CPU_AVX512F | CPU_AVX512BW | CPU_AVX512CD | CPU_AVX512DQ | CPU_AVX512VL)
+
+uint32_t cpu_features(void);
+bool cpu_has(uint32_t features);
+
+/*
+ * Highest x86-64-vN level supported by the CPU: 1 for a baseline x86-64 CPU,
+ * 0 on other architectures.
+ */
+int cpu_level(void);
+
+/*
+ * Bytes xsave writes for the state components the OS enables (cpuid leaf
+ * 0xD), or 0 when xsave is unavailable or on other architectures.
+ */
+uint32_t cpu_xsaveSize(void);
+
+#endif
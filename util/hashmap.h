@@ -2,6 +2,7 @@
 #define NORLIT_LIB_UTIL_HASHMAP_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef int (*comparator_t)(const void *, const void *);
 typedef int (*hash_t)(const void *);
@@ -11,8 +12,27 @@ typedef struct {
     void *second;
 } pair_t;
 
+/*
+ * Operation counters of the calling thread, maintained by every hashmap.
+ * Work is attributed by taking a snapshot before and after it.
+ */
+typedef struct {
+    unsigned long long lookups;
+    unsigned long long probes;
+} hashmap_counters_t;
+
+/* Shape of a single hashmap */
+typedef struct {
+    int buckets;
+    int entries;
+    int maxChain;
+    size_t memory;
+} hashmap_info_t;
+
 int string_hash(const void *);
 int string_comparator(const void *, const void *);
+/* Hash of maps created by hashmap_new_string, picked for the host CPU */
+unsigned string_hash_len(const char *, size_t);
 hashmap_t *hashmap_new_string(int size);
 hashmap_t *hashmap_new(hash_t, comparator_t, int);
 void *hashmap_put(hashmap_t *, const void *, void *);
@@ -21,5 +41,7 @@ void *hashmap_remove(hashmap_t *, const void *);
 void hashmap_dispose(hashmap_t *);
 pair_t *hashmap_iterator(hashmap_t *hm);
 pair_t *hashmap_next(pair_t *it);
+void hashmap_counters(hashmap_counters_t *);
+void hashmap_info(hashmap_t *, hashmap_info_t *);
 
 #endif
\ No newline at end of file
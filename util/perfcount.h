@@ -0,0 +1,35 @@
+#ifndef NORLIT_LIB_UTIL_PERFCOUNT_H
+#define NORLIT_LIB_UTIL_PERFCOUNT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Hardware counters of the calling thread, read through perf_event_open.
+ * Every thread opens its own counters on its first read, so a delta must be
+ * taken between two reads on one thread. Buckets sum the deltas of all
+ * threads. Where perf events are unavailable every read yields zeros and
+ * perfcount_available returns false.
+ */
+enum {
+    PERFCOUNT_CYCLES,
+    PERFCOUNT_INSTRUCTIONS,
+    PERFCOUNT_LLC_MISSES,
+    PERFCOUNT_DTLB_MISSES,
+    PERFCOUNT_BRANCH_MISSES,
+    PERFCOUNT_EVENTS
+};
+
+#define PERFCOUNT_BUCKETS 32
+
+bool perfcount_available(void);
+void perfcount_read(uint64_t values[PERFCOUNT_EVENTS]);
+
+/* Buckets aggregate counter deltas under a name, which must stay valid */
+int perfcount_bucket(const char* name);
+void perfcount_account(int bucket, const uint64_t start[PERFCOUNT_EVENTS]);
+uint64_t perfcount_get(int bucket, uint64_t values[PERFCOUNT_EVENTS]);
+void perfcount_report(FILE* file);
+
+#endif